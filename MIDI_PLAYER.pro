@@ -2,8 +2,10 @@
 # Project created by QtCreator 2013-07-30T18:35:05
 # -------------------------------------------------
 #QT += multimedia
-QT += core gui
-greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+# Qt 5 APIs throughout: QSaveFile, QStandardPaths, QThread interruption,
+# QAtomicInt load/store, QWheelEvent::angleDelta() and others
+lessThan(QT_MAJOR_VERSION, 5): error("MIDI_PLAYER needs Qt 5 or later")
+QT += core gui widgets
 
 CONFIG += console
 
@@ -15,14 +17,44 @@ SOURCES += \
     main.cpp \
     player.cpp \
     file_parser.cpp \
+    rawmidi_player.cpp \
+    midi_index.cpp \
+    event_list.cpp \
+    mix.cpp \
+    loop.cpp \
+    reload.cpp \
+    notes.cpp \
+    control.cpp \
+    sync.cpp \
+    follow.cpp \
+    simulate.cpp \
+    playermanager.cpp \
+    library.cpp \
+    mixerdialog.cpp \
+    pianoroll.cpp \
     playerwindow.cpp
 
 HEADERS += \
     playerwindow.h \
-    player.h
+    player.h \
+    midi_index.h \
+    chunked_list.h \
+    arena.h \
+    event_list.h \
+    tempo_map.h \
+    song.h \
+    playermanager.h \
+    library.h \
+    mixerdialog.h \
+    pianoroll.h
 
 FORMS += midi_player.ui
 
+# make check: the seq engine on a virtual clock against the logs in tests/
+check.commands = sh $$PWD/tests/check.sh $$OUT_PWD/$$TARGET
+check.depends = $$TARGET
+QMAKE_EXTRA_TARGETS += check
+
 #DEFINES += QT_NO_DEBUG_OUTPUT
 
 LIBS += -lasound
@@ -0,0 +1,68 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <QtGlobal>
+#include <vector>
+#include <stdlib.h>
+
+// Monotonic bump allocator for everything a loaded song owns besides its
+// event list: SysEx payloads and the like.  Nothing is freed on its own;
+// clear() releases the whole song at once.
+class Arena
+{
+public:
+	explicit Arena( size_t block_size = 64 * 1024 )
+		: block_size(block_size), ptr(0), left(0), allocs(0), total(0) {}
+	~Arena() { clear(); }
+
+	void *alloc( size_t n ) {
+		if ( n > left )
+			return grow( n );
+		void *p = ptr;
+		ptr += n;
+		left -= n;
+		return p;
+	}
+
+	void clear() {
+		for ( size_t i = 0; i < blocks.size(); ++ i )
+			free( blocks[i] );
+		blocks.clear();
+		ptr = 0;
+		left = 0;
+	}
+
+	// for the load statistics; kept across clear()
+	qint64 allocations() const { return allocs; }
+	qint64 bytes() const { return total; }
+	void resetStats() { allocs = total = 0; }
+
+private:
+	Arena( const Arena & );
+	Arena &operator=( const Arena & );
+
+	void *grow( size_t n ) {
+		// big payloads get a block of their own, the current one stays open
+		size_t size = n > block_size / 4 ? n : block_size;
+		char *block = static_cast<char *>( malloc(size) );
+		if ( !block )
+			return 0;
+		blocks.push_back( block );
+		allocs ++;
+		total += size;
+		if ( size == n )
+			return block;
+		ptr = block + n;
+		left = size - n;
+		return block;
+	}
+
+	size_t block_size;
+	std::vector<char *> blocks;
+	char *ptr;		// free space in the current block
+	size_t left;
+	qint64 allocs;
+	qint64 total;
+};
+
+#endif // ARENA_H
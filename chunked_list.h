@@ -0,0 +1,102 @@
+#ifndef CHUNKED_LIST_H
+#define CHUNKED_LIST_H
+
+#include <QtGlobal>
+#include <vector>
+
+// Append-only storage in fixed size blocks.  Growing never copies or moves
+// what is already stored and no single allocation has to hold the whole
+// song, so tens of millions of events are fine.  Indexes are 64 bit.
+// Only the first block starts small and doubles up to BLOCK_SIZE, so a
+// short song does not hold a full block in every list.
+template <class T, int BLOCK_BITS = 16>
+class ChunkedList
+{
+public:
+	enum {
+		BLOCK_SIZE = 1 << BLOCK_BITS,
+		BLOCK_MASK = BLOCK_SIZE - 1,
+		FIRST_BLOCK = BLOCK_SIZE < 64 ? BLOCK_SIZE : 64
+	};
+
+	ChunkedList() : count(0), allocs(0) {}
+
+	qint64 size() const { return count; }
+	bool isEmpty() const { return !count; }
+
+	T &operator[]( qint64 i ) { return blocks[i >> BLOCK_BITS][i & BLOCK_MASK]; }
+	const T &operator[]( qint64 i ) const { return blocks[i >> BLOCK_BITS][i & BLOCK_MASK]; }
+	T &back() { return (*this)[count - 1]; }
+	const T &back() const { return (*this)[count - 1]; }
+
+	void push_back( const T &value ) {
+		if ( (count >> BLOCK_BITS) == static_cast<qint64>(blocks.size()) )
+			add_block( blocks.empty() ? FIRST_BLOCK : BLOCK_SIZE );
+		std::vector<T> &b = blocks[count >> BLOCK_BITS];
+		if ( b.size() == b.capacity() )
+			grow( b, 2 * b.size() );
+		b.push_back( value );
+		++ count;
+	}
+
+	// allocate the blocks for n elements up front
+	void reserve( qint64 n ) {
+		if ( !blocks.empty() )
+			grow( blocks.back(), n - (static_cast<qint64>(blocks.size() - 1) << BLOCK_BITS) );
+		while ( static_cast<qint64>(blocks.size()) << BLOCK_BITS < n )
+			add_block( n - (static_cast<qint64>(blocks.size()) << BLOCK_BITS) );
+	}
+
+	// whole blocks, for tight loops over the contents
+	int blockCount() const { return (count + BLOCK_MASK) >> BLOCK_BITS; }
+	const T *block( int b ) const { return &blocks[b][0]; }
+	int blockSize( int b ) const { return blocks[b].size(); }
+
+	// let block b go ahead of clear(), once nothing in it is read again;
+	// what it held is gone, only clear() is safe after the last of them
+	void freeBlock( int b ) { std::vector<T>().swap( blocks[b] ); }
+
+	void clear() {
+		std::vector< std::vector<T> >().swap( blocks );
+		count = 0;
+		allocs = 0;
+	}
+	void swap( ChunkedList &other ) {
+		blocks.swap( other.blocks );
+		qSwap( count, other.count );
+		qSwap( allocs, other.allocs );
+	}
+
+	// what the blocks take, room to grow included
+	qint64 bytes() const {
+		qint64 n = 0;
+		for ( size_t b = 0; b < blocks.size(); ++ b )
+			n += blocks[b].capacity();
+		return n * static_cast<qint64>(sizeof(T));
+	}
+
+	// blocks allocated since the last resetStats(), for the load statistics
+	qint64 allocations() const { return allocs; }
+	void resetStats() { allocs = 0; }
+
+private:
+	void add_block( qint64 n ) {
+		blocks.push_back( std::vector<T>() );
+		blocks.back().reserve( qMin(n, static_cast<qint64>(BLOCK_SIZE)) );
+		allocs ++;
+	}
+	// room for n in block b, never past BLOCK_SIZE
+	void grow( std::vector<T> &b, qint64 n ) {
+		n = qMin( n, static_cast<qint64>(BLOCK_SIZE) );
+		if ( n <= static_cast<qint64>(b.capacity()) )
+			return;
+		b.reserve( n );
+		allocs ++;
+	}
+
+	std::vector< std::vector<T> > blocks;
+	qint64 count;
+	qint64 allocs;
+};
+
+#endif // CHUNKED_LIST_H
@@ -0,0 +1,322 @@
+// control.cpp   -- part of MIDI_PLAYER
+// device resets and other setup as data: MIDI messages at set times from
+// the start of the sequence.  The seq side schedules them on a queue of
+// their own that always runs, in real time, so they go out paced to the
+// millisecond with no one waiting on them; the rawmidi engine writes them
+// at their times itself (see raw_control()).
+// A play from the start begins with a pre-roll: the chosen reset and the
+// setup the song has at tick 0 go out paced at the wire rate while the
+// engine queues the first lookahead, and only then does the song's queue
+// start.  The first notes are timed against Play and against their plan.
+// contains:
+//      resetSequence()
+//      sendSequence()
+//      queue_control()
+//      song_setup()
+//      send_preroll()
+//      start_queue()
+//      echo_note()
+//      read_echoes()
+//      time_note()
+//      report_start()
+//      tick_ns()
+
+#include "playerwindow.h"	// hack!
+#include "player.h"
+
+#include <poll.h>
+
+#define NSEC_PER_MSEC 1000000LL
+// wire time of one byte
+#define MIDI_NSEC_PER_BYTE (1000000000LL / MIDI_BYTES_PER_SEC)
+// what the device may take to act on a SysEx in the song's setup, and the
+// longest one sent ahead of the song rather than with it
+#define SETUP_SYSEX_GAP_MS 20
+#define SETUP_SYSEX_MAX 4096
+// how many of the first notes are timed
+#define TIMED_NOTES 8
+// pause between the messages of the MT-32 mode setup, and the wait after
+// a reset before the device takes anything else
+#define MT32_PACE_MS 10
+#define GM_SETTLE_MS 100
+#define GS_SETTLE_MS 50
+#define XG_SETTLE_MS 50
+
+static const unsigned char sysex_reset_GM[] = { 0xF0, 0x7E, 0x7F, 0x09, 0x01, 0xF7 };
+static const unsigned char sysex_reset_GS[] =
+	//{ 0xF0, 0x42, 0x12, 0x40, 0x00, 0x7F, 0x00, 0x41, 0xF7 };	// from GS_RESET.MID
+	{ 0xF0, 0x41, 0x10, 0x42, 0x12, 0x40, 0x00, 0x7F, 0x00, 0x41, 0xF7 };
+static const unsigned char sysex_reset_XG[] = { 0xF0, 0x43, 0x10, 0x4C, 0x00, 0x00, 0x7E, 0x00, 0xF7 };
+static const unsigned char sysex_mt32_p2[] = { 0xF0, 0x41, 0x10, 0x42, 0x12, 0x40, 0x10, 0x0E, 0x00, 0x22, 0xF7 };
+static const unsigned char sysex_mt32_p3[] = { 0xF0, 0x41, 0x10, 0x42, 0x12, 0x40, 0x01, 0x31, 0x00, 0x04, 0x35, 0x6A, 0x6B, 0xF7 };
+
+static void add_message( MidiPlayer::ControlSequence &s, int ms, const unsigned char *buf, int len )
+{
+	MidiPlayer::TimedMessage m;
+	m.ms = ms;
+	m.bytes = QByteArray( reinterpret_cast<const char *>(buf), len );
+	s << m;
+}
+
+// the message list of a reset; the last entry, with no bytes, is the wait
+// for the device to settle
+MidiPlayer::ControlSequence MidiPlayer::resetSequence( Reset r )
+{
+	ControlSequence s;
+	int ms = 0;
+	switch ( r ) {
+	case RESET_NONE:
+		return s;
+	case RESET_GM:
+		add_message( s, 0, sysex_reset_GM, sizeof(sysex_reset_GM) );
+		ms = GM_SETTLE_MS;
+		break;
+	case RESET_GS:
+		add_message( s, 0, sysex_reset_GS, sizeof(sysex_reset_GS) );
+		ms = GS_SETTLE_MS;
+		break;
+	case RESET_XG:
+		add_message( s, 0, sysex_reset_XG, sizeof(sysex_reset_XG) );
+		ms = XG_SETTLE_MS;
+		break;
+	case RESET_MT32:
+		// GS reset, the MT-32 bank and some reverb on the first ten
+		// channels, then the GS setup of the MT-32 mode
+		add_message( s, ms, sysex_reset_GS, sizeof(sysex_reset_GS) );
+		for ( unsigned i = 0; i < 10; i ++ ) {
+			ms += MT32_PACE_MS;
+			unsigned char bank[3] = { static_cast<unsigned char>(0xB0 | i), 0, 127 };
+			unsigned char reverb[3] = { static_cast<unsigned char>(0xB0 | i), 91, 64 };
+			add_message( s, ms, bank, sizeof(bank) );
+			add_message( s, ms, reverb, sizeof(reverb) );
+		}
+		for ( unsigned i = 0; i < 10; i ++ ) {
+			ms += MT32_PACE_MS;
+			unsigned char sysex_mt32_p1[] = { 0xF0, 0x41, 0x10, 0x42, 0x12, 0x40,
+											  static_cast<unsigned char>(0x20 + i), 0x04, 0x04,
+											  static_cast<unsigned char>(0x18 - i), 0xF7 };
+			add_message( s, ms, sysex_mt32_p1, sizeof(sysex_mt32_p1) );
+		}
+		ms += MT32_PACE_MS;
+		add_message( s, ms, sysex_mt32_p2, sizeof(sysex_mt32_p2) );
+		ms += MT32_PACE_MS;
+		add_message( s, ms, sysex_mt32_p3, sizeof(sysex_mt32_p3) );
+		ms += GS_SETTLE_MS;
+		break;
+	}
+	add_message( s, ms, NULL, 0 );
+	return s;
+}	// end resetSequence
+
+// Send s from now on, without waiting for any of it.  The engine thread
+// owns the sequencer while it plays, so this is for a stopped or paused
+// player only: false if it is playing.
+bool MidiPlayer::sendSequence( const ControlSequence &s )
+{
+	if ( isRunning() || !seq || ctl_queue < 0 )
+		return false;
+	connect_port();
+	int ms = queue_control( s );
+	int err = snd_seq_drain_output(seq);
+	check_snd("drain output", err);
+	qDebug() << "Queued" << s.size() << "control messages over" << ms << "ms";
+	return true;
+}
+
+// s on the control queue, real time from now; returns its length in ms
+int MidiPlayer::queue_control( const ControlSequence &s )
+{
+	snd_midi_event_t *coder;
+	int err = snd_midi_event_new( 16, &coder );
+	check_snd("create MIDI encoder", err);
+	if ( err < 0 )
+		return 0;
+	int ms = 0;
+	for ( int n = 0; n < s.size(); ++ n ) {
+		const TimedMessage &m = s[n];
+		ms = qMax( ms, m.ms );
+		if ( m.bytes.isEmpty() )
+			continue;
+		snd_seq_event_t ev;
+		snd_seq_ev_clear(&ev);
+		if ( static_cast<unsigned char>(m.bytes[0]) == 0xF0 )
+			snd_seq_ev_set_sysex(&ev, m.bytes.size(), const_cast<char *>(m.bytes.constData()));
+		else {
+			snd_midi_event_reset_encode( coder );
+			if ( snd_midi_event_encode(coder, reinterpret_cast<const unsigned char *>(m.bytes.constData()), m.bytes.size(), &ev) <= 0
+				 || ev.type == SND_SEQ_EVENT_NONE )
+				continue;
+		}
+		snd_seq_real_time_t at;
+		at.tv_sec = m.ms / 1000;
+		at.tv_nsec = (m.ms % 1000) * NSEC_PER_MSEC;
+		snd_seq_ev_schedule_real(&ev, ctl_queue, 1, &at);
+		ev.dest = port;
+		err = snd_seq_event_output(seq, &ev);
+		check_snd("output event", err);
+	}
+	snd_midi_event_free( coder );
+	return ms;
+}	// end queue_control
+
+// the song's setup, for the pre-roll: the controllers, programs, bends and
+// SysEx at tick 0 ahead of the first note, appended to out from ms on at
+// the wire rate.  Tempo events are passed over, they stay with the queue.
+// Returns the index of the first compiled event not taken.
+qint64 MidiPlayer::song_setup( const Song &s, ControlSequence &out, int ms )
+{
+	qint64 ns = static_cast<qint64>(ms) * NSEC_PER_MSEC;
+	qint64 i;
+	EventList::Reader events;
+	events.reset( &s.compiled );
+	for ( i = 0; i < s.compiled.size(); ++ i ) {
+		const snd_seq_event_t &ev = events[i];
+		if ( ev.time.tick > 0 )
+			break;
+		unsigned char msg[3];
+		int len = EventList::message( ev, msg );
+		const char *bytes = reinterpret_cast<const char *>( msg );
+		if ( ev.type == SND_SEQ_EVENT_SYSEX ) {
+			len = ev.data.ext.len;
+			bytes = static_cast<const char *>( ev.data.ext.ptr );
+		}
+		bool take = false;
+		switch ( ev.type ) {
+		case SND_SEQ_EVENT_TEMPO:
+			continue;
+		case SND_SEQ_EVENT_CONTROLLER:
+		case SND_SEQ_EVENT_PGMCHANGE:
+		case SND_SEQ_EVENT_PITCHBEND:
+		case SND_SEQ_EVENT_CHANPRESS:
+			take = true;
+			break;
+		case SND_SEQ_EVENT_SYSEX:
+			take = len > 0 && len <= SETUP_SYSEX_MAX && static_cast<unsigned char>(bytes[0]) == 0xF0;
+			break;
+		}
+		if ( !take )
+			break;
+		TimedMessage m;
+		m.ms = (ns + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+		m.bytes = QByteArray( bytes, len );
+		out << m;
+		ns += len * MIDI_NSEC_PER_BYTE;
+		if ( ev.type == SND_SEQ_EVENT_SYSEX )
+			ns += SETUP_SYSEX_GAP_MS * NSEC_PER_MSEC;
+	}
+	if ( !out.isEmpty() ) {
+		// the wait for the last of it to go out
+		TimedMessage end;
+		end.ms = qMax( out.last().ms, static_cast<int>((ns + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC) );
+		out << end;
+	}
+	return i;
+}	// end song_setup
+
+// seq engine, Play from the start: the pre-roll on the control queue, with
+// the song's queue stopped at tick 0 until start_queue()
+void MidiPlayer::send_preroll()
+{
+	snd_seq_drop_input(seq);	// echoes of the last play
+	snd_seq_get_queue_status(seq, ctl_queue, status);
+	const snd_seq_real_time_t *now = snd_seq_queue_status_get_real_time(status);
+	pre.play_ns = static_cast<qint64>(now->tv_sec) * 1000000000LL + now->tv_nsec;
+	ControlSequence s = resetSequence( preroll_reset );
+	int reset_ms = s.isEmpty() ? 0 : s.last().ms;
+	pre.end = song_setup( *song, s, reset_ms );
+	int ms = queue_control( s );
+	pre.start_ns = pre.play_ns + ms * NSEC_PER_MSEC;
+	pre.start_pending = true;
+	pre.timing = true;
+	pre.echoes = TIMED_NOTES;
+	pre.timed = 0;
+	int err = snd_seq_drain_output(seq);
+	check_snd("drain output", err);
+	qDebug() << "Pre-roll:" << s.size() << "messages," << pre.end << "events of the song, over" << ms << "ms";
+}	// end preroll
+
+// start the song's queue when the pre-roll is through; from the seq engine
+// once it has queued the first lookahead
+void MidiPlayer::start_queue()
+{
+	snd_seq_event_t ev;
+	snd_seq_ev_clear(&ev);
+	ev.type = SND_SEQ_EVENT_START;
+	ev.dest.client = SND_SEQ_CLIENT_SYSTEM;
+	ev.dest.port = SND_SEQ_PORT_SYSTEM_TIMER;
+	ev.data.queue.queue = queue;
+	snd_seq_real_time_t at;
+	at.tv_sec = pre.start_ns / 1000000000LL;
+	at.tv_nsec = pre.start_ns % 1000000000LL;
+	snd_seq_ev_schedule_real(&ev, ctl_queue, 0, &at);
+	int err = snd_seq_event_output(seq, &ev);
+	check_snd("output event", err);
+	err = snd_seq_drain_output(seq);
+	check_snd("drain output", err);
+	pre.start_pending = false;
+}	// end start_queue
+
+// one of the first notes, at queue tick: an echo back to us at the same
+// time, which the port stamps with the control queue's clock on arrival
+void MidiPlayer::echo_note( unsigned tick )
+{
+	snd_seq_event_t ev;
+	snd_seq_ev_clear(&ev);
+	ev.type = SND_SEQ_EVENT_ECHO;
+	snd_seq_ev_schedule_tick(&ev, queue, 0, tick);
+	ev.dest.client = snd_seq_client_id(seq);
+	ev.dest.port = 0;
+	ev.data.raw32.d[0] = tick;
+	int err = snd_seq_event_output(seq, &ev);
+	check_snd("output event", err);
+	pre.echoes --;
+}
+
+// the echoes that are back, without waiting for any
+void MidiPlayer::read_echoes()
+{
+	struct pollfd pfd;
+	if ( snd_seq_poll_descriptors(seq, &pfd, 1, POLLIN) != 1 )
+		return;
+	while ( snd_seq_event_input_pending(seq, 0) > 0 || poll(&pfd, 1, 0) > 0 ) {
+		snd_seq_event_t *ev;
+		if ( snd_seq_event_input(seq, &ev) < 0 )
+			break;
+		if ( ev->type != SND_SEQ_EVENT_ECHO || !pre.timing )
+			continue;
+		qint64 arrival = static_cast<qint64>(ev->time.time.tv_sec) * 1000000000LL + ev->time.time.tv_nsec;
+		time_note( arrival, pre.start_ns + tick_ns(ev->data.raw32.d[0]) );
+	}
+}
+
+// one of the first notes went out at 'at', planned for 'due', both on the
+// clock of pre.play_ns
+void MidiPlayer::time_note( qint64 at, qint64 due )
+{
+	if ( !pre.timed ) {
+		pre.first_ns = at;
+		pre.late_sum = pre.late_max = 0;
+	}
+	pre.late_sum += at - due;
+	pre.late_max = qMax( pre.late_max, at - due );
+	if ( ++ pre.timed == TIMED_NOTES )
+		report_start();
+}
+
+// how soon the song was heard after Play, and how well its first notes kept time
+void MidiPlayer::report_start()
+{
+	if ( !pre.timing )
+		return;
+	pre.timing = false;
+	if ( !pre.timed )
+		return;
+	qDebug() << "First note" << (pre.first_ns - pre.play_ns) / 1000 << "us after Play; the first" << pre.timed
+			 << "notes late by" << pre.late_sum / pre.timed / 1000 << "us on average," << pre.late_max / 1000 << "us at most";
+}
+
+// song time of tick from the start, at the current speed
+qint64 MidiPlayer::tick_ns( qint64 tick )
+{
+	return play_song->tempo_map.ns( tick ) * SKEW_BASE / speed_skew.load();
+}
@@ -0,0 +1,323 @@
+// event_list.cpp   -- part of MIDI_PLAYER
+// the compiled events of a song, expanded or packed.  Packed, each event
+// is the delta from the tick before it as a variable length number, then
+// its message: a channel message in running status, 0xF0 with the length
+// and the address of a SysEx payload (which stays in the song arena), 0xFF
+// with the three bytes of a tempo.  An event of another track than the one
+// before has PACK_TRACK and the track ahead of its message.  Every
+// PACK_BLOCK events a block starts afresh, its first tick and track and
+// where it starts in the index, so a block decodes on its own.
+// contains:
+//      find_tick()
+//      clear()
+//      startPacked()
+//      pack()
+//      encode()
+//      bytes()
+//      message()
+//      start()
+//      decode()
+//      seek()
+//      Reader::load()
+
+#include "event_list.h"
+
+#include <QElapsedTimer>
+#include <string.h>
+#include <limits.h>
+
+// marks the track of the event, undefined as a MIDI status
+#define PACK_TRACK 0xF9
+// an event of no other kind: its type follows
+#define PACK_OTHER 0xF4
+
+static void put_var( QByteArray &out, quint64 v )
+{
+	unsigned char buf[10];
+	int n = sizeof(buf);
+	buf[--n] = v & 0x7F;
+	while ( v >>= 7 )
+		buf[--n] = 0x80 | (v & 0x7F);
+	out.append( reinterpret_cast<const char *>(buf + n), sizeof(buf) - n );
+}
+
+static quint64 get_var( const unsigned char *&p )
+{
+	quint64 v = 0;
+	unsigned char c;
+	do {
+		c = *p++;
+		v = v << 7 | (c & 0x7F);
+	} while ( c & 0x80 );
+	return v;
+}
+
+qint64 EventList::find_tick( qint64 tick ) const
+{
+	if ( !is_packed ) {
+		qint64 lo = 0, hi = count;
+		while ( lo < hi ) {
+			qint64 mid = lo + (hi - lo) / 2;
+			if ( events[mid].time.tick < tick )
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return lo;
+	}
+	// the last block starting before tick has it, or it is the next one's first
+	qint64 lo = 0, hi = index.size();
+	while ( lo < hi ) {
+		qint64 mid = lo + (hi - lo) / 2;
+		if ( index[mid].tick < tick )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if ( lo == 0 )
+		return 0;
+	qint64 i = (lo - 1) * PACK_BLOCK;
+	qint64 end = qMin( count, lo * PACK_BLOCK );
+	State st;
+	start( lo - 1, st );
+	for ( ; i < end; ++ i ) {
+		snd_seq_event_t ev;
+		decode( st, ev );
+		if ( ev.time.tick >= tick )
+			break;
+	}
+	return i;
+}	// end find_tick
+
+void EventList::clear()
+{
+	events.clear();
+	tracks.clear();
+	stream.clear();
+	index.clear();
+	count = 0;
+	is_packed = false;
+}
+
+void EventList::startPacked()
+{
+	clear();
+	is_packed = true;
+}
+
+void EventList::pack()
+{
+	if ( is_packed ) {
+		stream.squeeze();
+		index.squeeze();
+		return;
+	}
+	stream.clear();
+	index.clear();
+	stream.reserve( qMin(count * 4, static_cast<qint64>(INT_MAX / 2)) );
+	const qint64 block = ChunkedList<quint16>::BLOCK_SIZE;	// of both expanded lists
+	for ( qint64 i = 0; i < count; ++ i ) {
+		encode( i, events[i], tracks[i] );
+		if ( (i + 1) % block == 0 ) {
+			events.freeBlock( i / block );
+			tracks.freeBlock( i / block );
+		}
+	}
+	stream.squeeze();
+	index.squeeze();
+	events.clear();
+	tracks.clear();
+	is_packed = true;
+}	// end pack
+
+// append event i to the stream
+void EventList::encode( qint64 i, const snd_seq_event_t &ev, unsigned track )
+{
+	if ( i % PACK_BLOCK == 0 ) {
+		Block b;
+		b.tick = ev.time.tick;
+		b.offset = stream.size();
+		b.track = track;
+		index.push_back( b );
+		pack_tick = ev.time.tick;
+		pack_track = track;
+		pack_running = 0;
+	}
+	put_var( stream, ev.time.tick - pack_tick );
+	pack_tick = ev.time.tick;
+	if ( track != pack_track ) {
+		stream.append( static_cast<char>(PACK_TRACK) );
+		put_var( stream, track );
+		pack_track = track;
+	}
+	unsigned char msg[3];
+	int len = message( ev, msg );
+	if ( len ) {
+		int skip = msg[0] == pack_running;
+		stream.append( reinterpret_cast<const char *>(msg + skip), len - skip );
+		pack_running = msg[0];
+	} else if ( ev.type == SND_SEQ_EVENT_SYSEX ) {
+		stream.append( static_cast<char>(0xF0) );
+		put_var( stream, ev.data.ext.len );
+		const void *ptr = ev.data.ext.ptr;
+		stream.append( reinterpret_cast<const char *>(&ptr), sizeof(ptr) );
+	} else if ( ev.type == SND_SEQ_EVENT_TEMPO ) {
+		unsigned tempo = ev.data.queue.param.value;
+		stream.append( static_cast<char>(0xFF) );
+		stream.append( static_cast<char>(tempo >> 16) );
+		stream.append( static_cast<char>(tempo >> 8) );
+		stream.append( static_cast<char>(tempo) );
+	} else {
+		stream.append( static_cast<char>(PACK_OTHER) );
+		stream.append( static_cast<char>(ev.type) );
+	}
+}	// end encode
+
+qint64 EventList::bytes() const
+{
+	if ( !is_packed )
+		return count * static_cast<qint64>(sizeof(snd_seq_event_t) + sizeof(quint16));
+	return stream.size() + index.size() * static_cast<qint64>(sizeof(Block));
+}
+
+int EventList::message( const snd_seq_event_t &ev, unsigned char *out )
+{
+	const snd_seq_ev_ctrl_t &c = ev.data.control;
+	switch ( ev.type ) {
+	case SND_SEQ_EVENT_NOTEOFF:
+	case SND_SEQ_EVENT_NOTEON:
+	case SND_SEQ_EVENT_KEYPRESS:
+		out[0] = (ev.type == SND_SEQ_EVENT_NOTEOFF ? 0x80 : ev.type == SND_SEQ_EVENT_NOTEON ? 0x90 : 0xA0) |
+				 ev.data.note.channel;
+		out[1] = ev.data.note.note;
+		out[2] = ev.data.note.velocity;
+		return 3;
+	case SND_SEQ_EVENT_CONTROLLER:
+		out[0] = 0xB0 | c.channel;
+		out[1] = c.param;
+		out[2] = c.value;
+		return 3;
+	case SND_SEQ_EVENT_PGMCHANGE:
+	case SND_SEQ_EVENT_CHANPRESS:
+		out[0] = (ev.type == SND_SEQ_EVENT_PGMCHANGE ? 0xC0 : 0xD0) | c.channel;
+		out[1] = c.value;
+		return 2;
+	case SND_SEQ_EVENT_PITCHBEND:
+		out[0] = 0xE0 | c.channel;
+		out[1] = (c.value + 0x2000) & 0x7F;
+		out[2] = ((c.value + 0x2000) >> 7) & 0x7F;
+		return 3;
+	}
+	return 0;
+}	// end message
+
+void EventList::start( qint64 b, State &st ) const
+{
+	const Block &block = index[b];
+	st.p = reinterpret_cast<const unsigned char *>( stream.constData() ) + block.offset;
+	st.tick = block.tick;
+	st.track = block.track;
+	st.running = 0;
+}
+
+// the next event of a block, as MidiPlayer::compile_event() makes it
+void EventList::decode( State &st, snd_seq_event_t &ev )
+{
+	const unsigned char *&p = st.p;
+	st.tick += get_var( p );
+	if ( *p == PACK_TRACK ) {
+		++ p;
+		st.track = get_var( p );
+	}
+	snd_seq_ev_clear(&ev);
+	ev.flags = SND_SEQ_TIME_STAMP_TICK;
+	ev.time.tick = st.tick;
+	unsigned char status = *p;
+	if ( status & 0x80 )
+		++ p;
+	switch ( status ) {
+	case 0xF0: {
+		unsigned len = get_var( p );
+		void *ptr;
+		memcpy( &ptr, p, sizeof(ptr) );
+		p += sizeof(ptr);
+		ev.type = SND_SEQ_EVENT_SYSEX;
+		snd_seq_ev_set_variable(&ev, len, ptr);
+		return;
+	}
+	case 0xFF:
+		ev.type = SND_SEQ_EVENT_TEMPO;
+		snd_seq_ev_set_fixed(&ev);
+		ev.dest.client = SND_SEQ_CLIENT_SYSTEM;
+		ev.dest.port = SND_SEQ_PORT_SYSTEM_TIMER;
+		ev.data.queue.param.value = p[0] << 16 | p[1] << 8 | p[2];
+		p += 3;
+		return;
+	case PACK_OTHER:
+		ev.type = *p++;
+		return;
+	}
+	if ( status & 0x80 )
+		st.running = status;
+	else
+		status = st.running;
+	unsigned ch = status & 0xF;
+	snd_seq_ev_set_fixed(&ev);
+	switch ( status & 0xF0 ) {
+	case 0x80:
+	case 0x90:
+	case 0xA0:
+		ev.type = (status & 0xF0) == 0x80 ? SND_SEQ_EVENT_NOTEOFF :
+				  (status & 0xF0) == 0x90 ? SND_SEQ_EVENT_NOTEON : SND_SEQ_EVENT_KEYPRESS;
+		ev.data.note.channel = ch;
+		ev.data.note.note = p[0];
+		ev.data.note.velocity = p[1];
+		p += 2;
+		break;
+	case 0xB0:
+		ev.type = SND_SEQ_EVENT_CONTROLLER;
+		ev.data.control.channel = ch;
+		ev.data.control.param = p[0];
+		ev.data.control.value = p[1];
+		p += 2;
+		break;
+	case 0xC0:
+	case 0xD0:
+		ev.type = (status & 0xF0) == 0xC0 ? SND_SEQ_EVENT_PGMCHANGE : SND_SEQ_EVENT_CHANPRESS;
+		ev.data.control.channel = ch;
+		ev.data.control.value = p[0];
+		p += 1;
+		break;
+	default:
+		ev.type = SND_SEQ_EVENT_PITCHBEND;
+		ev.data.control.channel = ch;
+		ev.data.control.value = (p[0] | p[1] << 7) - 0x2000;
+		p += 2;
+		break;
+	}
+}	// end decode
+
+void EventList::seek( qint64 i, snd_seq_event_t &ev, unsigned &track ) const
+{
+	State st;
+	start( i / PACK_BLOCK, st );
+	for ( qint64 n = i % PACK_BLOCK; n >= 0; -- n )
+		decode( st, ev );
+	track = st.track;
+}
+
+void EventList::Reader::load( qint64 b )
+{
+	QElapsedTimer timer;
+	timer.start();
+	State st;
+	list->start( b, st );
+	int n = qMin( static_cast<qint64>(PACK_BLOCK), list->count - b * PACK_BLOCK );
+	for ( int k = 0; k < n; ++ k ) {
+		decode( st, buf[k] );
+		buf_track[k] = st.track;
+	}
+	block = b;
+	blocks ++;
+	decode_ns += timer.nsecsElapsed();
+}
@@ -0,0 +1,154 @@
+#ifndef EVENT_LIST_H
+#define EVENT_LIST_H
+
+#include <QtGlobal>
+#include <QByteArray>
+#include <QVector>
+
+#include <alsa/asoundlib.h>
+
+#include "chunked_list.h"
+
+// The compiled events of a song in tick order, with the track of each.
+// They are built expanded, a snd_seq_event_t apiece, and may be packed
+// once complete, or built packed from the start: a byte stream of tick
+// deltas and MIDI messages in running status, a few bytes an event, with
+// an index entry every PACK_BLOCK events for random access.  Reading is the same either way, operator[]
+// for the odd event and a Reader for runs of them; see event_list.cpp.
+class EventList
+{
+public:
+	enum { PACK_BLOCK = 128 };
+
+	EventList() : pack_tick(0), pack_track(0), pack_running(0), count(0), is_packed(false) {}
+
+	qint64 size() const { return count; }
+	bool isEmpty() const { return !count; }
+	bool packed() const { return is_packed; }
+
+	// packed, each of these decodes from the start of the block
+	snd_seq_event_t operator[]( qint64 i ) const {
+		if ( !is_packed )
+			return events[i];
+		snd_seq_event_t ev;
+		unsigned track;
+		seek( i, ev, track );
+		return ev;
+	}
+	snd_seq_event_t back() const { return (*this)[count - 1]; }
+	unsigned track( qint64 i ) const {
+		if ( !is_packed )
+			return tracks[i];
+		snd_seq_event_t ev;
+		unsigned track;
+		seek( i, ev, track );
+		return track;
+	}
+	// index of the first event at or after tick
+	qint64 find_tick( qint64 tick ) const;
+
+	// building; packed after startPacked(), the event goes straight into
+	// the stream
+	void push_back( const snd_seq_event_t &ev, unsigned track ) {
+		if ( is_packed ) {
+			encode( count, ev, track );
+		} else {
+			events.push_back( ev );
+			tracks.push_back( track );
+		}
+		++ count;
+	}
+	void reserve( qint64 n ) {
+		events.reserve( n );
+		tracks.reserve( n );
+	}
+	void clear();
+	qint64 allocations() const { return events.allocations() + tracks.allocations(); }
+	void resetStats() {
+		events.resetStats();
+		tracks.resetStats();
+	}
+
+	// empty the list and build it packed from now on, so the expanded
+	// events are never held; pack() when done
+	void startPacked();
+	// replace the expanded events by the stream, a block of them freed as
+	// soon as it is packed; a list built packed is only trimmed
+	void pack();
+	// what the events take now
+	qint64 bytes() const;
+
+	// channel message of ev, full status, into out; its length, 0 if ev
+	// is none
+	static int message( const snd_seq_event_t &ev, unsigned char *out );
+
+	// Runs of events, forwards or backwards, a block decoded at a time.
+	// A reference it returns holds until it is asked for another block.
+	// reset() it before use, and whenever the list it reads goes.
+	class Reader
+	{
+	public:
+		void reset( const EventList *list ) {
+			this->list = list;
+			block = -1;
+			blocks = decode_ns = 0;
+		}
+		const snd_seq_event_t &operator[]( qint64 i ) {
+			if ( !list->is_packed )
+				return list->events[i];
+			if ( i / PACK_BLOCK != block )
+				load( i / PACK_BLOCK );
+			return buf[i % PACK_BLOCK];
+		}
+		unsigned track( qint64 i ) {
+			if ( !list->is_packed )
+				return list->tracks[i];
+			if ( i / PACK_BLOCK != block )
+				load( i / PACK_BLOCK );
+			return buf_track[i % PACK_BLOCK];
+		}
+		// blocks decoded since reset(), and the time it took
+		qint64 blocks, decode_ns;
+
+	private:
+		void load( qint64 b );
+		const EventList *list;
+		qint64 block;
+		snd_seq_event_t buf[PACK_BLOCK];
+		quint16 buf_track[PACK_BLOCK];
+	};
+
+private:
+	EventList( const EventList & );
+	EventList &operator=( const EventList & );
+
+	// where each block of the stream starts, and what it starts with
+	struct Block {
+		qint64 tick;			// of its first event
+		int offset;			// in stream
+		quint16 track;			// of its first event
+	};
+	// where decoding a block stands
+	struct State {
+		const unsigned char *p;
+		qint64 tick;
+		unsigned track;
+		unsigned char running;
+	};
+	void encode( qint64 i, const snd_seq_event_t &ev, unsigned track );
+	void start( qint64 b, State &st ) const;
+	static void decode( State &st, snd_seq_event_t &ev );
+	void seek( qint64 i, snd_seq_event_t &ev, unsigned &track ) const;
+
+	ChunkedList<snd_seq_event_t> events;	// expanded
+	ChunkedList<quint16> tracks;
+	QByteArray stream;			// packed
+	QVector<Block> index;
+	qint64 pack_tick;			// where encode() stands
+	unsigned pack_track;
+	unsigned char pack_running;
+	qint64 count;
+	bool is_packed;
+};
+
+#endif // EVENT_LIST_H
@@ -1,33 +1,67 @@
 #include "playerwindow.h" // hack
 #include "player.h"
 #include "ui_midi_player.h"
+#include "midi_index.h"
 #include <alsa/asoundlib.h>
 #include <algorithm>
 #include <iostream>
+#include <limits.h>
+#include <QFile>
+#include <QElapsedTimer>
+#include <QMutexLocker>
 
-#define MAKE_ID(c1, c2, c3, c4) ((c1) | ((c2) << 8) | ((c3) << 16) | ((c4) << 24))
+// decoder tables, indexed by status byte
+enum {
+	ST_CHANNEL = 0x01,	// channel voice message, data bytes follow
+	ST_SYSEX = 0x02,	// 0xF0 / 0xF7, length-prefixed payload
+	ST_META = 0x04		// 0xFF, type byte and length-prefixed payload
+};
+struct status_info {
+	unsigned char type;	// SND_SEQ_EVENT_xxx
+	unsigned char len;	// data bytes of a channel message
+	unsigned char flags;	// ST_xxx, 0 = invalid status
+};
+#define ST_ROW(type, len) \
+	{ type, len, ST_CHANNEL }, { type, len, ST_CHANNEL }, { type, len, ST_CHANNEL }, { type, len, ST_CHANNEL }, \
+	{ type, len, ST_CHANNEL }, { type, len, ST_CHANNEL }, { type, len, ST_CHANNEL }, { type, len, ST_CHANNEL }, \
+	{ type, len, ST_CHANNEL }, { type, len, ST_CHANNEL }, { type, len, ST_CHANNEL }, { type, len, ST_CHANNEL }, \
+	{ type, len, ST_CHANNEL }, { type, len, ST_CHANNEL }, { type, len, ST_CHANNEL }, { type, len, ST_CHANNEL }
+#define ST_NONE { 0, 0, 0 }
+#define ST_NONE16 ST_NONE, ST_NONE, ST_NONE, ST_NONE, ST_NONE, ST_NONE, ST_NONE, ST_NONE, \
+	ST_NONE, ST_NONE, ST_NONE, ST_NONE, ST_NONE, ST_NONE, ST_NONE, ST_NONE
+static const struct status_info status_table[0x100] = {
+	ST_NONE16, ST_NONE16, ST_NONE16, ST_NONE16,	// 0x00-0x7f are data bytes
+	ST_NONE16, ST_NONE16, ST_NONE16, ST_NONE16,
+	ST_ROW(SND_SEQ_EVENT_NOTEOFF, 2),		// 0x8n
+	ST_ROW(SND_SEQ_EVENT_NOTEON, 2),		// 0x9n
+	ST_ROW(SND_SEQ_EVENT_KEYPRESS, 2),		// 0xAn
+	ST_ROW(SND_SEQ_EVENT_CONTROLLER, 2),		// 0xBn
+	ST_ROW(SND_SEQ_EVENT_PGMCHANGE, 1),		// 0xCn
+	ST_ROW(SND_SEQ_EVENT_CHANPRESS, 1),		// 0xDn
+	ST_ROW(SND_SEQ_EVENT_PITCHBEND, 2),		// 0xEn
+	{ SND_SEQ_EVENT_SYSEX, 0, ST_SYSEX },		// 0xF0
+	ST_NONE, ST_NONE, ST_NONE, ST_NONE, ST_NONE, ST_NONE,
+	{ SND_SEQ_EVENT_SYSEX, 0, ST_SYSEX },		// 0xF7
+	ST_NONE, ST_NONE, ST_NONE, ST_NONE, ST_NONE, ST_NONE, ST_NONE,
+	{ SND_SEQ_EVENT_NONE, 0, ST_META }		// 0xFF
+};
+#undef ST_ROW
+#undef ST_NONE
+#undef ST_NONE16
 
-int smpte_timing;
-int prev_tick;
-
-int MidiPlayer::read_32_le(void) {
-	int value = read_byte();
-	value |= read_byte() << 8;
-	value |= read_byte() << 16;
-	value |= read_byte() << 24;
-	return !feof(file) ? value : -1;
-}
-int MidiPlayer::read_int(int bytes) {
-	int value = 0;
-	do {
-		int c = read_byte();
-		if (c == EOF)
-			return -1;
-		value = (value << 8) | c;
-	} while (--bytes);
-	return value;
-}
 int MidiPlayer::read_var(void) {
+	// fast path: most quantities are 1 or 2 bytes and fully inside the image
+	if (file_offset + 2 <= file_size) {
+		const unsigned char *p = file_data + file_offset;
+		if (!(p[0] & 0x80)) {
+			file_offset += 1;
+			return p[0];
+		}
+		if (!(p[1] & 0x80)) {
+			file_offset += 2;
+			return ((p[0] & 0x7f) << 7) | p[1];
+		}
+	}
 	int c = read_byte();
 	int value = c & 0x7f;
 	if (c & 0x80) {
@@ -44,69 +78,17 @@ int MidiPlayer::read_var(void) {
 			}
 		}
 	}
-	return !feof(file) ? value : -1;
+	return !at_eof() ? value : -1;
 }   // end read_var
 
 // start of data reading functions
-int MidiPlayer::read_riff(QString &file_name) {
-	// skip file length
-	read_byte();
-	read_byte();
-	read_byte();
-	read_byte();
-	// check file type ("RMID" = RIFF MIDI)
-	if ( read_id() != MAKE_ID('R', 'M', 'I', 'D') )
-		goto invalid_format;
-	// search for "data" chunk
-	for (;;) {
-		int id = read_id();
-		int len = read_32_le();
-		if ( feof(file) )
-			goto data_not_found;
-		if ( id == MAKE_ID('d', 'a', 't', 'a') )
-			break;
-		if ( len < 0 )
-			goto data_not_found;
-		skip((len + 1) & ~1);
-	}
-	// the "data" chunk must contain data in SMF format
-	if ( read_id() != MAKE_ID('M', 'T', 'h', 'd') )
-		goto invalid_format;
-	return read_smf(file_name);
-
-invalid_format:
-	QMessageBox::critical(m_parent, "MIDI Player", QString("%1: invalid file format") .arg(file_name));
-	return 0;
-
-data_not_found:
-	QMessageBox::critical(m_parent, "MIDI Player", QString("%1: data chunk not found") .arg(file_name));
-	return 0;
-}   // end read_riff
-
-int MidiPlayer::read_smf(QString &file_name) {
-	int header_len, type, num_tracks, time_division;
-	int err;
+int MidiPlayer::read_smf(QString &file_name, const MidiIndex &index) {
+	int num_tracks, time_division;
 	// read midi data into memory, parsing it into events
-	// the starting position is immediately after the "MThd" id
-	header_len = read_int(4);   // header length
-	if ( header_len < 6 )
-		goto invalid_format;
-
-	type = read_int(2);     // midi type 0 or 1
-	if ( (type != 0) && (type != 1) ) {
-		QMessageBox::critical(m_parent, "MIDI Player", QString("%1: type %2 format is not supported") .arg(file_name) .arg(type));
-		return 0;
-	}
-	num_tracks = read_int(2);       // number of tracks
-	if ( (num_tracks < 1) || (num_tracks > 1000) ) {
-		QMessageBox::critical(m_parent, "MIDI Player", QString("%1: invalid number of tracks (%2)") .arg(file_name) .arg(num_tracks));
-		num_tracks = 0;
-		return 0;
-	}
-	time_division = read_int(2);    // time division
+	// the chunk structure has already been checked by the index
+	num_tracks = index.num_tracks;
+	time_division = index.time_division;
 	qDebug() << "time_division/ppq: " << time_division;
-	if ( time_division < 0 )
-		goto invalid_format;
 	// interpret and set tempo
 	snd_seq_queue_tempo_t *queue_tempo;
 	snd_seq_queue_tempo_alloca(&queue_tempo);
@@ -139,80 +121,198 @@ int MidiPlayer::read_smf(QString &file_name) {
 			snd_seq_queue_tempo_set_ppq(queue_tempo, 15 * time_division);
 			break;
 		default:
-			QMessageBox::critical(m_parent, "MIDI Player", QString("%1: invalid number of SMPTE frames per second (%2)") .arg(file_name) .arg(i));
+			parse_error( QString("%1: invalid number of SMPTE frames per second (%2)") .arg(file_name) .arg(i) );
 			return 0;
 		}
 	}
-	err = snd_seq_set_queue_tempo(seq, queue, queue_tempo);
-	if ( err < 0 ) {
-		QMessageBox::critical(m_parent, "MIDI Player", QString("Cannot set queue tempo (%1/%2") .arg(snd_seq_queue_tempo_get_tempo(queue_tempo)) .arg(snd_seq_queue_tempo_get_ppq(queue_tempo)));
-		return 0;
-	}
-	PPQ = snd_seq_queue_tempo_get_ppq(queue_tempo);
+	load->PPQ = snd_seq_queue_tempo_get_ppq(queue_tempo);
+	load->initial_tempo = snd_seq_queue_tempo_get_tempo(queue_tempo);
 	qDebug() << "Initial Tempo: " << snd_seq_queue_tempo_get_tempo(queue_tempo);
-	if ( PPQ != time_division )
-		qDebug() << "New ppq: " << PPQ;
-	BPM = static_cast<double>(1000000/static_cast<double>(snd_seq_queue_tempo_get_tempo(queue_tempo))*60);
-	song_length_seconds = prev_tick = 0;
-	// read len data from track unless EOF or new track found
+	if ( load->PPQ != time_division )
+		qDebug() << "New ppq: " << load->PPQ;
+	load->BPM = static_cast<double>(1000000/static_cast<double>(snd_seq_queue_tempo_get_tempo(queue_tempo))*60);
+	load->length_seconds = prev_tick = 0;
+	// decode each track from its indexed chunk, one after the other
+	track_start.clear();
+	track_start.reserve( num_tracks );
+	load->tracks = num_tracks;
+	load->format = index.format;
+	load->division = index.time_division;
+	load->track_hash.resize( num_tracks );
 	for ( int j = 0; j < num_tracks; ++ j ) {
-		qDebug() << "Process track" << j+1 << "of" << num_tracks;
-		int len;
-		// verify data is valid
-		for (;;) {
-			int id = read_id();
-			len = read_int(4);      // track length
-			if ( feof(file) ) {
-				QMessageBox::critical(m_parent, "MIDI Player", QString("%1: unexpected end of file") .arg(file_name));
-				return 0;
-			}
-			if (len < 0 || len >= 0x10000000) {
-				QMessageBox::critical(m_parent, "MIDI Player", QString("%1: invalid chunk length %2") .arg(file_name) .arg(len));
-				return 0;
-			}
-			if (id == MAKE_ID('M', 'T', 'r', 'k'))
-				break;            // found start of a new track, loop back and process it
-			skip(len);
-		}   // end FOR (infinite)
+		if ( num_tracks <= 64 || !(j & 1023) )
+			qDebug() << "Process track" << j+1 << "of" << num_tracks;
+		track_start.append( load->all_events.size() );
+		// size hint: a running status note with a one byte delta takes 3
+		// bytes, most events take more
+		load->all_events.reserve( load->all_events.size() + index.tracks[j].length / 4 );
+		file_offset = index.tracks[j].offset;
+		load->track_hash[j] = Song::hash( file_data + file_offset, qMin(index.tracks[j].length, file_size - file_offset) );
 		// do the actual reading of midi data from the file
-		if (!read_track(file_offset + len, file_name)) return 0;
+		if (!read_track(j, file_offset + index.tracks[j].length, file_name)) return 0;
+		load_bytes.store( file_offset );
+		load_tracks.store( j + 1 );
+		if ( load_cancel.load() )
+			return 0;
 	}   // end FOR j
 
-	// sort the event vector in tick order
-	//    std::sort(all_events.begin(), all_events.end(), tick_comp);
-	std::stable_sort(all_events.begin(), all_events.end(), tick_comp);
-	if ( song_length_seconds == 0 ) {
-		song_length_seconds = (60000/(BPM*PPQ)) * all_events.back().tick / 1000 ;
-		qDebug() << "Song length: " << song_length_seconds;
+	// merge the tracks into tick order
+	merge_tracks();
+	qint64 end_tick = load->all_events.isEmpty() ? 0 : load->all_events.back().tick;
+	if ( load->length_seconds == 0 ) {
+		load->length_seconds = (60000/(load->BPM*load->PPQ)) * end_tick / 1000 ;
+		qDebug() << "Song length: " << load->length_seconds;
 	}
 	else
 	{
-		song_length_seconds += (60000/(BPM*PPQ)) * (all_events.back().tick-prev_tick) / 1000 ;
-		qDebug() << "Song length: " << song_length_seconds;
+		load->length_seconds += (60000/(load->BPM*load->PPQ)) * (end_tick-prev_tick) / 1000 ;
+		qDebug() << "Song length: " << load->length_seconds;
 	}
 	return 1;   // good return, all data read ok
-
-invalid_format:
-	QMessageBox::critical( m_parent, "MIDI Player", QString("%1: invalid file format") .arg(file_name) );
-	return 0;
 }   // end read_smf
 
-bool MidiPlayer::tick_comp(const struct event& e1, const struct event& e2) {
-	return ( e1.tick < e2.tick );
+// Every track is already in tick order, so a k-way merge gives the same
+// result as a stable sort of the whole list (equal ticks keep track order)
+// in one sequential pass.  The merged list is built beside the decoded
+// one, so the events are held twice until the swap at the end.
+void MidiPlayer::merge_tracks()
+{
+	struct head {
+		qint64 tick;
+		int track;
+		// std heaps keep the largest on top, so order by "later"
+		bool operator<( const head &h ) const {
+			return tick != h.tick ? tick > h.tick : track > h.track;
+		}
+	};
+	int num_tracks = track_start.size();
+	if ( num_tracks < 2 )
+		return;
+	track_start.append( load->all_events.size() );
+	std::vector<head> heap;
+	std::vector<qint64> pos( track_start.constBegin(), track_start.constEnd() - 1 );
+	heap.reserve( num_tracks );
+	for ( int t = 0; t < num_tracks; ++ t )
+		if ( pos[t] < track_start[t + 1] ) {
+			head h = { load->all_events[pos[t]].tick, t };
+			heap.push_back( h );
+		}
+	std::make_heap( heap.begin(), heap.end() );
+
+	ChunkedList<Song::event> merged;
+	merged.reserve( load->all_events.size() );
+	while ( !heap.empty() ) {
+		std::pop_heap( heap.begin(), heap.end() );
+		head &h = heap.back();
+		qint64 &i = pos[h.track];
+		// take the whole run of this track that still comes first
+		qint64 until = heap.size() > 1 ? heap.front().tick : -1;
+		int next_track = heap.size() > 1 ? heap.front().track : 0;
+		do {
+			merged.push_back( load->all_events[i] );
+			++ i;
+		} while ( i < track_start[h.track + 1] &&
+				  (until < 0 || load->all_events[i].tick < until ||
+				   (load->all_events[i].tick == until && h.track < next_track)) );
+		if ( i < track_start[h.track + 1] ) {
+			h.tick = load->all_events[i].tick;
+			std::push_heap( heap.begin(), heap.end() );
+		} else {
+			heap.pop_back();
+		}
+	}
+	load_stats.allocations += load->all_events.allocations();
+	note_peak( merged.bytes() );
+	load->all_events.swap( merged );
+	track_start.clear();
+}   // end merge_tracks
+
+// keep LoadStats::peak_bytes: what the song being loaded holds now, and
+// extra held for it beside the song
+void MidiPlayer::note_peak( qint64 extra )
+{
+	qint64 bytes = extra + load->all_events.bytes() + load->arena.bytes() + load->compiled.bytes() +
+		load->wire.capacity() + load->wire_index.bytes() + load->notes.bytes() + load->note_reach.bytes();
+	for ( int level = 0; level < load->roll.size(); ++ level )
+		bytes += load->roll[level].size();
+	load_stats.peak_bytes = qMax( load_stats.peak_bytes, bytes );
+}
+
+// Songs that send the same dump or reset over and over keep one copy of it.
+// The key leaves the 0xF0 out of the bytes hashed, so a payload already
+// stored with it (on a reload, see splice_song()) finds the same entry.
+const unsigned char *Song::intern_sysex( bool f0, const unsigned char *src, unsigned n )
+{
+	if ( !f0 && n && src[0] == 0xf0 ) {
+		f0 = true;
+		++ src;
+		-- n;
+	}
+	unsigned length = n + f0;
+	sysex_bytes += length;
+	quint64 key = hash( src, n ) ^ f0;
+	QHash<quint64, payload>::const_iterator it = sysex_pool.constFind( key );
+	if ( it != sysex_pool.constEnd() && it->length == length && (!f0 || it->data[0] == 0xf0) &&
+		 !memcmp( it->data + f0, src, n ) ) {
+		sysex_shared += length;
+		return it->data;
+	}
+	unsigned char *p = static_cast<unsigned char *>( arena.alloc(length) );
+	if ( !length || !p )
+		return p;
+	if ( f0 )
+		p[0] = 0xf0;
+	memcpy( p + f0, src, n );
+	if ( it == sysex_pool.constEnd() ) {
+		payload stored = { p, length };
+		sysex_pool.insert( key, stored );
+	}
+	return p;
+}
+
+void Song::pack()
+{
+	compiled.pack();
+	all_events.clear();
+	wire.clear();
+	wire_index.clear();
+	sysex_pool.clear();
+}
+
+void Song::build_tempo_map()
+{
+	tempo_map.clear( initial_tempo, static_cast<qint64>(PPQ) );
+	EventList::Reader events;
+	events.reset( &compiled );
+	for ( qint64 i = 0; i < compiled.size(); ++ i ) {
+		const snd_seq_event_t &ev = events[i];
+		if ( ev.type == SND_SEQ_EVENT_TEMPO )
+			tempo_map.append( ev.time.tick, ev.data.queue.param.value );
+	}
 }
 
-int MidiPlayer::read_track(int track_end, QString &file_name) {
+int MidiPlayer::read_track(int track, int track_end, QString &file_name) {
 // read one complete track from the file, parse it into events
-	int tick = 0;
+	qint64 tick = 0;
 	unsigned char last_cmd = 0;
-	struct event Event;
+	Song::event Event;
 	Event.port = 0;
+	Event.track = track;
+	Event.sysex = NULL;
 	// the current file position is after the track ID and length
 	while (file_offset < track_end)
 	{
 		unsigned char cmd;
 		int len, c;
 
+		// a long track reports its progress and can be cancelled as it goes
+		if (file_offset >= load_check) {
+			load_bytes.store(file_offset);
+			if (load_cancel.load())
+				return 0;
+			load_check = file_offset + LOAD_CHECK_BYTES;
+		}
+
 		int delta_ticks = read_var();
 		if (delta_ticks < 0)
 			break;
@@ -221,167 +321,262 @@ int MidiPlayer::read_track(int track_end, QString &file_name) {
 		if (c < 0)
 			break;      // bad data, exit with rc
 		if (c & 0x80) {
-			// have command
+			// have command, only channel messages set the running status
 			cmd = c;
 			if (cmd < 0xf0)
 				last_cmd = cmd;
 		} else {
-			// running status
-			ungetc(c, file);
+			// running status, c is the first data byte
 			file_offset--;
 			cmd = last_cmd;
 			if (!cmd)
 				goto _error;
 		}
-		unsigned int x = cmd >> 4;
-		static unsigned char cmd_type[0xf];
-		switch(x) {
-		case 0x8:
-			cmd_type[x] = SND_SEQ_EVENT_NOTEOFF;
-			break;
-		case 0x9:
-			cmd_type[x] = SND_SEQ_EVENT_NOTEON;
-			break;
-		case 0xA:
-			cmd_type[x] = SND_SEQ_EVENT_KEYPRESS;
-			break;Event.sysex.clear();
-		case 0xB:
-			cmd_type[x] = SND_SEQ_EVENT_CONTROLLER;
-			break;
-		case 0xC:
-			cmd_type[x] = SND_SEQ_EVENT_PGMCHANGE;
-			break;
-		case 0xD:
-			cmd_type[x] = SND_SEQ_EVENT_CHANPRESS;
-			break;
-		case 0xE:
-			cmd_type[x] = SND_SEQ_EVENT_PITCHBEND;
-			break;
-		}
-		switch(x) {
-		case 0x8: // channel msg with 2 parameter bytes
-		case 0x9:
-		case 0xa:
-		case 0xb:
-		case 0xe:
-			Event.type = cmd_type[cmd >> 4];
+		const struct status_info &info = status_table[cmd];
+		if (info.flags & ST_CHANNEL) {
+			Event.type = info.type;
 			Event.tick = tick;
 			Event.data.d[0] = cmd & 0x0f;
 			Event.data.d[1] = read_byte() & 0x7f;
-			Event.data.d[2] = read_byte() & 0x7f;
-			all_events.push_back(Event);
-			break;
-		case 0xc: // channel msg with 1 parameter byte
-		case 0xd:
-			Event.type = cmd_type[cmd >> 4];
+			if (info.len == 2)
+				Event.data.d[2] = read_byte() & 0x7f;
+			load->all_events.push_back(Event);
+			continue;
+		}
+		if (info.flags & ST_SYSEX) {
+			// sysex, or continued sysex / escaped commands (0xf7)
+			len = read_var();
+			if (len < 0) goto _error;
+			c = cmd == 0xf0;
+			const unsigned char *payload;
+			if (file_offset + len <= file_size) {
+				payload = load->intern_sysex(c, file_data + file_offset, len);
+				file_offset += len;
+			} else {
+				// cut short: what read_byte() makes of the rest
+				QByteArray rest;
+				for (int n = 0; n < len; ++n)
+					rest.append(read_byte());
+				payload = load->intern_sysex(c, reinterpret_cast<const unsigned char *>(rest.constData()), len);
+			}
+			if (len + c && !payload) goto _error;
+			Event.type = info.type;
 			Event.tick = tick;
-			Event.data.d[0] = cmd & 0x0f;
-			Event.data.d[1] = read_byte() & 0x7f;
-			all_events.push_back(Event);
+			Event.data.length = len + c;
+			Event.sysex = payload;
+			load->all_events.push_back(Event);
+			Event.sysex = NULL;
+			continue;
+		}
+		if (!(info.flags & ST_META))
+			goto _error;        // invalid Fx command
+		// meta event
+		c = read_byte();
+		len = read_var();
+		if (len < 0) goto _error;
+		switch (c) {
+		 case 0x21: // port number
+			if (len < 1) goto _error;
+			skip(len);
 			break;
-		case 0xf:
-			switch (cmd) {
-			case 0xf0: // sysex
-			case 0xf7: // continued sysex, or escaped commands
-				len = read_var();
-				if (len < 0) goto _error;
-				if (cmd == 0xf0) ++len;
-				Event.type = SND_SEQ_EVENT_SYSEX;
+		 case 0x2f: // end of track
+			skip(track_end - file_offset);
+			return 1;   // this is the successful exit point, end of the track
+		 case 0x51: // tempo
+			if (len < 3) goto _error;
+			if (smpte_timing) {
+				// SMPTE timing doesn't change
+				skip(len);
+			} else {
+				Event.type = SND_SEQ_EVENT_TEMPO;
 				Event.tick = tick;
-				Event.data.length = len;
-				Event.sysex.clear();
-				if (cmd == 0xf0) {
-					Event.sysex.push_back(0xf0);
-					c = 1;
-				} else {
-					c = 0;
-				}
-				for (; c < len; ++c)
-					Event.sysex.push_back(read_byte());
-				all_events.push_back(Event);
-				break;
-			case 0xff: // meta event
-				c = read_byte();
-				len = read_var();
-				if (len < 0) goto _error;
-				switch (c) {
-				 case 0x21: // port number
-					if (len < 1) goto _error;
-					skip(len);
-					break;
-				 case 0x2f: // end of track
-					skip(track_end - file_offset);
-					return 1;   // this is the successful exit point, end of the track
-				 case 0x51: // tempo
-					if (len < 3) goto _error;
-					if (smpte_timing) {
-						// SMPTE timing doesn't change
-						skip(len);
-					} else {
-						Event.type = SND_SEQ_EVENT_TEMPO;
-						Event.tick = tick;
-						Event.data.tempo = read_byte() << 16;
-						Event.data.tempo |= read_byte() << 8;
-						Event.data.tempo |= read_byte();
-						all_events.push_back(Event);
-						skip(len - 3);
-						song_length_seconds += (60000/(BPM*PPQ)) * (tick-prev_tick) / 1000 ;
-						prev_tick = tick;
-						BPM = static_cast<double>(1000000/static_cast<double>(Event.data.tempo)*60);
-						qDebug() << "New tempo: " << Event.data.tempo;
-						qDebug() << " BPM: " << BPM << " at tick " << Event.tick;
-						qDebug() << "New song_len: " << song_length_seconds;
-					}
-					break;
-				 case 0x59:  // Key Signature
-					if (len<2) goto _error;
-					sf = read_byte();
-					minor_key = read_byte();
-					break;
-				 default: // ignore all other meta events
-					skip(len);
-					break;
-				}   // end SWITCH (meta-event byte value)
-				break;
-			default: // invalid Fx command
-				goto _error;
-			}   // end SWITCH (cmd)
+				Event.data.tempo = read_byte() << 16;
+				Event.data.tempo |= read_byte() << 8;
+				Event.data.tempo |= read_byte();
+				load->all_events.push_back(Event);
+				skip(len - 3);
+				load->length_seconds += (60000/(load->BPM*load->PPQ)) * (tick-prev_tick) / 1000 ;
+				prev_tick = tick;
+				load->BPM = static_cast<double>(1000000/static_cast<double>(Event.data.tempo)*60);
+				qDebug() << "New tempo: " << Event.data.tempo;
+				qDebug() << " BPM: " << load->BPM << " at tick " << Event.tick;
+				qDebug() << "New song_len: " << load->length_seconds;
+			}
+			break;
+		 case 0x59:  // Key Signature
+			if (len<2) goto _error;
+			load->sf = read_byte();
+			load->minor_key = read_byte();
+			break;
+		 default: // ignore all other meta events
+			skip(len);
 			break;
-		default: // cannot happen
-			goto _error;
-		}   // end switch
+		}   // end SWITCH (meta-event byte value)
 	}   // end WHILE (one complete track)
 _error:
-	QMessageBox::critical(m_parent, "MIDI Player", QString("%1: invalid MIDI data (offset %2)") .arg(file_name) .arg(file_offset));
+	parse_error( QString("%1: invalid MIDI data (offset %2)") .arg(file_name) .arg(file_offset) );
 	return 0;
 }   // end read_track
 
 int MidiPlayer::parseFile(QString &file_name)
 {
-	all_events.clear();
-	// parse the midi file
-	file = fopen(file_name.toLocal8Bit().data(), "rb");
-	if (!file) {
-		QMessageBox::critical(m_parent, "MIDI Player", QString("Cannot open %s - %s") .arg(file_name) .arg(strerror(errno)));
+	// let go of the previous song first: unless another player still plays
+	// it, its payloads go in one go before the next one is loaded
+	song = SongPtr( new Song );
+	int ok = readFile( file_name );
+	useLoad();
+	return ok;
+}   // end parseFile
+
+// The loading part of parseFile(), safe to run on a thread of its own
+// while the GUI carries on: it only builds the next song, see useLoad().
+// Progress is published as it goes, cancelLoad() stops it at the next
+// track or LOAD_CHECK_BYTES.
+int MidiPlayer::readFile(QString &file_name)
+{
+	load = new Song;
+	memset( &load_stats, 0, sizeof(load_stats) );
+	load_cancel.store( 0 );
+	load_bytes.store( 0 );
+	load_tracks.store( 0 );
+	load_num_tracks.store( 0 );
+	// map the midi file, the decoder reads straight from the image
+	QFile midi_file(file_name);
+	// the parser and the index count in int
+	if (midi_file.size() > INT_MAX) {
+		parse_error( QString("%1: too big (%2 bytes)") .arg(file_name) .arg(midi_file.size()) );
 		return 0;
 	}
+	if (!midi_file.open(QIODevice::ReadOnly) || !(file_data = midi_file.map(0, midi_file.size()))) {
+		parse_error( QString("Cannot open %1 - %2") .arg(file_name) .arg(midi_file.errorString()) );
+		return 0;
+	}
+	QElapsedTimer timer;
+	timer.start();
+	file_size = midi_file.size();
 	file_offset = 0;
+	load_size.store( file_size );
+	load_check = LOAD_CHECK_BYTES;
 	int ok = 0;
-	// validate and load the midi data into memory for playing
-	switch (read_id()) {
-	case MAKE_ID('M', 'T', 'h', 'd'):
-		ok = read_smf(file_name);
-		break;
-	case MAKE_ID('R', 'I', 'F', 'F'):
-		ok = read_riff(file_name);
-		break;
-	default:
-		QMessageBox::critical(m_parent, "MIDI Player", QString("%1 is not a Standard MIDI File") .arg(file_name));
-		break;
+	// validate the chunk structure and index the tracks before decoding
+	MidiIndex index;
+	if ( !index.build(file_data, file_size) ) {
+		qDebug() << "Rejected after" << timer.nsecsElapsed() / 1000 << "us";
+		parse_error( index.error .arg(file_name) );
+	} else {
+		load_stats.index_ns = timer.nsecsElapsed();
+		qDebug() << "Indexed" << index.tracks.size() << "tracks in" << load_stats.index_ns / 1000 << "us";
+		load_num_tracks.store( index.num_tracks );
+		// load the midi data into memory for playing
+		ok = read_smf(file_name, index);
+	}
+	midi_file.unmap(const_cast<uchar *>(file_data));   // all data loaded or invalid file
+	file_data = NULL;
+	load_stats.parse_ns = timer.nsecsElapsed() - load_stats.index_ns;
+	qDebug() << "Parsed" << load->all_events.size() << "events from" << file_size << "bytes in" << timer.nsecsElapsed() / 1000 << "us";
+	if ( load_cancel.load() ) {
+		// nothing of it is kept
+		qDebug() << "Load cancelled after" << timer.nsecsElapsed() / 1000 << "us";
+		delete load;
+		load = new Song;
+		return 0;
 	}
-	fclose(file);   // all data loaded or invalid file
 
-	last_tick = all_events.back().tick;
+	// a file rejected by the index has no events at all
+	load->last_tick = load->all_events.size() ? load->all_events.back().tick : 0;
+	// ticks are accumulated in 64 bits, but the sequencer queue counts in 32
+	if ( ok && load->last_tick > UINT_MAX ) {
+		parse_error( QString("%1: song too long (%2 ticks)") .arg(file_name) .arg(load->last_tick) );
+		load->all_events.clear();
+		load->last_tick = 0;
+		ok = 0;
+	}
+	if ( ok && load->all_events.size() > MAX_WIRE_EVENTS ) {
+		parse_error( QString("%1: too many events (%2)") .arg(file_name) .arg(load->all_events.size()) );
+		load->all_events.clear();
+		load->last_tick = 0;
+		ok = 0;
+	}
+	load_stats.events = load->all_events.size();
+	load_stats.allocations += load->all_events.allocations();
+	if ( ok ) {
+		// the notes come from all_events, which compact storage lets go
+		// of while compiling
+		load->index_notes();
+		load->build_roll();
+		compile_events();
+		load->build_tempo_map();
+	} else
+		load->tracks = 0;
 
+	load_stats.file_bytes = file_size;
+	load_stats.allocations += load->arena.allocations();
+	load_stats.arena_bytes = load->arena.bytes();
+	load_stats.sysex_bytes = load->sysex_bytes;
+	load_stats.sysex_shared = load->sysex_shared;
+	qDebug() << "Load:" << load_stats.allocations << "allocations," << load_stats.arena_bytes << "arena bytes, at most"
+			 << load_stats.peak_bytes << "bytes held, index" << load_stats.index_ns / 1000 << "us, parse"
+			 << load_stats.parse_ns / 1000 << "us, compile" << load_stats.compile_ns / 1000 << "us";
+	if ( load->sysex_bytes )
+		// saved: the repeats not stored again, and all of it not copied
+		// into the wire bytes, which hold channel messages only
+		qDebug() << "Load: SysEx of" << load->sysex_bytes << "bytes;" << load->sysex_shared
+				 << "of them repeats stored once," << load->sysex_bytes << "kept out of the wire bytes";
+	load_stats.event_bytes = load->compiled.bytes() + load->wire.size() + load->wire_index.size() * static_cast<qint64>(sizeof(int)) +
+		load->all_events.size() * static_cast<qint64>(sizeof(Song::event));
+	if ( ok && compact_store ) {
+		QElapsedTimer pack_timer;
+		pack_timer.start();
+		load->pack();
+		load_stats.pack_ns = pack_timer.nsecsElapsed();
+		load_stats.event_bytes = load->compiled.bytes();
+		// the notes and the roll stay as they are: chasing notes on a seek
+		// or loop and the piano roll read them
+		qDebug() << "Compact:" << load_stats.events << "events in" << load_stats.event_bytes << "bytes from a file of"
+				 << file_size << "bytes, notes and roll" << load->notes.bytes() + load->note_reach.bytes()
+				 << "more, at most" << load_stats.peak_bytes << "bytes held while loading";
+	}
 	return ok;
-}   // end parseFile
+}   // end readFile
+
+// swap in what readFile() made, good or not, in one step
+void MidiPlayer::useLoad()
+{
+	if ( !load )
+		return;
+	setSong( SongPtr(load) );
+	load = NULL;
+}
+
+// the song for the caller to let go of, wherever that suits it best; the
+// player is left with an empty one.  Not while an engine plays.
+SongPtr MidiPlayer::takeSong()
+{
+	QMutexLocker lock( &swap_lock );
+	SongPtr old = song;
+	song = SongPtr( new Song );
+	play_song = song;
+	return old;
+}
+
+MidiPlayer::LoadProgress MidiPlayer::loadProgress()
+{
+	LoadProgress p;
+	p.bytes = load_bytes.load();
+	p.file_bytes = load_size.load();
+	p.tracks = load_tracks.load();
+	p.num_tracks = load_num_tracks.load();
+	return p;
+}
+
+// an error in the file: a message box from the GUI thread, else it is kept
+// for takeErrors()
+void MidiPlayer::parse_error( const QString &msg )
+{
+	if ( m_parent && QThread::currentThread() == thread() )
+		QMessageBox::critical( m_parent, "MIDI Player", msg );
+	else {
+		qDebug() << msg;
+		errors << msg;
+	}
+}
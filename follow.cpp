@@ -0,0 +1,229 @@
+// follow.cpp   -- part of MIDI_PLAYER
+// following an external MIDI Clock: a client of its own, "midi_player
+// clock", takes the master's Clock, Start, Stop, Continue and Song
+// Position on its input port, stamped on arrival with the real time of a
+// queue it keeps running for that.  The stamps go through an alpha-beta
+// filter (a second order PLL) for the clock period; the speed is set so
+// that the song's tempo where it plays matches the master's, nudged by how
+// far the song is behind or ahead of the master's position.  The master's
+// transport comes back to the window as FollowAction bits to act on.
+// Everything here runs on the GUI thread, see handleFollow().
+// contains:
+//      setFollow()
+//      followFd()
+//      handleFollow()
+//      followStats()
+//      follow_clock()
+//      follow_drive()
+
+#include "playerwindow.h"	// hack!
+#include "player.h"
+
+#include <poll.h>
+#include <errno.h>
+#include <math.h>
+
+#define NSEC_PER_SEC 1000000000LL
+#define CLOCKS_PER_QUARTER 24
+// a song position counts sixteenths
+#define CLOCKS_PER_SPP 6
+// filter gains: how much of an arrival error moves the phase, and the
+// period; critically damped for FOLLOW_ALPHA
+#define FOLLOW_ALPHA 0.15
+#define FOLLOW_BETA (FOLLOW_ALPHA * FOLLOW_ALPHA / (2 - FOLLOW_ALPHA))
+// clocks before the estimate steers the speed
+#define FOLLOW_LOCK_CLOCKS 12
+// a clock this many periods off the estimate starts it over
+#define FOLLOW_GAP 4
+// speed correction per quarter note behind the master, and its limit
+#define FOLLOW_GAIN 0.5
+#define FOLLOW_MAX_CORRECTION 0.05
+// further off than this many quarter notes, seek to the master
+#define FOLLOW_RELOCATE 1
+// clocks the jitter is averaged over, and between two reports
+#define FOLLOW_JITTER_CLOCKS 64
+#define FOLLOW_REPORT_CLOCKS (CLOCKS_PER_QUARTER * 16)
+
+// The client is opened the first time, and kept; off, what comes in is
+// read and dropped.  Connect the master to it with aconnect or the like.
+bool MidiPlayer::setFollow( bool on )
+{
+	if ( on && !follow_seq ) {
+		int err = snd_seq_open(&follow_seq, "default", SND_SEQ_OPEN_INPUT, SND_SEQ_NONBLOCK);
+		if ( err < 0 ) {
+			check_snd("open clock client", err);
+			follow_seq = NULL;
+			return false;
+		}
+		snd_seq_set_client_name(follow_seq, "midi_player clock");
+		follow_queue = snd_seq_alloc_queue(follow_seq);
+		check_snd("allocate clock queue", follow_queue);
+		err = snd_seq_start_queue(follow_seq, follow_queue, NULL);
+		check_snd("start clock queue", err);
+		snd_seq_drain_output(follow_seq);
+		snd_seq_port_info_t *pinfo;
+		snd_seq_port_info_alloca(&pinfo);
+		snd_seq_port_info_set_name(pinfo, "clock in");
+		snd_seq_port_info_set_capability(pinfo, SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE);
+		snd_seq_port_info_set_type(pinfo, SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+		snd_seq_port_info_set_timestamping(pinfo, 1);
+		snd_seq_port_info_set_timestamp_real(pinfo, 1);
+		snd_seq_port_info_set_timestamp_queue(pinfo, follow_queue);
+		err = snd_seq_create_port(follow_seq, pinfo);
+		check_snd("create clock port", err);
+		if ( err < 0 ) {
+			snd_seq_close(follow_seq);
+			follow_seq = NULL;
+			return false;
+		}
+		qDebug() << "Following the clock on" << snd_seq_client_id(follow_seq) << ":"
+				 << snd_seq_port_info_get_port(pinfo);
+	}
+	if ( on == fol.on )
+		return true;
+	if ( on ) {
+		fol.speed_before = getSpeed();
+		fol.running = false;
+		fol.lock = 0;
+		fol.period_ns = 0;
+		fol.jitter_sq = 0;
+		fol.drift_ns = 0;
+	} else
+		setSpeed( fol.speed_before );
+	fol.on = on;
+	fol.actions = 0;
+	return true;
+}	// end setFollow
+
+int MidiPlayer::followFd()
+{
+	struct pollfd pfd;
+	if ( !follow_seq || snd_seq_poll_descriptors(follow_seq, &pfd, 1, POLLIN) != 1 )
+		return -1;
+	return pfd.fd;
+}
+
+// Read what the master sent, steer the speed on its clocks, and tell what
+// its transport did since the last call: FollowAction bits.  After
+// FOLLOW_START the song plays from the top, after FOLLOW_SEEK from
+// followPosition(); followRunning() is whether it plays at all.
+int MidiPlayer::handleFollow()
+{
+	snd_seq_event_t *ev;
+	int err;
+	if ( !follow_seq )
+		return 0;
+	while ( (err = snd_seq_event_input(follow_seq, &ev)) >= 0 || err == -ENOSPC ) {
+		if ( err == -ENOSPC ) {
+			// clocks were lost, the estimate starts over
+			qDebug() << "Clock input overrun";
+			fol.lock = 0;
+			continue;
+		}
+		if ( !fol.on )
+			continue;
+		switch ( ev->type ) {
+		case SND_SEQ_EVENT_CLOCK:
+			follow_clock( ev->time.time.tv_sec * NSEC_PER_SEC + ev->time.time.tv_nsec );
+			break;
+		case SND_SEQ_EVENT_START:
+			fol.running = true;
+			fol.clocks = 0;
+			fol.lock = 0;
+			fol.actions = FOLLOW_START;	// what came before no longer matters
+			break;
+		case SND_SEQ_EVENT_CONTINUE:
+			fol.running = true;
+			fol.lock = 0;
+			fol.actions |= FOLLOW_RUN;
+			break;
+		case SND_SEQ_EVENT_STOP:
+			fol.running = false;
+			fol.actions |= FOLLOW_RUN;
+			break;
+		case SND_SEQ_EVENT_SONGPOS:
+			fol.clocks = static_cast<qint64>(ev->data.control.value) * CLOCKS_PER_SPP;
+			fol.seek_tick = fol.clocks * static_cast<qint64>(song->PPQ) / CLOCKS_PER_QUARTER;
+			fol.actions |= FOLLOW_SEEK;
+			break;
+		}
+	}
+	int actions = fol.actions;
+	fol.actions = 0;
+	return actions;
+}	// end handleFollow
+
+MidiPlayer::FollowStats MidiPlayer::followStats()
+{
+	FollowStats s;
+	s.locked = fol.on && fol.running && fol.lock >= FOLLOW_LOCK_CLOCKS;
+	s.bpm = fol.period_ns > 0 ? 60.0 * NSEC_PER_SEC / (fol.period_ns * CLOCKS_PER_QUARTER) : 0;
+	s.jitter_us = sqrt( fol.jitter_sq ) / 1000;
+	s.drift_ms = fol.drift_ns / 1000000;
+	return s;
+}
+
+// A clock stamped at t: the filter predicts each clock one period after
+// the last, and moves both by the error.  Jitter is that error, drift how
+// far the song is behind the master (see follow_drive()).
+void MidiPlayer::follow_clock( qint64 t )
+{
+	Follow &f = fol;
+	f.clocks ++;
+	if ( f.lock == 0 || (f.lock == 1 && f.period_ns <= 0) ) {
+		if ( f.lock == 1 )
+			f.period_ns = t - f.last_ns;
+		f.last_ns = t;
+		f.lock ++;
+		return;
+	}
+	double err = t - (f.last_ns + f.period_ns);
+	if ( qAbs(err) > f.period_ns * FOLLOW_GAP ) {
+		// the master paused its clock, or we missed some
+		f.last_ns = t;
+		f.lock = 1;
+		return;
+	}
+	f.last_ns += f.period_ns + FOLLOW_ALPHA * err;
+	f.period_ns += FOLLOW_BETA * err;
+	f.jitter_sq += (err * err - f.jitter_sq) / FOLLOW_JITTER_CLOCKS;
+	f.lock ++;
+	if ( f.lock < FOLLOW_LOCK_CLOCKS || !f.running )
+		return;
+	if ( isRunning() )
+		follow_drive();
+	if ( f.lock % FOLLOW_REPORT_CLOCKS == 0 ) {
+		FollowStats s = followStats();
+		qDebug() << "Following" << s.bpm << "BPM, jitter" << s.jitter_us << "us, drift" << s.drift_ms << "ms, speed" << getSpeed();
+	}
+}	// end follow_clock
+
+// Where the master is now against where the song plays: the speed for its
+// tempo at this point of the song, corrected towards the master's position
+// within FOLLOW_MAX_CORRECTION; too far off, a seek there.
+void MidiPlayer::follow_drive()
+{
+	Follow &f = fol;
+	qint64 ppq = static_cast<qint64>(song->PPQ);
+	snd_seq_queue_status_t *qstatus;
+	snd_seq_queue_status_alloca( &qstatus );
+	int err = snd_seq_get_queue_status( follow_seq, follow_queue, qstatus );
+	check_snd("get queue status", err);
+	const snd_seq_real_time_t *rt = snd_seq_queue_status_get_real_time( qstatus );
+	qint64 now = rt->tv_sec * NSEC_PER_SEC + rt->tv_nsec;
+	qint64 ours = getTick();
+	double master = (f.clocks - 1 + (now - f.last_ns) / f.period_ns) * ppq / CLOCKS_PER_QUARTER;
+	double behind = (master - ours) / ppq;		// quarter notes
+	f.drift_ns = behind * f.period_ns * CLOCKS_PER_QUARTER;
+	if ( qAbs(behind) > FOLLOW_RELOCATE && !(f.actions & FOLLOW_SEEK) ) {
+		f.seek_tick = static_cast<qint64>(master);
+		f.actions |= FOLLOW_SEEK;
+		qDebug() << "Following: the song is" << behind << "quarter notes behind, seeking to tick" << f.seek_tick;
+		// steer again once the seek has settled
+		f.lock = 2;
+		return;
+	}
+	double master_tempo = f.period_ns * CLOCKS_PER_QUARTER / 1000;	// usec per quarter
+	double correction = qBound( -FOLLOW_MAX_CORRECTION, behind * FOLLOW_GAIN, FOLLOW_MAX_CORRECTION );
+	setSpeed( song->tempo_map.tempo(ours) / master_tempo * (1 + correction) );
+}	// end follow_drive
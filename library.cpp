@@ -0,0 +1,444 @@
+// library.cpp   -- part of MIDI_PLAYER
+// index of a MIDI collection: per file the header and what the meta events
+// tell (tempo map, key signature, length), kept in a file and brought up
+// to date by path, mtime and size.  Files are read on a thread pool and
+// never decoded into events.
+// contains:
+//      MidiLibrary()
+//      loadIndex()
+//      saveIndex()
+//      count()
+//      scan()
+//      lookup()
+//      store()
+//      probe()
+//      describe()
+
+#include "library.h"
+#include "midi_index.h"
+#include "tempo_map.h"
+
+#include <QtDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QDirIterator>
+#include <QDateTime>
+#include <QDataStream>
+#include <QSaveFile>
+#include <QSet>
+#include <QStandardPaths>
+#include <QRunnable>
+#include <QMetaObject>
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QMutexLocker>
+
+#include <algorithm>
+#include <limits.h>
+
+#define INDEX_MAGIC 0x4d504c49	// "MPLI"
+#define INDEX_VERSION 1
+
+static QDataStream &operator<<( QDataStream &out, const MidiInfo &i )
+{
+	return out << i.mtime << i.size << i.ok << i.format << i.tracks << i.ppq
+			   << i.last_tick << i.seconds << i.tempo_min << i.tempo_max
+			   << i.has_key << i.sf << i.minor_key << i.notes << i.error;
+}
+
+static QDataStream &operator>>( QDataStream &in, MidiInfo &i )
+{
+	return in >> i.mtime >> i.size >> i.ok >> i.format >> i.tracks >> i.ppq
+			  >> i.last_tick >> i.seconds >> i.tempo_min >> i.tempo_max
+			  >> i.has_key >> i.sf >> i.minor_key >> i.notes >> i.error;
+}
+
+MidiLibrary::MidiLibrary( const QString &index_file )
+	: file( index_file )
+	, dirty( false )
+{
+	if ( file.isEmpty() )
+		file = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + "/midi_player/library.idx";
+}
+
+bool MidiLibrary::loadIndex()
+{
+	QFile f( file );
+	if ( !f.open(QIODevice::ReadOnly) )
+		return false;
+	QDataStream in( &f );
+	quint32 magic, version, n;
+	in >> magic >> version >> n;
+	if ( magic != INDEX_MAGIC || version != INDEX_VERSION ) {
+		qDebug() << "Library index" << file << "is of another version, starting over";
+		return false;
+	}
+	QMutexLocker l( &lock );
+	entries.clear();
+	entries.reserve( n );
+	while ( n -- ) {
+		QString path;
+		MidiInfo info;
+		in >> path >> info;
+		if ( in.status() != QDataStream::Ok )
+			break;
+		entries.insert( path, info );
+	}
+	dirty = false;
+	qDebug() << "Library index:" << entries.size() << "files";
+	return in.status() == QDataStream::Ok;
+}
+
+bool MidiLibrary::saveIndex()
+{
+	QMutexLocker l( &lock );
+	if ( !dirty )
+		return true;
+	QDir().mkpath( QFileInfo(file).absolutePath() );
+	// all or nothing, a crash must not leave half an index behind
+	QSaveFile f( file );
+	if ( !f.open(QIODevice::WriteOnly) )
+		return false;
+	QDataStream out( &f );
+	out << quint32(INDEX_MAGIC) << quint32(INDEX_VERSION) << quint32(entries.size());
+	for ( QHash<QString, MidiInfo>::const_iterator e = entries.constBegin(); e != entries.constEnd(); ++ e )
+		out << e.key() << e.value();
+	if ( !f.commit() )
+		return false;
+	dirty = false;
+	return true;
+}
+
+// reads files off a shared list until it runs out, one per pool thread
+class ProbeTask : public QRunnable
+{
+public:
+	ProbeTask(const QStringList &paths, MidiInfo *infos, QAtomicInt &next)
+		: paths(paths), infos(infos), next(next) {}
+	void run() {
+		int i;
+		while ( (i = next.fetchAndAddRelaxed(1)) < paths.size() )
+			MidiLibrary::probe( paths[i], infos[i] );
+	}
+private:
+	const QStringList &paths;
+	MidiInfo *infos;
+	QAtomicInt &next;
+};
+
+int MidiLibrary::scan( const QStringList &dirs, int threads )
+{
+	QElapsedTimer timer;
+	timer.start();
+	QStringList todo;	// new or changed
+	int files = 0;
+	for ( int d = 0; d < dirs.size(); ++ d ) {
+		QString root = QFileInfo( dirs[d] ).absoluteFilePath();
+		// the walk goes to the disk, lookup() need not wait for it
+		QStringList found;
+		QVector<qint64> mtimes, sizes;
+		QDirIterator it( root, QStringList() << "*.mid" << "*.midi" << "*.rmi" << "*.kar",
+						 QDir::Files, QDirIterator::Subdirectories );
+		while ( it.hasNext() ) {
+			found << it.next();
+			QFileInfo fi = it.fileInfo();
+			mtimes << fi.lastModified().toMSecsSinceEpoch();
+			sizes << fi.size();
+		}
+		files += found.size();
+		QSet<QString> seen;
+		QMutexLocker l( &lock );
+		for ( int i = 0; i < found.size(); ++ i ) {
+			seen.insert( found[i] );
+			QHash<QString, MidiInfo>::const_iterator e = entries.constFind( found[i] );
+			if ( e == entries.constEnd() || e->mtime != mtimes[i] || e->size != sizes[i] )
+				todo << found[i];
+		}
+		// forget what is no longer there
+		for ( QHash<QString, MidiInfo>::iterator e = entries.begin(); e != entries.end(); ) {
+			if ( e.key().startsWith(root + "/") && !seen.contains(e.key()) ) {
+				e = entries.erase( e );
+				dirty = true;
+			} else
+				++ e;
+		}
+	}
+	qint64 walk_ns = timer.nsecsElapsed();
+
+	QVector<MidiInfo> infos( todo.size() );
+	QAtomicInt next( 0 );
+	QThreadPool pool;
+	if ( threads > 0 )
+		pool.setMaxThreadCount( threads );
+	for ( int t = 0; t < qMin(pool.maxThreadCount(), todo.size()); ++ t )
+		pool.start( new ProbeTask(todo, infos.data(), next) );
+	pool.waitForDone();
+
+	int bad = 0;
+	QMutexLocker l( &lock );
+	for ( int i = 0; i < todo.size(); ++ i ) {
+		entries.insert( todo[i], infos[i] );
+		bad += !infos[i].ok;
+	}
+	dirty |= !todo.isEmpty();
+	double secs = timer.nsecsElapsed() / 1e9;
+	qDebug() << "Library:" << files << "files," << todo.size() << "read (" << bad << "not playable) on"
+			 << pool.maxThreadCount() << "threads in" << static_cast<int>(secs * 1000) << "ms, walk"
+			 << walk_ns / 1000000 << "ms;" << static_cast<int>(files / qMax(secs, 1e-9)) << "files/s,"
+			 << static_cast<int>(todo.size() / qMax(secs - walk_ns / 1e9, 1e-9)) << "read/s";
+	return todo.size();
+}	// end scan
+
+int MidiLibrary::count()
+{
+	QMutexLocker l( &lock );
+	return entries.size();
+}
+
+// reads one file for lookup() and tells the receiver
+class LookupTask : public QRunnable
+{
+public:
+	LookupTask(MidiLibrary *library, const QString &path, QObject *receiver, const char *member)
+		: library(library), path(path), receiver(receiver), member(member) {}
+	void run() {
+		MidiInfo info;
+		MidiLibrary::probe( path, info );
+		library->store( path, info );
+		QMetaObject::invokeMethod( receiver, member.constData(), Qt::QueuedConnection, Q_ARG(QString, path) );
+	}
+private:
+	MidiLibrary *library;
+	QString path;
+	QObject *receiver;
+	QByteArray member;
+};
+
+bool MidiLibrary::lookup( const QString &path, MidiInfo &info, QObject *receiver, const char *member )
+{
+	QFileInfo fi( path );
+	QString key = fi.absoluteFilePath();
+	{
+		QMutexLocker l( &lock );
+		QHash<QString, MidiInfo>::const_iterator e = entries.constFind( key );
+		if ( e != entries.constEnd() && e->mtime == fi.lastModified().toMSecsSinceEpoch() && e->size == fi.size() ) {
+			info = *e;
+			return info.ok;
+		}
+		if ( receiver ) {
+			info.ok = false;
+			info.error.clear();
+			if ( !pending.contains(key) ) {
+				pending.insert( key );
+				pool.start( new LookupTask(this, key, receiver, member) );
+			}
+			return false;
+		}
+	}
+	probe( key, info );
+	store( key, info );
+	return info.ok;
+}
+
+void MidiLibrary::store( const QString &path, const MidiInfo &info )
+{
+	QMutexLocker l( &lock );
+	entries.insert( path, info );
+	pending.remove( path );
+	dirty = true;
+}
+
+static inline int get_var( const unsigned char *data, int end, int &pos )
+{
+	int value = 0;
+	for ( int n = 0; n < 4; ++ n ) {
+		if ( pos >= end )
+			return -1;
+		int c = data[pos++];
+		value = (value << 7) | (c & 0x7f);
+		if ( !(c & 0x80) )
+			return value;
+	}
+	return -1;
+}
+
+typedef QPair<qint64, int> TempoChange;	// tick, usec per quarter
+
+// Walk one track for its end, tempo changes, first key signature and
+// notes, stepping over everything else.  Like read_track(), a track must
+// end with End-of-Track.
+static bool scan_track( const unsigned char *data, int size, const MidiIndex::Chunk &chunk,
+						bool smpte, QVector<TempoChange> &tempos, qint64 &key_tick, MidiInfo &info )
+{
+	int pos = chunk.offset;
+	int end = qMin( chunk.offset + chunk.length, size );
+	qint64 tick = 0;
+	unsigned char running = 0;
+	while ( pos < end ) {
+		int len = get_var( data, end, pos );
+		if ( len < 0 || pos >= end )
+			return false;
+		tick += len;
+		unsigned char cmd = data[pos];
+		if ( cmd & 0x80 ) {
+			pos ++;
+			if ( cmd < 0xf0 )
+				running = cmd;
+		} else if ( !(cmd = running) )
+			return false;
+		if ( cmd < 0xf0 ) {
+			len = (cmd & 0xe0) == 0xc0 ? 1 : 2;	// Cn, Dn: one data byte
+			if ( pos + len > end )
+				return false;
+			if ( (cmd & 0xf0) == 0x90 && data[pos + 1] )
+				info.notes ++;
+			pos += len;
+			continue;
+		}
+		int type = 0;
+		if ( cmd == 0xff ) {
+			if ( pos >= end )
+				return false;
+			type = data[pos++];
+		} else if ( cmd != 0xf0 && cmd != 0xf7 )
+			return false;
+		len = get_var( data, end, pos );
+		if ( len < 0 || len > end - pos )
+			return false;
+		const unsigned char *p = data + pos;
+		pos += len;
+		if ( cmd != 0xff )
+			continue;	// sysex
+		switch ( type ) {
+		case 0x2f:	// end of track
+			info.last_tick = qMax( info.last_tick, tick );
+			return true;
+		case 0x51:	// tempo, fixed with SMPTE timing
+			if ( len < 3 )
+				return false;
+			if ( !smpte )
+				tempos << TempoChange( tick, p[0] << 16 | p[1] << 8 | p[2] );
+			break;
+		case 0x59:	// key signature
+			if ( len < 2 )
+				return false;
+			if ( key_tick < 0 || tick < key_tick ) {
+				key_tick = tick;
+				info.has_key = true;
+				info.sf = static_cast<signed char>( p[0] );
+				info.minor_key = p[1];
+			}
+			break;
+		}
+	}
+	return false;
+}	// end scan_track
+
+static bool tick_order( const TempoChange &a, const TempoChange &b )
+{
+	return a.first < b.first;
+}
+
+// read what the index keeps of one file
+bool MidiLibrary::probe( const QString &path, MidiInfo &info )
+{
+	QFileInfo fi( path );
+	info.mtime = fi.lastModified().toMSecsSinceEpoch();
+	info.size = fi.size();
+	info.ok = info.has_key = info.minor_key = false;
+	info.format = info.tracks = info.ppq = info.sf = 0;
+	info.last_tick = info.notes = 0;
+	info.seconds = 0;
+	info.tempo_min = info.tempo_max = 0;
+	info.error.clear();
+
+	// MidiIndex counts in int
+	if ( info.size > INT_MAX ) {
+		info.error = QString("%1: too big (%2 bytes)") .arg(path) .arg(info.size);
+		return false;
+	}
+	QFile f( path );
+	const unsigned char *data;
+	if ( !f.open(QIODevice::ReadOnly) || !(data = f.map(0, f.size())) ) {
+		info.error = QString("Cannot open %1 - %2") .arg(path) .arg(f.errorString());
+		return false;
+	}
+	int size = f.size();
+	MidiIndex index;
+	if ( !index.build(data, size) ) {
+		info.error = index.error.arg(path);
+		f.unmap( const_cast<uchar *>(data) );
+		return false;
+	}
+	info.format = index.format;
+	info.tracks = index.num_tracks;
+
+	// the same resolution and initial tempo as read_smf()
+	int division = index.time_division;
+	bool smpte = division & 0x8000;
+	int tempo = 500000;
+	if ( !smpte )
+		info.ppq = division;
+	else {
+		division &= 0xff;
+		switch ( 0x80 - ((index.time_division >> 8) & 0x7f) ) {
+		case 24:	info.ppq = 12 * division;	break;
+		case 25:	info.ppq = 10 * division;	tempo = 400000;	break;
+		case 29:	info.ppq = 2997 * division;	tempo = 100000000;	break;
+		case 30:	info.ppq = 15 * division;	break;
+		default:
+			info.error = QString("%1: invalid number of SMPTE frames per second") .arg(path);
+			f.unmap( const_cast<uchar *>(data) );
+			return false;
+		}
+	}
+
+	QVector<TempoChange> tempos;
+	qint64 key_tick = -1;
+	for ( int t = 0; t < index.tracks.size(); ++ t )
+		if ( !scan_track(data, size, index.tracks[t], smpte, tempos, key_tick, info) ) {
+			info.error = QString("%1: invalid MIDI data in track %2") .arg(path) .arg(t + 1);
+			f.unmap( const_cast<uchar *>(data) );
+			return false;
+		}
+	f.unmap( const_cast<uchar *>(data) );
+
+	// length along the merged tempo map; a tempo counts toward the range
+	// if some of the song plays at it
+	std::stable_sort( tempos.begin(), tempos.end(), tick_order );
+	TempoMap map;
+	map.clear( tempo, info.ppq );
+	for ( int n = 0; n < tempos.size(); ++ n )
+		map.append( tempos[n].first, tempos[n].second );
+	info.tempo_min = INT_MAX;
+	info.tempo_max = 0;
+	for ( int n = 0; n < map.changes.size() && map.changes[n].tick < info.last_tick; ++ n ) {
+		info.tempo_min = qMin( info.tempo_min, static_cast<int>(map.changes[n].tempo) );
+		info.tempo_max = qMax( info.tempo_max, static_cast<int>(map.changes[n].tempo) );
+	}
+	if ( !info.tempo_max )
+		info.tempo_min = info.tempo_max = map.tempo( info.last_tick );
+	info.seconds = map.usec( info.last_tick ) / 1000000;
+	info.ok = true;
+	return true;
+}	// end probe
+
+QString MidiLibrary::describe( const MidiInfo &info )
+{
+	static const char *major[] = { "Cb", "Gb", "Db", "Ab", "Eb", "Bb", "F", "C", "G", "D", "A", "E", "B", "F#", "C#" };
+	static const char *minor[] = { "Ab", "Eb", "Bb", "F", "C", "G", "D", "A", "E", "B", "F#", "C#", "G#", "D#", "A#" };
+	if ( !info.ok )
+		return info.error;
+	int secs = static_cast<int>( info.seconds + 0.5 );
+	QString text = QString("%1:%2, %3 tracks, %4 PPQ, ") .arg(secs / 60) .arg(secs % 60, 2, 10, QChar('0'))
+		.arg(info.tracks) .arg(info.ppq);
+	int slow = static_cast<int>( 60000000.0 / info.tempo_max + 0.5 );
+	int fast = static_cast<int>( 60000000.0 / info.tempo_min + 0.5 );
+	text += slow == fast ? QString("%1 BPM") .arg(slow) : QString("%1-%2 BPM") .arg(slow) .arg(fast);
+	if ( info.has_key ) {
+		int sf = qBound( -7, info.sf, 7 ) + 7;
+		text += QString(", %1 %2") .arg(info.minor_key ? minor[sf] : major[sf]) .arg(info.minor_key ? "minor" : "major");
+	}
+	return text + QString(", %1 notes") .arg(info.notes);
+}
@@ -0,0 +1,67 @@
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+#include <QString>
+#include <QStringList>
+#include <QHash>
+#include <QSet>
+#include <QMutex>
+#include <QThreadPool>
+
+class QObject;
+
+// what the library knows of a file, from its header and meta events only
+struct MidiInfo {
+	qint64 mtime;		// ms since the epoch, with size the key of the entry
+	qint64 size;
+	bool ok;		// false: error says why
+	int format;
+	int tracks;
+	int ppq;		// as the player counts, SMPTE files included
+	qint64 last_tick;
+	double seconds;		// along the tempo map
+	int tempo_min, tempo_max;	// usec per quarter
+	bool has_key;		// the first key signature, if any:
+	int sf;			// sharps/flats
+	bool minor_key;
+	qint64 notes;
+	QString error;
+};
+
+// Persistent index of the MIDI files under some directories.  scan() reads
+// new and changed files on a thread pool, without decoding them into
+// events, and drops the ones that are gone; lookup() answers from the
+// index and probes a file it has not seen yet, on a pool of its own when
+// the caller would rather be told later.
+class MidiLibrary
+{
+public:
+	MidiLibrary(const QString &index_file = QString());
+
+	bool loadIndex();
+	bool saveIndex();	// only if something changed
+
+	// index everything below dirs, the number of files read
+	int scan( const QStringList &dirs, int threads = 0 );
+	// the entry of path if it is up to date, else the file is read: right
+	// away without a receiver, otherwise on the pool with false returned,
+	// and member of receiver invoked with the path once it is indexed
+	bool lookup( const QString &path, MidiInfo &info, QObject *receiver = 0, const char *member = 0 );
+	int count();
+
+	static bool probe( const QString &path, MidiInfo &info );
+	static QString describe( const MidiInfo &info );	// one line for the user
+
+private:
+	QString file;
+	QHash<QString, MidiInfo> entries;	// by absolute path
+	QSet<QString> pending;		// queued by lookup()
+	QMutex lock;
+	bool dirty;
+	QThreadPool pool;		// last, so it is done before the rest goes
+
+	friend class LookupTask;
+	void store( const QString &path, const MidiInfo &info );
+};
+
+#endif // LIBRARY_H
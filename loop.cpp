@@ -0,0 +1,340 @@
+// loop.cpp   -- part of MIDI_PLAYER
+// A-B looping: the engines treat the loop end like one more event and wrap
+// when they reach it, so the next pass goes out right behind the current
+// one.  At the seam every sounding note is released and the controller
+// state of the loop start is chased in, prepared here when the loop is set.
+// contains:
+//      setLoop()
+//      setLoopTime()
+//      tick_at_time()
+//      build_chase()
+//      seek_chase()
+//      swap_chase()
+//      chase_wire()
+//      refresh_loop()
+//      wrap_queue()
+//      set_offset()
+//      song_tick()
+
+#include "playerwindow.h"	// hack!
+#include "player.h"
+
+#include <QMutexLocker>
+#include <limits.h>
+
+// chase slots: controllers per channel, then program, bend and pressure
+#define SLOT_PGM (16 * 128)
+#define SLOT_BEND (SLOT_PGM + 16)
+#define SLOT_PRESS (SLOT_BEND + 16)
+#define SLOT_TEMPO (SLOT_PRESS + 16)
+#define SLOTS (SLOT_TEMPO + 1)
+
+// controllers whose last value alone is the state; data entry and the
+// parameter numbers only mean something in sequence, and the channel mode
+// messages are commands
+static bool chased_controller( int cc )
+{
+	return cc < 120 && cc != 6 && cc != 38 && (cc < 96 || cc > 101);
+}
+
+// GM power-on value, for a controller the loop changes but the song has not
+// set before it
+static int controller_default( int cc )
+{
+	switch ( cc ) {
+	case 7:		return 100;	// volume
+	case 10:	return 64;	// pan
+	case 11:	return 127;	// expression
+	case 91:	return 40;	// reverb depth
+	}
+	return cc >= 70 && cc <= 79 ? 64 : 0;	// sound controllers are centered
+}
+
+// the chase slot of an event, -1 if it is not chased
+static int chase_slot( const snd_seq_event_t &ev )
+{
+	int ch = ev.data.control.channel & 0xF;
+	switch ( ev.type ) {
+	case SND_SEQ_EVENT_CONTROLLER:
+		if ( !chased_controller(ev.data.control.param) )
+			return -1;
+		return ch * 128 + ev.data.control.param;
+	case SND_SEQ_EVENT_PGMCHANGE:	return SLOT_PGM + ch;
+	case SND_SEQ_EVENT_PITCHBEND:	return SLOT_BEND + ch;
+	case SND_SEQ_EVENT_CHANPRESS:	return SLOT_PRESS + ch;
+	case SND_SEQ_EVENT_TEMPO:	return SLOT_TEMPO;
+	}
+	return -1;
+}
+
+// the chase events of the wanted slots, per channel in the order a device
+// wants them: the latest of s (at index last[slot]) or, if s has none,
+// the GM default
+static void chase_events( const Song &s, const QVector<qint64> &last, const QVector<bool> &wanted,
+						  QVector<snd_seq_event_t> &chase )
+{
+	snd_seq_event_t ev;
+	for ( int ch = 0; ch < 16; ++ ch ) {
+		// bank select goes before the program, the rest after it
+		static const int order[] = { 0, 32, -1 };
+		for ( int n = 0; n < 3 + 128; ++ n ) {
+			int cc = n < 3 ? order[n] : n - 3;
+			int slot = cc < 0 ? SLOT_PGM + ch : ch * 128 + cc;
+			if ( n >= 3 && (cc == 0 || cc == 32 || !chased_controller(cc)) )
+				continue;
+			if ( !wanted[slot] )
+				continue;
+			snd_seq_ev_clear(&ev);
+			if ( last[slot] >= 0 )
+				ev = s.compiled[last[slot]];
+			else if ( cc < 0 )
+				snd_seq_ev_set_pgmchange(&ev, ch, 0);
+			else
+				snd_seq_ev_set_controller(&ev, ch, cc, controller_default(cc));
+			chase << ev;
+		}
+		if ( wanted[SLOT_BEND + ch] ) {
+			snd_seq_ev_clear(&ev);
+			if ( last[SLOT_BEND + ch] >= 0 )
+				ev = s.compiled[last[SLOT_BEND + ch]];
+			else
+				snd_seq_ev_set_pitchbend(&ev, ch, 0);
+			chase << ev;
+		}
+		if ( wanted[SLOT_PRESS + ch] ) {
+			snd_seq_ev_clear(&ev);
+			if ( last[SLOT_PRESS + ch] >= 0 )
+				ev = s.compiled[last[SLOT_PRESS + ch]];
+			else
+				snd_seq_ev_set_chanpress(&ev, ch, 0);
+			chase << ev;
+		}
+	}
+}
+
+void MidiPlayer::setLoop( qint64 a, qint64 b )
+{
+	Loop l;
+	l.a = qMax( 0LL, a );
+	l.b = qMin( b, last_tick + 1 );
+	l.tempo = 0;
+	if ( l.b <= l.a || song->compiled.isEmpty() )
+		l.a = l.b = 0;
+	else
+		build_chase( l );
+	QMutexLocker lock( &loop_lock );
+	loop = l;
+	loop_serial.ref();
+}
+
+void MidiPlayer::setLoopTime( double a, double b )
+{
+	setLoop( tick_at_time(a), tick_at_time(b) );
+}
+
+// tick of a song time, along the tempo map
+qint64 MidiPlayer::tick_at_time( double seconds )
+{
+	return song->tempo_map.tick( seconds * 1000000 );
+}
+
+// Collect what the loop needs at its start: for every controller, program,
+// bend, pressure and the tempo that [a, b) changes, its value at a.  Only
+// those, so a wrap costs a handful of events however long the song before
+// the loop is.
+void MidiPlayer::build_chase( Loop &l )
+{
+	seek_chase( l.b, l.a, l.chase, l.tempo );
+	// the rawmidi engine sends the same, as one write
+	chase_wire( l.chase, l.chase_wire );
+	qDebug() << "Loop" << l.a << "-" << l.b << "chases" << l.chase.size() << "events" << (l.tempo ? "and the tempo" : "");
+}	// end build_chase
+
+// What a jump from one tick of the song to another has to send: the value
+// at 'to' of every controller, program, bend and pressure the song changes
+// between the two, either way round, and the tempo at 'to' if that changes
+// too (else 0).  A loop wrap jumps from b back to a.
+void MidiPlayer::seek_chase( qint64 from, qint64 to, QVector<snd_seq_event_t> &chase, unsigned &tempo )
+{
+	QVector<qint64> last( SLOTS, -1 );	// latest event before to, per slot
+	QVector<bool> changed( SLOTS, false );	// by an event in between
+	qint64 lo = qMin( from, to );
+	qint64 end = song->find_tick( qMax(from, to) );
+	EventList::Reader events;
+	events.reset( &song->compiled );
+	for ( qint64 i = 0; i < end; ++ i ) {
+		const snd_seq_event_t &ev = events[i];
+		int slot = chase_slot( ev );
+		if ( slot < 0 )
+			continue;
+		if ( ev.time.tick < to )
+			last[slot] = i;
+		if ( ev.time.tick >= lo )
+			changed[slot] = true;
+	}
+
+	chase_events( *song, last, changed, chase );
+	tempo = 0;
+	if ( changed[SLOT_TEMPO] )
+		tempo = last[SLOT_TEMPO] >= 0 ? song->compiled[last[SLOT_TEMPO]].data.queue.param.value : song->initial_tempo;
+}	// end seek_chase
+
+// The state a reloaded song has at tick wherever it differs from the song
+// played so far, and its tempo there if that differs (else 0).  Only the
+// differences, so an edit that leaves the controllers alone chases nothing.
+void MidiPlayer::swap_chase( const Song &from, const Song &to, qint64 tick,
+							 QVector<snd_seq_event_t> &chase, unsigned &tempo )
+{
+	QVector<qint64> was( SLOTS, -1 ), now( SLOTS, -1 );
+	qint64 end = from.find_tick( tick );
+	EventList::Reader events;
+	events.reset( &from.compiled );
+	for ( qint64 i = 0; i < end; ++ i ) {
+		int slot = chase_slot( events[i] );
+		if ( slot >= 0 )
+			was[slot] = i;
+	}
+	end = to.find_tick( tick );
+	events.reset( &to.compiled );
+	for ( qint64 i = 0; i < end; ++ i ) {
+		int slot = chase_slot( events[i] );
+		if ( slot >= 0 )
+			now[slot] = i;
+	}
+	QVector<bool> differs( SLOTS, false );
+	for ( int slot = 0; slot < SLOT_TEMPO; ++ slot ) {
+		if ( was[slot] < 0 )
+			differs[slot] = now[slot] >= 0;
+		else
+			differs[slot] = now[slot] < 0 ||
+				from.compiled[was[slot]].data.control.value != to.compiled[now[slot]].data.control.value;
+	}
+	chase_events( to, now, differs, chase );
+	unsigned before = was[SLOT_TEMPO] >= 0 ? from.compiled[was[SLOT_TEMPO]].data.queue.param.value : from.initial_tempo;
+	unsigned after = now[SLOT_TEMPO] >= 0 ? to.compiled[now[SLOT_TEMPO]].data.queue.param.value : to.initial_tempo;
+	tempo = before != after ? after : 0;
+}	// end swap_chase
+
+// chase events as MIDI bytes, full status, for the rawmidi engine; held
+// notes too, see held_notes()
+void MidiPlayer::chase_wire( const QVector<snd_seq_event_t> &chase, QByteArray &wire )
+{
+	for ( int n = 0; n < chase.size(); ++ n ) {
+		const snd_seq_ev_ctrl_t &c = chase[n].data.control;
+		wire.append( raw_status(chase[n].type) | c.channel );
+		if ( chase[n].type == SND_SEQ_EVENT_NOTEON || chase[n].type == SND_SEQ_EVENT_NOTEOFF ) {
+			wire.append( chase[n].data.note.note );
+			wire.append( chase[n].data.note.velocity );
+		} else if ( chase[n].type == SND_SEQ_EVENT_PITCHBEND ) {
+			wire.append( (c.value + 0x2000) & 0x7F );
+			wire.append( ((c.value + 0x2000) >> 7) & 0x7F );
+		} else if ( chase[n].type == SND_SEQ_EVENT_CONTROLLER ) {
+			wire.append( c.param );
+			wire.append( c.value );
+		} else
+			wire.append( c.value );
+	}
+}
+
+// playback thread: take over a changed loop, true if there was one
+bool MidiPlayer::refresh_loop()
+{
+	if ( loop_serial.loadAcquire() == loop_seen )
+		return false;
+	QMutexLocker lock( &loop_lock );
+	loop_seen = loop_serial.load();
+	play_loop = loop;
+	return true;
+}
+
+// seq engine at the loop end: release what sounds, chase the state of the
+// loop start and move the queue offset on by one pass, all at the seam, so
+// the next pass is queued right behind the current one.  True if the queue
+// had to be moved back instead.
+bool MidiPlayer::wrap_queue( qint64 &offset, qint64 &tempo )
+{
+	const Loop &l = play_loop;
+	qint64 seam = l.b + offset;
+	qint64 next = offset + l.b - l.a;
+	bool moved = false;
+	snd_seq_event_t ev;
+	int err;
+
+	QVector<int> notes = take_notes( false );
+	for ( int n = 0; n < notes.size(); ++ n ) {
+		snd_seq_ev_clear(&ev);
+		snd_seq_ev_set_noteoff(&ev, notes[n] >> 7, notes[n] & 0x7F, 0);
+		snd_seq_ev_schedule_tick(&ev, queue, 0, seam);
+		ev.dest = port;
+		err = seq_output(ev);
+		check_snd("output event", err);
+	}
+	reset_voices();
+
+	if ( l.b + next > UINT_MAX ) {
+		// the next pass would overflow the queue's 32 bit tick: let this one
+		// play out and move the queue back, one short gap in weeks of looping
+		err = seq_drain();
+		check_snd("drain output", err);
+		while ( !stopping() ) {
+			if ( queue_tick() >= seam )
+				break;
+			seq_wait( 1 );
+		}
+		if ( stopping() )
+			return false;
+		snd_seq_ev_clear(&ev);
+		snd_seq_ev_set_queue_pos_tick(&ev, queue, l.a);
+		snd_seq_ev_set_direct(&ev);
+		err = seq_direct(ev);
+		check_snd("set queue position", err);
+		qDebug() << "Loop: queue moved back to tick" << l.a;
+		seam = l.a;
+		next = 0;
+		moved = true;
+	}
+
+	for ( int n = 0; n < l.chase.size(); ++ n ) {
+		ev = l.chase[n];
+		snd_seq_ev_schedule_tick(&ev, queue, 0, seam);
+		ev.dest = port;
+		err = seq_output(ev);
+		check_snd("output event", err);
+	}
+	if ( l.tempo ) {
+		snd_seq_ev_clear(&ev);
+		snd_seq_ev_set_queue_tempo(&ev, queue, l.tempo);
+		snd_seq_ev_schedule_tick(&ev, queue, 0, seam);
+		err = seq_output(ev);
+		check_snd("output event", err);
+		tempo = l.tempo;
+	}
+	// and what is held across the loop start sounds again
+	QVector<snd_seq_event_t> held = held_notes( l.a );
+	for ( int n = 0; n < held.size(); ++ n ) {
+		ev = held[n];
+		snd_seq_ev_schedule_tick(&ev, queue, 0, seam);
+		ev.dest = port;
+		err = seq_output(ev);
+		check_snd("output event", err);
+	}
+	set_offset( seam, moved ? 0 : offset, next );
+	offset = next;
+	return moved;
+}	// end wrap_queue
+
+// the seq engine's offset for getTick(): before and from queue tick 'at'
+void MidiPlayer::set_offset( qint64 at, qint64 before, qint64 after )
+{
+	QMutexLocker lock( &loop_lock );
+	wrap_at = at;
+	offset_before = before;
+	offset_after = after;
+}
+
+// queue tick to song tick, following the wraps queued so far
+qint64 MidiPlayer::song_tick( qint64 queue_tick )
+{
+	QMutexLocker lock( &loop_lock );
+	return qMax( 0LL, queue_tick - (queue_tick >= wrap_at ? offset_after : offset_before) );
+}
@@ -1,10 +1,116 @@
 #include <QApplication>
+#include <QElapsedTimer>
 #include "playerwindow.h"
+#include "player.h"
+#include "playermanager.h"
+#include "library.h"
+
+// MIDI_PLAYER --multi file.mid client:port [client:port ...]
+// plays the file on every port at once, each on a queue of its own, and
+// reports the engine load every second until all of them are done
+static int play_multi( const QStringList &args )
+{
+	PlayerManager manager;
+	if ( !manager.ready() || args.size() < 2 )
+		return 1;
+	for ( int n = 1; n < args.size(); ++ n ) {
+		QStringList addr = args[n].split(':');
+		if ( addr.size() != 2 || manager.addSession(addr[0].toInt(), addr[1].toInt()) < 0 ) {
+			qDebug() << "No such port" << args[n];
+			return 1;
+		}
+	}
+	QString file_name = args[0];
+	if ( !manager.load(0, file_name) )
+		return 1;
+	for ( int n = 1; n < manager.sessionCount(); ++ n )
+		manager.share( 0, n );
+	for ( int n = 0; n < manager.sessionCount(); ++ n )
+		manager.play( n );
+	PlayerManager::Stats st;
+	do {
+		QThread::sleep( 1 );
+		st = manager.takeStats();
+		qDebug() << st.playing << "playing:" << st.cycles << "engine cycles, avg"
+				 << st.cycle_avg_ns / 1000 << "us, max" << st.cycle_max_ns / 1000 << "us, cpu"
+				 << QString::number(st.cpu_load * 100, 'f', 1) + "%";
+	} while ( st.playing );
+	return 0;
+}
+
+// MIDI_PLAYER --index dir [dir ...]
+// brings the library index up to date for everything below the dirs
+static int index_library( const QStringList &dirs )
+{
+	MidiLibrary library;
+	library.loadIndex();
+	library.scan( dirs );
+	return library.saveIndex() ? 0 : 1;
+}
+
+// MIDI_PLAYER --simulate file.mid [ms:step ...]
+// plays the file through the seq engine on a virtual clock, as fast as it
+// goes, and prints what the queue would play, an event a line.  The steps
+// at wall times in ms from Play: pause, resume, seek=tick, speed=factor,
+// loop=a-b in ticks (loop=0-0 turns it off).
+static int simulate( const QStringList &args )
+{
+	if ( args.isEmpty() )
+		return 1;
+	QVector<MidiPlayer::SimStep> script;
+	for ( int n = 1; n < args.size(); ++ n ) {
+		QStringList part = args[n].split(':');
+		QStringList value = part.value(1).split('=');
+		QStringList loop = value.value(1).split('-');
+		MidiPlayer::SimStep step;
+		step.ms = part[0].toLongLong();
+		step.a = value.value(1).toDouble();
+		step.b = 0;
+		if ( value[0] == "pause" )
+			step.action = MidiPlayer::SIM_PAUSE;
+		else if ( value[0] == "resume" )
+			step.action = MidiPlayer::SIM_RESUME;
+		else if ( value[0] == "seek" )
+			step.action = MidiPlayer::SIM_SEEK;
+		else if ( value[0] == "speed" )
+			step.action = MidiPlayer::SIM_SPEED;
+		else if ( value[0] == "loop" && loop.size() == 2 ) {
+			step.action = MidiPlayer::SIM_LOOP;
+			step.a = loop[0].toLongLong();
+			step.b = loop[1].toLongLong();
+		} else {
+			qDebug() << "No such step" << args[n];
+			return 1;
+		}
+		script << step;
+	}
+	// no client of its own
+	MidiPlayer player( static_cast<snd_seq_t *>(NULL) );
+	QString file_name = args[0];
+	if ( !player.parseFile(file_name) )
+		return 1;
+	QTextStream out( stdout );
+	MidiPlayer::SimStats st = player.simulate( script, out );
+	qDebug() << "Simulated" << st.events << "events over" << st.wall_ns / 1000000 << "ms in"
+			 << st.engine_ns / 1000 << "us of the engine," << st.pumps << "engine cycles,"
+			 << (st.engine_ns ? st.events * 1000000000LL / st.engine_ns : 0) << "events/s";
+	return 0;
+}
 
 int main(int argc, char *argv[])
 {
+	QElapsedTimer startup;
+	startup.start();
 	QApplication a(argc, argv);
+	QStringList args = a.arguments();
+	if ( args.size() > 1 && args[1] == "--multi" )
+		return play_multi( args.mid(2) );
+	if ( args.size() > 1 && args[1] == "--index" )
+		return index_library( args.mid(2) );
+	if ( args.size() > 1 && args[1] == "--simulate" )
+		return simulate( args.mid(2) );
 	PlayerWindow w;
+	w.setStartupClock(startup);
 	w.show();
 	return a.exec();
 }
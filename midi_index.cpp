@@ -0,0 +1,220 @@
+// midi_index.cpp   -- part of MIDI_PLAYER
+// validate the chunk structure of a mapped midi file and index its tracks
+// before the real decode, so corrupt files are rejected up front and the
+// decoders get their track boundaries
+// contains:
+//      MidiIndex::build()
+//      MidiIndex::find_eot()
+
+#include "midi_index.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+#define MAKE_ID(c1, c2, c3, c4) ((c1) | ((c2) << 8) | ((c3) << 16) | ((c4) << 24))
+
+static inline int get_id( const unsigned char *p ) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+}
+static inline int get_32_le( const unsigned char *p ) {
+	return get_id(p);
+}
+static inline int get_32_be( const unsigned char *p ) {
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+static inline int get_16_be( const unsigned char *p ) {
+	return (p[0] << 8) | p[1];
+}
+
+// End-of-Track is FF 2F 00.  All scanners return the offset of the first
+// match starting in [from, to - 3], or -1.
+static int scan_eot_scalar( const unsigned char *data, int from, int to )
+{
+	for ( int i = from; i + 3 <= to; ++ i )
+		if ( data[i] == 0xff && data[i + 1] == 0x2f && data[i + 2] == 0x00 )
+			return i;
+	return -1;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static int scan_eot_sse2( const unsigned char *data, int from, int to )
+{
+	const __m128i ff = _mm_set1_epi8( static_cast<char>(0xff) );
+	const __m128i meta = _mm_set1_epi8( 0x2f );
+	const __m128i zero = _mm_setzero_si128();
+	int i = from;
+	// three shifted loads, so a match across two blocks is not missed
+	for ( ; i + 16 + 2 <= to; i += 16 ) {
+		__m128i a = _mm_loadu_si128( reinterpret_cast<const __m128i *>(data + i) );
+		__m128i b = _mm_loadu_si128( reinterpret_cast<const __m128i *>(data + i + 1) );
+		__m128i c = _mm_loadu_si128( reinterpret_cast<const __m128i *>(data + i + 2) );
+		__m128i m = _mm_and_si128( _mm_cmpeq_epi8(a, ff),
+					_mm_and_si128( _mm_cmpeq_epi8(b, meta), _mm_cmpeq_epi8(c, zero) ) );
+		int bits = _mm_movemask_epi8( m );
+		if ( bits )
+			return i + __builtin_ctz( bits );
+	}
+	return scan_eot_scalar( data, i, to );
+}
+
+__attribute__((target("avx2")))
+static int scan_eot_avx2( const unsigned char *data, int from, int to )
+{
+	const __m256i ff = _mm256_set1_epi8( static_cast<char>(0xff) );
+	const __m256i meta = _mm256_set1_epi8( 0x2f );
+	const __m256i zero = _mm256_setzero_si256();
+	int i = from;
+	for ( ; i + 32 + 2 <= to; i += 32 ) {
+		__m256i a = _mm256_loadu_si256( reinterpret_cast<const __m256i *>(data + i) );
+		__m256i b = _mm256_loadu_si256( reinterpret_cast<const __m256i *>(data + i + 1) );
+		__m256i c = _mm256_loadu_si256( reinterpret_cast<const __m256i *>(data + i + 2) );
+		__m256i m = _mm256_and_si256( _mm256_cmpeq_epi8(a, ff),
+					_mm256_and_si256( _mm256_cmpeq_epi8(b, meta), _mm256_cmpeq_epi8(c, zero) ) );
+		unsigned bits = _mm256_movemask_epi8( m );
+		if ( bits )
+			return i + __builtin_ctz( bits );
+	}
+	return scan_eot_sse2( data, i, to );
+}
+#endif
+
+typedef int (*scanner)( const unsigned char *, int, int );
+
+static scanner pick_scanner()
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports("avx2") )
+		return scan_eot_avx2;
+	if ( __builtin_cpu_supports("sse2") )
+		return scan_eot_sse2;
+#endif
+	return scan_eot_scalar;
+}
+
+int MidiIndex::find_eot( const unsigned char *data, int from, int to )
+{
+	// the compiler guards the initialisation, the indexer pool calls this
+	// from several threads at once
+	static const scanner scan = pick_scanner();
+	// a well formed track ends with it, no need to look any further
+	if ( to - from >= 3 && data[to - 3] == 0xff && data[to - 2] == 0x2f && data[to - 1] == 0x00 )
+		return to - 3;
+	// otherwise take the first one; it may sit in a SysEx or text payload,
+	// so the decoder still has the final word
+	return scan( data, from, to );
+}
+
+bool MidiIndex::build( const unsigned char *data, int size )
+{
+	int pos, header_len;
+
+	tracks.clear();
+	error.clear();
+	if ( size < 4 )
+		goto not_smf;
+	switch ( get_id(data) ) {
+	case MAKE_ID('M', 'T', 'h', 'd'):
+		smf = 0;
+		break;
+	case MAKE_ID('R', 'I', 'F', 'F'):
+		// check file type ("RMID" = RIFF MIDI), skipping the file length
+		if ( size < 12 || get_id(data + 8) != MAKE_ID('R', 'M', 'I', 'D') )
+			goto invalid_format;
+		// search for the "data" chunk, it must contain data in SMF format
+		for ( pos = 12;; ) {
+			if ( pos + 8 > size )
+				goto data_not_found;
+			int id = get_id( data + pos );
+			int len = get_32_le( data + pos + 4 );
+			pos += 8;
+			if ( id == MAKE_ID('d', 'a', 't', 'a') )
+				break;
+			if ( len < 0 || len > size - pos )
+				goto data_not_found;
+			pos += (len + 1) & ~1;
+		}
+		if ( pos + 4 > size || get_id(data + pos) != MAKE_ID('M', 'T', 'h', 'd') )
+			goto invalid_format;
+		smf = pos;
+		break;
+	default:
+		goto not_smf;
+	}
+
+	// header chunk: format, number of tracks, time division
+	pos = smf + 4;
+	if ( pos + 4 + 6 > size )
+		goto invalid_format;
+	header_len = get_32_be( data + pos );
+	// at least the three fields, and no further than the end of the file
+	if ( header_len < 6 || header_len > size - pos - 4 )
+		goto invalid_format;
+	pos += 4;
+	format = get_16_be( data + pos );
+	if ( (format != 0) && (format != 1) ) {
+		error = QString("%1: type ") + QString::number(format) + " format is not supported";
+		return false;
+	}
+	// a 16 bit field, so at most 65535 tracks; black MIDI files use thousands
+	num_tracks = get_16_be( data + pos + 2 );
+	if ( num_tracks < 1 ) {
+		error = QString("%1: invalid number of tracks (") + QString::number(num_tracks) + ")";
+		return false;
+	}
+	time_division = get_16_be( data + pos + 4 );
+	pos += header_len;
+
+	// walk the chunks, skipping anything that is not a track
+	tracks.reserve( num_tracks );
+	while ( tracks.size() < num_tracks ) {
+		if ( pos + 8 > size )
+			goto unexpected_eof;
+		int id = get_id( data + pos );
+		int len = get_32_be( data + pos + 4 );
+		if ( len < 0 ) {
+			error = QString("%1: invalid chunk length ") + QString::number(len);
+			return false;
+		}
+		pos += 8;
+		// compared this way round so a huge length can't overflow pos
+		bool cut = len > size - pos;
+		if ( cut )
+			len = size - pos;
+		if ( id == MAKE_ID('M', 'T', 'r', 'k') ) {
+			Chunk track;
+			track.offset = pos;
+			track.length = len;
+			track.eot = find_eot( data, pos, pos + len );
+			// the decoders fail a track without one, but only once they
+			// have been through all of it; a track running past the end
+			// of the file is only usable if it still ends properly
+			if ( track.eot < 0 ) {
+				if ( cut )
+					goto unexpected_eof;
+				error = QString("%1: no End of Track in track ") + QString::number(tracks.size() + 1);
+				return false;
+			}
+			tracks.append( track );
+		} else if ( cut )
+			goto unexpected_eof;
+		pos += len;
+	}
+	return true;
+
+not_smf:
+	error = "%1 is not a Standard MIDI File";
+	return false;
+invalid_format:
+	error = "%1: invalid file format";
+	return false;
+data_not_found:
+	error = "%1: data chunk not found";
+	return false;
+unexpected_eof:
+	error = "%1: unexpected end of file";
+	return false;
+}	// end build
@@ -0,0 +1,32 @@
+#ifndef MIDI_INDEX_H
+#define MIDI_INDEX_H
+
+#include <QString>
+#include <QVector>
+
+// chunk level index of a mapped SMF or RIFF/RMID image, built in one pass
+// before any event is decoded
+class MidiIndex
+{
+public:
+	struct Chunk {
+		int offset;	// first byte after the chunk header
+		int length;	// as declared, cut at the end of a damaged file
+		int eot;	// offset of the End-of-Track meta, -1 if not found
+	};
+
+	bool build( const unsigned char *data, int size );
+
+	int smf;		// offset of "MThd" (inside the "data" chunk for RMID)
+	int format;
+	int num_tracks;
+	int time_division;
+	QVector<Chunk> tracks;	// the MTrk chunks, in file order
+
+	// why build() failed, "%1" stands for the file name
+	QString error;
+
+	static int find_eot( const unsigned char *data, int from, int to );
+};
+
+#endif // MIDI_INDEX_H
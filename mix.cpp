@@ -0,0 +1,151 @@
+// mix.cpp   -- part of MIDI_PLAYER
+// channel and track mute/solo, applied by the engines at schedule time:
+// the GUI side edits the settings and publishes a ready-made "audible"
+// mask, the playback thread picks it up between two events
+// contains:
+//      setChannelMute()
+//      setChannelSolo()
+//      setTrackMute()
+//      setTrackSolo()
+//      clearMix()
+//      publish_mix()
+//      refresh_mix()
+//      reset_notes()
+//      take_notes()
+//      take_track_notes()
+
+#include "playerwindow.h"	// hack!
+#include "player.h"
+
+#include <QMutexLocker>
+
+static void set_bit( QVector<quint32> &bits, int n, bool on )
+{
+	if ( n < 0 || (n >> 5) >= bits.size() )
+		return;
+	if ( on )
+		bits[n >> 5] |= 1u << (n & 31);
+	else
+		bits[n >> 5] &= ~(1u << (n & 31));
+}
+
+void MidiPlayer::setChannelMute( int channel, bool on )
+{
+	QMutexLocker lock( &mix_lock );
+	if ( on )
+		channel_mute |= 1 << (channel & 0xF);
+	else
+		channel_mute &= ~(1 << (channel & 0xF));
+	publish_mix();
+}
+
+void MidiPlayer::setChannelSolo( int channel, bool on )
+{
+	QMutexLocker lock( &mix_lock );
+	if ( on )
+		channel_solo |= 1 << (channel & 0xF);
+	else
+		channel_solo &= ~(1 << (channel & 0xF));
+	publish_mix();
+}
+
+void MidiPlayer::setTrackMute( int track, bool on )
+{
+	QMutexLocker lock( &mix_lock );
+	set_bit( track_mute, track, on );
+	publish_mix();
+}
+
+void MidiPlayer::setTrackSolo( int track, bool on )
+{
+	QMutexLocker lock( &mix_lock );
+	set_bit( track_solo, track, on );
+	publish_mix();
+}
+
+void MidiPlayer::clearMix()
+{
+	QMutexLocker lock( &mix_lock );
+	channel_mute = channel_solo = 0;
+	track_mute.fill( 0 );
+	track_solo.fill( 0 );
+	publish_mix();
+}
+
+// rebuild the audible masks from the settings, with mix_lock held.
+// Solo wins over mute's absence: with any solo set only soloed channels
+// (tracks) are heard, and a muted one stays muted either way.
+void MidiPlayer::publish_mix()
+{
+	int words = (song->tracks + 31) >> 5;
+	track_mute.resize( words );
+	track_solo.resize( words );
+	bool any_solo = false;
+	for ( int w = 0; w < words; ++ w )
+		any_solo |= track_solo[w] != 0;
+	mix_tracks.resize( words );
+	for ( int w = 0; w < words; ++ w )
+		mix_tracks[w] = (any_solo ? track_solo[w] : ~0u) & ~track_mute[w];
+	mix_channels = (channel_solo ? channel_solo : 0xFFFF) & ~channel_mute;
+	mix_serial.ref();
+}
+
+// playback thread: take over a changed mix, true if there was one
+bool MidiPlayer::refresh_mix()
+{
+	if ( mix_serial.loadAcquire() == mix_seen )
+		return false;
+	QMutexLocker lock( &mix_lock );
+	mix_seen = mix_serial.load();
+	play_channels = mix_channels;
+	play_tracks = mix_tracks;
+	play_track_bits = play_tracks.constData();
+	return true;
+}
+
+void MidiPlayer::reset_notes()
+{
+	memset( note_count, 0, sizeof(note_count) );
+	memset( note_track, 0, sizeof(note_track) );
+	memset( sent_key, 0xff, sizeof(sent_key) );	// all -1
+	mix_seen = -1;		// pick up the current mix before the first event
+}
+
+// notes let through and still sounding, only those the current mix mutes
+// or all of them (at a loop wrap); each comes back once per note-on, as
+// channel << 7 | the key it went out on, and is forgotten
+QVector<int> MidiPlayer::take_notes( bool muted_only )
+{
+	QVector<int> notes;
+	for ( int ch = 0; ch < 16; ++ ch )
+		for ( int key = 0; key < 128; ++ key ) {
+			if ( !note_count[ch][key] || (muted_only && audible(ch, note_track[ch][key])) )
+				continue;
+			int sent = sent_key[ch][key] >= 0 ? sent_key[ch][key] : key;
+			for ( int n = note_count[ch][key]; n > 0; -- n )
+				notes << (ch << 7 | sent);
+			note_count[ch][key] = 0;
+			sent_key[ch][key] = -1;
+		}
+	return notes;
+}
+
+// the same for the notes of some tracks (one bit per track), when a
+// reload swaps them out under the engine
+QVector<int> MidiPlayer::take_track_notes( const QVector<quint32> &tracks )
+{
+	QVector<int> notes;
+	for ( int ch = 0; ch < 16; ++ ch )
+		for ( int key = 0; key < 128; ++ key ) {
+			unsigned track = note_track[ch][key];
+			if ( !note_count[ch][key] || (track >> 5) >= static_cast<unsigned>(tracks.size()) ||
+				 !((tracks[track >> 5] >> (track & 31)) & 1) )
+				continue;
+			int sent = sent_key[ch][key] >= 0 ? sent_key[ch][key] : key;
+			for ( int n = note_count[ch][key]; n > 0; -- n )
+				notes << (ch << 7 | sent);
+			note_count[ch][key] = 0;
+			sent_key[ch][key] = -1;
+		}
+	return notes;
+}
@@ -0,0 +1,80 @@
+// mixerdialog.cpp   -- part of MIDI_PLAYER
+// table of channels and tracks with mute and solo check boxes; every
+// click goes straight to the player, the engines pick it up while playing
+// contains:
+//      MixerDialog()
+//      reload()
+//      itemChanged()
+//      clearAll()
+
+#include "mixerdialog.h"
+#include "playerwindow.h"	// hack!
+#include "player.h"
+
+#include <QTableWidget>
+#include <QHeaderView>
+#include <QPushButton>
+#include <QVBoxLayout>
+
+enum { COL_NAME, COL_MUTE, COL_SOLO };
+
+MixerDialog::MixerDialog(MidiPlayer *player, QWidget *parent) :
+	QDialog(parent),
+	player(player)
+{
+	setWindowTitle("Mix");
+	table = new QTableWidget(0, 3, this);
+	table->setHorizontalHeaderLabels(QStringList() << "" << "Mute" << "Solo");
+	table->verticalHeader()->hide();
+	table->horizontalHeader()->setSectionResizeMode(COL_NAME, QHeaderView::Stretch);
+	QPushButton *clear = new QPushButton("&Clear", this);
+	QVBoxLayout *layout = new QVBoxLayout(this);
+	layout->addWidget(table);
+	layout->addWidget(clear);
+	connect(table, SIGNAL(itemChanged(QTableWidgetItem*)), this, SLOT(itemChanged(QTableWidgetItem*)));
+	connect(clear, SIGNAL(clicked()), this, SLOT(clearAll()));
+	reload();
+}
+
+void MixerDialog::reload()
+{
+	int tracks = player->trackCount();
+	table->blockSignals(true);
+	table->setRowCount(16 + tracks);
+	for ( int row = 0; row < 16 + tracks; row ++ ) {
+		QTableWidgetItem *name = new QTableWidgetItem(row < 16 ?
+			QString("Channel %1").arg(row + 1) : QString("Track %1").arg(row - 16 + 1));
+		name->setFlags(Qt::ItemIsEnabled);
+		table->setItem(row, COL_NAME, name);
+		for ( int col = COL_MUTE; col <= COL_SOLO; col ++ ) {
+			QTableWidgetItem *box = new QTableWidgetItem;
+			box->setFlags(Qt::ItemIsEnabled | Qt::ItemIsUserCheckable);
+			box->setCheckState(Qt::Unchecked);
+			table->setItem(row, col, box);
+		}
+	}
+	table->blockSignals(false);
+}
+
+void MixerDialog::itemChanged(QTableWidgetItem *item)
+{
+	bool on = item->checkState() == Qt::Checked;
+	int row = item->row();
+	if ( item->column() == COL_MUTE ) {
+		if ( row < 16 )
+			player->setChannelMute(row, on);
+		else
+			player->setTrackMute(row - 16, on);
+	} else if ( item->column() == COL_SOLO ) {
+		if ( row < 16 )
+			player->setChannelSolo(row, on);
+		else
+			player->setTrackSolo(row - 16, on);
+	}
+}
+
+void MixerDialog::clearAll()
+{
+	player->clearMix();
+	reload();
+}
@@ -0,0 +1,30 @@
+#ifndef MIXERDIALOG_H
+#define MIXERDIALOG_H
+
+#include <QDialog>
+
+class MidiPlayer;
+class QTableWidget;
+class QTableWidgetItem;
+
+// mute and solo for the 16 channels and every track of the loaded song
+class MixerDialog : public QDialog
+{
+	Q_OBJECT
+
+public:
+	MixerDialog(MidiPlayer *player, QWidget *parent = 0);
+
+	// rebuild the rows after a song was loaded, everything unmuted
+	void reload();
+
+private slots:
+	void itemChanged(QTableWidgetItem *item);
+	void clearAll();
+
+private:
+	MidiPlayer *player;
+	QTableWidget *table;
+};
+
+#endif // MIXERDIALOG_H
@@ -0,0 +1,256 @@
+// notes.cpp   -- part of MIDI_PLAYER
+// the notes of a song as intervals, from note-on to release, in an
+// implicit interval tree: sorted by note-on, each node of the balanced
+// tree over that order knowing the latest release below it.  The engines
+// ask it which notes are held where they pick the song up in the middle
+// (a resume, a seek, a loop wrap) and sound those again.  The piano roll
+// draws from a density pyramid built from the same notes.
+// contains:
+//      index_notes()
+//      sounding()
+//      overlapping()
+//      build_roll()
+//      seek()
+//      held_notes()
+//      resume_queue()
+
+#include "playerwindow.h"	// hack!
+#include "player.h"
+
+#include <QElapsedTimer>
+
+// cells of the finest level of the piano roll, over the whole song
+#define ROLL_CELLS 8192
+
+// fill in the latest release of [lo, hi) at its middle, and return it
+static qint64 build_reach( Song &s, qint64 lo, qint64 hi )
+{
+	if ( lo >= hi )
+		return -1;
+	qint64 mid = lo + (hi - lo) / 2;
+	qint64 reach = qMax( s.notes[mid].off, qMax(build_reach(s, lo, mid), build_reach(s, mid + 1, hi)) );
+	s.note_reach[mid] = reach;
+	return reach;
+}
+
+// A note-off ends the oldest note still open on its key and channel, the
+// way the engines count them (see mix_pass()); a note-on with velocity 0
+// is a note-off.  Notes never released end with the song.
+void Song::index_notes()
+{
+	QElapsedTimer timer;
+	timer.start();
+	notes.clear();
+	note_reach.clear();
+	// the open notes of each key, a queue linked through next
+	QVector<qint64> head( 16 * 128, -1 ), tail( 16 * 128, -1 );
+	ChunkedList<qint64> next;
+	for ( qint64 i = 0; i < all_events.size(); ++ i ) {
+		const event &e = all_events[i];
+		if ( e.type != SND_SEQ_EVENT_NOTEON && e.type != SND_SEQ_EVENT_NOTEOFF )
+			continue;
+		int k = (e.data.d[0] & 0xF) << 7 | (e.data.d[1] & 0x7F);
+		if ( e.type == SND_SEQ_EVENT_NOTEON && e.data.d[2] ) {
+			note n;
+			n.on = e.tick;
+			n.off = -1;
+			n.track = e.track;
+			n.channel = e.data.d[0] & 0xF;
+			n.key = e.data.d[1] & 0x7F;
+			n.velocity = e.data.d[2];
+			if ( tail[k] >= 0 )
+				next[tail[k]] = notes.size();
+			else
+				head[k] = notes.size();
+			tail[k] = notes.size();
+			notes.push_back( n );
+			next.push_back( -1 );
+		} else if ( head[k] >= 0 ) {
+			notes[head[k]].off = e.tick;
+			head[k] = next[head[k]];
+			if ( head[k] < 0 )
+				tail[k] = -1;
+		}
+	}
+	for ( int k = 0; k < 16 * 128; ++ k )
+		for ( qint64 n = head[k]; n >= 0; n = next[n] )
+			notes[n].off = last_tick + 1;
+
+	for ( qint64 n = 0; n < notes.size(); ++ n )
+		note_reach.push_back( 0 );
+	build_reach( *this, 0, notes.size() );
+	qDebug() << "Indexed" << notes.size() << "notes in" << timer.nsecsElapsed() / 1000 << "us";
+}	// end index_notes
+
+// O(log n) nodes down to the first note sounding, then each further one
+// at O(log n) at most: a subtree is left out as soon as all of it is
+// released by from, or starts at to or after it
+static bool find_overlapping( const Song &s, qint64 lo, qint64 hi, qint64 from, qint64 to,
+							  QVector<qint64> &found, int limit )
+{
+	while ( lo < hi ) {
+		qint64 mid = lo + (hi - lo) / 2;
+		if ( s.note_reach[mid] <= from )
+			return true;
+		if ( !find_overlapping(s, lo, mid, from, to, found, limit) )
+			return false;
+		if ( s.notes[mid].on >= to )
+			return true;
+		if ( s.notes[mid].off > from ) {
+			if ( found.size() >= limit )
+				return false;
+			found << mid;
+		}
+		lo = mid + 1;
+	}
+	return true;
+}
+
+void Song::sounding( qint64 tick, QVector<qint64> &found ) const
+{
+	find_overlapping( *this, 0, notes.size(), tick, tick + 1, found, INT_MAX );
+}
+
+bool Song::overlapping( qint64 from, qint64 to, QVector<qint64> &found, int limit ) const
+{
+	return find_overlapping( *this, 0, notes.size(), from, to, found, limit );
+}
+
+// The density pyramid of the piano roll, from the notes: level 0 adds up
+// the part of each cell a note covers, whole cells in between through a
+// running count, so a note costs the same however long it is.  Every
+// level above takes the mean of two cells, rounded up so that a short
+// note does not vanish at any zoom.
+void Song::build_roll()
+{
+	QElapsedTimer timer;
+	timer.start();
+	roll.clear();
+	roll_bucket = qMax( 1LL, (last_tick + ROLL_CELLS) / ROLL_CELLS );
+	int cells = last_tick / roll_bucket + 1;	// the last note ends by last_tick + 1
+	QVector<qint64> part( cells * 128, 0 );		// ticks covered in cells partly covered
+	QVector<int> whole( (cells + 1) * 128, 0 );	// notes starting (ending) to cover whole cells
+	for ( qint64 n = 0; n < notes.size(); ++ n ) {
+		const note &nt = notes[n];
+		if ( nt.off <= nt.on )
+			continue;
+		qint64 c0 = nt.on / roll_bucket, c1 = (nt.off - 1) / roll_bucket;
+		if ( c0 == c1 ) {
+			part[c0 * 128 + nt.key] += nt.off - nt.on;
+			continue;
+		}
+		part[c0 * 128 + nt.key] += (c0 + 1) * roll_bucket - nt.on;
+		part[c1 * 128 + nt.key] += nt.off - c1 * roll_bucket;
+		whole[(c0 + 1) * 128 + nt.key] ++;
+		whole[c1 * 128 + nt.key] --;
+	}
+	QByteArray level( cells * 128, 0 );
+	int covering[128] = { 0 };
+	for ( int c = 0; c < cells; ++ c )
+		for ( int key = 0; key < 128; ++ key ) {
+			covering[key] += whole[c * 128 + key];
+			qint64 ticks = part[c * 128 + key] + covering[key] * roll_bucket;
+			level[c * 128 + key] = static_cast<char>( qMin(255LL, (ticks * 255 + roll_bucket - 1) / roll_bucket) );
+		}
+	roll << level;
+	while ( cells > 1 ) {
+		const QByteArray &below = roll.last();
+		int up = (cells + 1) / 2;
+		QByteArray next( up * 128, 0 );
+		for ( int c = 0; c < up; ++ c )
+			for ( int key = 0; key < 128; ++ key ) {
+				int a = static_cast<unsigned char>( below[2 * c * 128 + key] );
+				int b = 2 * c + 1 < cells ? static_cast<unsigned char>( below[(2 * c + 1) * 128 + key] ) : 0;
+				next[c * 128 + key] = static_cast<char>( (a + b + 1) / 2 );
+			}
+		roll << next;
+		cells = up;
+	}
+	qDebug() << "Piano roll:" << roll.size() << "levels of" << roll_bucket << "ticks and up in" << timer.nsecsElapsed() / 1000 << "us";
+}	// end build_roll
+
+// Move the paused player to tick: resumePlayer() plays on from there.  The
+// controllers, programs and tempo the jump skips over are chased then, and
+// the notes held at tick are sounded again.
+void MidiPlayer::seek( qint64 tick )
+{
+	tick = qBound( 0LL, tick, last_tick );
+	seek_state.clear();
+	seek_chase( paused_tick, tick, seek_state, seek_tempo );
+	// the queue carries on from where it stopped
+	resume_offset += currentTick - tick;
+	currentTick = tick;
+	qDebug() << "Seek from tick" << paused_tick << "to" << tick << "chases" << seek_state.size() << "events"
+			 << (seek_tempo ? "and the tempo" : "");
+}
+
+// The notes held at tick, begun before it and released after it, as the
+// engine would have let them through: under the current mix, the
+// polyphony budget and the transposition.  A culled key comes with its
+// release first, as in pump().
+QVector<snd_seq_event_t> MidiPlayer::held_notes( qint64 tick )
+{
+	QVector<snd_seq_event_t> held;
+	QVector<qint64> found;
+	play_song->sounding( tick, found );
+	for ( int n = 0; n < found.size(); ++ n ) {
+		const Song::note &note = play_song->notes[found[n]];
+		if ( note.on == tick || !audible(note.channel, note.track) )
+			continue;	// the first goes out with the song anyway
+		note_count[note.channel][note.key] ++;
+		note_track[note.channel][note.key] = note.track;
+		snd_seq_event_t ev;
+		snd_seq_ev_clear(&ev);
+		snd_seq_ev_set_noteon(&ev, note.channel, note.key, note.velocity);
+		if ( polyphony ) {
+			Cull cl = cull_note( ev );
+			if ( cl == CULL_DROP )
+				continue;
+			if ( cl == CULL_RETRIGGER ) {
+				snd_seq_event_t off = ev;
+				off.type = SND_SEQ_EVENT_NOTEOFF;
+				off.data.note.velocity = 0;
+				if ( transpose_note(off) )
+					held << off;
+			}
+		}
+		if ( transpose_note(ev) )
+			held << ev;
+	}
+	if ( !found.isEmpty() )
+		qDebug() << "Tick" << tick << ":" << found.size() << "notes sounding," << held.size() << "sent again";
+	return held;
+}	// end held_notes
+
+// seq engine picking the song up at currentTick, queue tick at: what a seek
+// left to chase, then the notes held there
+void MidiPlayer::resume_queue( qint64 at )
+{
+	snd_seq_event_t ev;
+	int err;
+	refresh_mix();
+	for ( int n = 0; n < seek_state.size(); ++ n ) {
+		ev = seek_state[n];
+		snd_seq_ev_schedule_tick(&ev, queue, 0, at);
+		ev.dest = port;
+		err = seq_output(ev);
+		check_snd("output event", err);
+	}
+	if ( seek_tempo ) {
+		snd_seq_ev_clear(&ev);
+		snd_seq_ev_set_queue_tempo(&ev, queue, seek_tempo);
+		snd_seq_ev_schedule_tick(&ev, queue, 0, at);
+		err = seq_output(ev);
+		check_snd("output event", err);
+	}
+	seek_state.clear();
+	seek_tempo = 0;
+	QVector<snd_seq_event_t> held = held_notes( currentTick );
+	for ( int n = 0; n < held.size(); ++ n ) {
+		ev = held[n];
+		snd_seq_ev_schedule_tick(&ev, queue, 0, at);
+		ev.dest = port;
+		err = seq_output(ev);
+		check_snd("output event", err);
+	}
+}	// end resume_queue
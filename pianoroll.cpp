@@ -0,0 +1,278 @@
+// pianoroll.cpp   -- part of MIDI_PLAYER
+// the piano roll window: a column of pixels per span of ticks, a row per
+// key, drawn from the song's density pyramid (see Song::build_roll()) so
+// that a frame costs the same at any zoom and however many notes the song
+// has.  Zoomed in far enough it draws the notes themselves.
+// contains:
+//      PianoRoll()
+//      reload()
+//      clear()
+//      setPosition()
+//      paintEvent()
+//      mousePressEvent()
+//      wheelEvent()
+//      render_roll()
+//      render_notes()
+//      render_overview()
+
+#include "pianoroll.h"
+#include "playerwindow.h"	// hack!
+#include "player.h"
+
+#include <QPainter>
+#include <QMouseEvent>
+#include <QWheelEvent>
+#include <QElapsedTimer>
+
+#define TIMELINE_HEIGHT 32
+// at most this many notes drawn one by one, else from the pyramid
+#define ROLL_EXACT_NOTES 20000
+// closest zoom, ticks across the window
+#define ROLL_MIN_SPAN 64
+#define ROLL_REPORT_FRAMES 100
+
+#define ROLL_BACKGROUND qRgb(24, 24, 24)
+#define ROLL_C_ROW qRgb(40, 40, 40)
+#define TIMELINE_BACKGROUND qRgb(48, 48, 48)
+#define TIMELINE_BAR qRgb(96, 160, 128)
+
+// a cell or a note of density (velocity) v, 1..255
+static QRgb shade( int v )
+{
+	int g = 64 + v * 191 / 255;
+	return qRgb( g / 4, g, g / 2 );
+}
+
+PianoRoll::PianoRoll(MidiPlayer *player, QWidget *parent) :
+	QWidget(parent),
+	player(player)
+{
+	setWindowFlags(Qt::Window);
+	setWindowTitle("Piano roll");
+	setMinimumSize(200, 128 + TIMELINE_HEIGHT);
+	resize(800, 400);
+	frames = 0;
+	frame_sum_ns = frame_max_ns = 0;
+	reload();
+}
+
+void PianoRoll::reload()
+{
+	song = player->getSong();
+	position = -1;
+	frame = QImage();
+	overview = QImage();
+	from = 0;
+	span = song_span();
+	update();
+}
+
+void PianoRoll::clear()
+{
+	song.clear();
+	frame = QImage();
+	overview = QImage();
+	update();
+}
+
+void PianoRoll::setPosition( qint64 tick )
+{
+	position = tick;
+	if ( song && tick >= 0 && (tick < from || tick >= from + span) )
+		set_view( tick - span / 8, span );
+	update();
+}
+
+QRect PianoRoll::roll_rect()
+{
+	return QRect( 0, 0, width(), height() - TIMELINE_HEIGHT - 2 );
+}
+
+QRect PianoRoll::timeline_rect()
+{
+	return QRect( 0, height() - TIMELINE_HEIGHT, width(), TIMELINE_HEIGHT );
+}
+
+qint64 PianoRoll::song_span()
+{
+	return song ? song->last_tick + 1 : 1;
+}
+
+qint64 PianoRoll::tick_at( int x, int width )
+{
+	return from + x * span / width;
+}
+
+// ticks from start on, within the song
+void PianoRoll::set_view( qint64 start, qint64 ticks )
+{
+	qint64 total = song_span();
+	span = qBound( qMin((qint64)ROLL_MIN_SPAN, total), ticks, total );
+	from = qBound( 0LL, start, total - span );
+	update();
+}
+
+void PianoRoll::paintEvent(QPaintEvent *)
+{
+	QElapsedTimer timer;
+	timer.start();
+	QPainter p(this);
+	QRect roll = roll_rect(), line = timeline_rect();
+	if ( !song ) {
+		p.fillRect( rect(), QColor(ROLL_BACKGROUND) );
+		return;
+	}
+	render_roll( roll.width() );
+	p.drawImage( roll, frame );
+	if ( overview.width() != line.width() )
+		render_overview( line.width() );
+	p.drawImage( line.topLeft(), overview );
+	// where the view is in the whole song, and the playhead in both
+	qint64 total = song_span();
+	p.setPen( Qt::white );
+	p.drawRect( line.left() + from * line.width() / total, line.top(),
+				qMax( 1LL, span * line.width() / total ) - 1, line.height() - 1 );
+	if ( position >= 0 ) {
+		p.setPen( Qt::red );
+		if ( position >= from && position < from + span ) {
+			int x = (position - from) * roll.width() / span;
+			p.drawLine( x, roll.top(), x, roll.bottom() );
+		}
+		int x = position * line.width() / total;
+		p.drawLine( x, line.top(), x, line.bottom() );
+	}
+
+	qint64 ns = timer.nsecsElapsed();
+	frame_sum_ns += ns;
+	frame_max_ns = qMax( frame_max_ns, ns );
+	if ( ++ frames == ROLL_REPORT_FRAMES ) {
+		qDebug() << "Piano roll:" << frames << "frames of" << roll.width() << "columns, avg"
+				 << frame_sum_ns / frames / 1000 << "us, max" << frame_max_ns / 1000 << "us";
+		frames = 0;
+		frame_sum_ns = frame_max_ns = 0;
+	}
+}	// end paintEvent
+
+// in the roll: seek there; in the timeline: look there
+void PianoRoll::mousePressEvent(QMouseEvent *event)
+{
+	if ( !song )
+		return;
+	QRect line = timeline_rect();
+	if ( event->pos().y() >= line.top() )
+		set_view( event->pos().x() * song_span() / line.width() - span / 2, span );
+	else
+		emit seek( tick_at(event->pos().x(), roll_rect().width()) );
+}
+
+// zoom in or out around the tick under the mouse
+void PianoRoll::wheelEvent(QWheelEvent *event)
+{
+	if ( !song )
+		return;
+	qint64 at = tick_at( event->pos().x(), roll_rect().width() );
+	qint64 ticks = event->angleDelta().y() > 0 ? span * 4 / 5 : span * 5 / 4 + 1;
+	set_view( at - (at - from) * ticks / span, ticks );
+	event->accept();
+}
+
+// The view into frame, width columns of 128 keys, high keys on top.  Each
+// column comes from the coarsest level of the pyramid whose cells are no
+// longer than a column, the mean of the one or two cells it covers; so
+// O(width) whatever the zoom.  Kept until the view changes.
+void PianoRoll::render_roll( int width )
+{
+	if ( frame.width() == width && frame_from == from && frame_span == span )
+		return;
+	frame = QImage( width, 128, QImage::Format_RGB32 );
+	frame_from = from;
+	frame_span = span;
+	QRgb *rows[128];
+	for ( int key = 0; key < 128; ++ key ) {
+		rows[key] = reinterpret_cast<QRgb *>( frame.scanLine(127 - key) );
+		QRgb bg = key % 12 ? ROLL_BACKGROUND : ROLL_C_ROW;
+		for ( int x = 0; x < width; ++ x )
+			rows[key][x] = bg;
+	}
+	if ( song->roll.isEmpty() )
+		return;
+	if ( span < song->roll_bucket * width && render_notes(width) )
+		return;
+
+	int level = 0;
+	while ( level + 1 < song->roll.size() && (song->roll_bucket << (level + 1)) * width <= span )
+		++ level;
+	qint64 bucket = song->roll_bucket << level;
+	const QByteArray &level_cells = song->roll[level];
+	const unsigned char *data = reinterpret_cast<const unsigned char *>( level_cells.constData() );
+	qint64 cells = level_cells.size() / 128;
+	for ( int x = 0; x < width; ++ x ) {
+		qint64 c0 = tick_at( x, width ) / bucket;
+		if ( c0 >= cells )
+			break;
+		qint64 c1 = qMin( cells, qMax(c0 + 1, (tick_at(x + 1, width) + bucket - 1) / bucket) );
+		int n = c1 - c0;
+		const unsigned char *cell = data + c0 * 128;
+		for ( int key = 0; key < 128; ++ key ) {
+			int sum = 0;
+			for ( int c = 0; c < n; ++ c )
+				sum += cell[c * 128 + key];
+			if ( sum )
+				rows[key][x] = shade( (sum + n - 1) / n );
+		}
+	}
+}	// end render_roll
+
+// the notes in view one by one, shaded by velocity, if there are few
+// enough of them; false leaves frame as it was
+bool PianoRoll::render_notes( int width )
+{
+	QVector<qint64> found;
+	if ( !song->overlapping(from, from + span, found, ROLL_EXACT_NOTES) )
+		return false;
+	for ( int n = 0; n < found.size(); ++ n ) {
+		const Song::note &note = song->notes[found[n]];
+		int x0 = qMax( 0LL, (note.on - from) * width / span );
+		int x1 = qMin( (qint64)width, qMax(x0 + 1LL, (note.off - from) * width / span) );
+		QRgb *row = reinterpret_cast<QRgb *>( frame.scanLine(127 - note.key) );
+		QRgb c = shade( note.velocity * 2 + 1 );
+		for ( int x = x0; x < x1; ++ x )
+			row[x] = c;
+		// a dark first column tells repeated notes apart
+		if ( x1 - x0 > 2 && note.on >= from )
+			row[x0] = ROLL_BACKGROUND;
+	}
+	return true;
+}	// end render_notes
+
+// the whole song as how much sounds when, bars up from the bottom
+void PianoRoll::render_overview( int width )
+{
+	overview = QImage( width, TIMELINE_HEIGHT, QImage::Format_RGB32 );
+	overview.fill( TIMELINE_BACKGROUND );
+	if ( song->roll.isEmpty() )
+		return;
+	int level = 0;
+	while ( level + 1 < song->roll.size() && song->roll[level].size() / 128 > width )
+		++ level;
+	const QByteArray &level_cells = song->roll[level];
+	const unsigned char *data = reinterpret_cast<const unsigned char *>( level_cells.constData() );
+	qint64 cells = level_cells.size() / 128;
+	QVector<int> load( width, 0 );
+	int most = 1;
+	for ( int x = 0; x < width; ++ x ) {
+		qint64 c0 = x * cells / width, c1 = qMax( c0 + 1, (x + 1) * cells / width );
+		int sum = 0;
+		for ( qint64 c = c0; c < c1; ++ c )
+			for ( int key = 0; key < 128; ++ key )
+				sum += data[c * 128 + key];
+		load[x] = sum / (c1 - c0);
+		most = qMax( most, load[x] );
+	}
+	for ( int y = 0; y < TIMELINE_HEIGHT; ++ y ) {
+		QRgb *row = reinterpret_cast<QRgb *>( overview.scanLine(y) );
+		for ( int x = 0; x < width; ++ x )
+			if ( load[x] && (qint64)load[x] * TIMELINE_HEIGHT >= (qint64)(TIMELINE_HEIGHT - y - 1) * most )
+				row[x] = TIMELINE_BAR;
+	}
+}	// end render_overview
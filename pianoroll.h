@@ -0,0 +1,57 @@
+#ifndef PIANOROLL_H
+#define PIANOROLL_H
+
+#include <QWidget>
+#include <QImage>
+
+#include "song.h"
+
+class MidiPlayer;
+
+// the loaded song as a piano roll, above a timeline of the whole of it.
+// A click in the roll seeks there, one in the timeline moves the view
+// there, the wheel zooms.
+class PianoRoll : public QWidget
+{
+	Q_OBJECT
+
+public:
+	PianoRoll(MidiPlayer *player, QWidget *parent = 0);
+
+	// show the player's song, from the start
+	void reload();
+	// let go of the song, so a load can free it
+	void clear();
+	// the playhead; the view follows it
+	void setPosition( qint64 tick );
+
+signals:
+	void seek( qint64 tick );
+
+protected:
+	void paintEvent(QPaintEvent *event);
+	void mousePressEvent(QMouseEvent *event);
+	void wheelEvent(QWheelEvent *event);
+
+private:
+	MidiPlayer *player;
+	SongPtr song;
+	qint64 from, span;		// the ticks in view
+	qint64 position;		// the playhead, -1 = none
+	QImage frame;			// a pixel per column and key, see render_roll()
+	qint64 frame_from, frame_span;	// what frame shows
+	QImage overview;		// the timeline
+	// frame times, reported every ROLL_REPORT_FRAMES
+	int frames;
+	qint64 frame_sum_ns, frame_max_ns;
+	QRect roll_rect();
+	QRect timeline_rect();
+	qint64 song_span();
+	qint64 tick_at( int x, int width );
+	void set_view( qint64 start, qint64 ticks );
+	void render_roll( int width );
+	bool render_notes( int width );
+	void render_overview( int width );
+};
+
+#endif // PIANOROLL_H
@@ -13,26 +13,131 @@
 #include <QMessageBox>
 #include <QTimer>
 #include <QSettings>
+#include <QElapsedTimer>
+#include <QMutexLocker>
+
+#include <algorithm>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
 
 static QSettings app_settings( "MAA Soft", "MIDI player" );
 
+// how far ahead of the queue the seq engine schedules; mute and solo
+// changes are heard after at most this long
+#define SEQ_LOOKAHEAD_US 200000
+// how often it checks on the queue while it is that far ahead
+#define SEQ_POLL_MS 10
+
 MidiPlayer::MidiPlayer( PlayerWindow *parent )
 	: QThread( parent )
 	, m_parent( parent )
+{
+	setup();
+	// the sequencer itself is opened by init(), off the GUI thread
+}
+
+// A session plays on a client opened by the PlayerManager, with a queue
+// of its own but no window, no settings and no hotplug monitor.  Its
+// errors only go to takeErrors().
+MidiPlayer::MidiPlayer( snd_seq_t *shared )
+	: QThread( 0 )
+	, m_parent( 0 )
+{
+	setup();
+	seq = shared;
+	own_seq = false;
+}
+
+void MidiPlayer::setup()
 {
 	memset( &port, 0, sizeof(port) );
+	memset( &subscribed, 0, sizeof(subscribed) );
 	seq = NULL;
-	queue = 0;
+	own_seq = true;
+	source_ready = false;
+	queue = -1;
 	currentTick = 0;
 	port_index = -1;
+	engine = ENGINE_SEQ;
+	sync_out = 0;
+	raw_out = NULL;
+	song = SongPtr( new Song );
+	play_song = song;
+	load = NULL;
+	load_check = LOAD_CHECK_BYTES;
+	last_tick = 0;
+	song_length_seconds = 0;
+	file_data = NULL;
+	file_size = file_offset = 0;
+	smpte_timing = false;
+	prev_tick = 0;
+	polyphony = 0;
+	culled = 0;
+	speed_skew.store( SKEW_BASE );
+	transpose_by.store( 0 );
+	memset( &load_stats, 0, sizeof(load_stats) );
+	reset_voices();
+	channel_mute = channel_solo = 0;
+	mix_channels = play_channels = 0xFFFF;
+	play_track_bits = NULL;
+	reset_notes();
+	loop.a = loop.b = 0;
+	loop.tempo = 0;
+	loop_seen = -1;
+	wrap_at = offset_before = offset_after = resume_offset = 0;
+	paused_tick = 0;
+	seek_tempo = 0;
+	memset( &cur, 0, sizeof(cur) );
+	halted.store( 0 );
+	swap_seen = 0;
+	watch_fd = watch_wd = -1;
 	port.client = app_settings.value("seq/client", 0).toInt();
 	port.port = app_settings.value("seq/port", 0).toInt();
+	preferred = port;
+	announce_seq = NULL;
+	snd_seq_queue_status_malloc( &status );
+	ctl_queue = -1;
+	memset( &pre, 0, sizeof(pre) );
+	follow_seq = NULL;
+	follow_queue = -1;
+	fol.on = fol.running = false;
+	fol.actions = 0;
+	fol.seek_tick = fol.clocks = 0;
+	fol.lock = 0;
+	fol.last_ns = fol.period_ns = 0;
+	fol.jitter_sq = fol.drift_ns = 0;
+	fol.speed_before = 1;
+	sim.on = false;
+	preroll_reset = static_cast<Reset>( app_settings.value("playback/preroll", RESET_NONE).toInt() );
+	setHighDensity( app_settings.value("playback/high_density", false).toBool() );
+	setCompact( app_settings.value("playback/compact", false).toBool() );
+}
 
+// the slow part of startup: open the sequencer, allocate the queue and
+// enumerate the ports.  PlayerWindow runs this on a worker thread and
+// leaves the player alone until it returns.
+void MidiPlayer::init()
+{
 	init_seq();
 	queue = snd_seq_alloc_named_queue(seq, "midi_player");
 	check_snd("create queue", queue);
+	if ( !own_seq ) {
+		// a session is told where to play, see connectTo()
+		scanPorts();
+		return;
+	}
+	// resets and the like go out on a queue that always runs
+	ctl_queue = snd_seq_alloc_named_queue(seq, "midi_player control");
+	check_snd("create queue", ctl_queue);
+	if ( ctl_queue >= 0 ) {
+		int err = snd_seq_start_queue(seq, ctl_queue, NULL);
+		check_snd("start queue", err);
+		snd_seq_drain_output(seq);
+	}
+	// subscribe before the scan, so no port can slip in between
+	open_announce();
 	scanPorts(); // empty parm means fill in the PortBox list
-	snd_seq_queue_status_malloc( &status );
 	//close_seq();
 
 	if ( (port_index < 0) && ports.size() )
@@ -40,23 +145,44 @@ MidiPlayer::MidiPlayer( PlayerWindow *parent )
 		port_index = 0;
 		port = ports[0];
 	}
+	if ( port_index >= 0 ) {
+		setEngine( static_cast<Engine>(app_settings.value( QString("engine/%1-%2") .arg(port.client) .arg(port.port), ENGINE_SEQ ).toInt()) );
+		setSync( app_settings.value( QString("sync/%1-%2") .arg(port.client) .arg(port.port), 0 ).toInt() );
+	}
+}
+
+// errors raised off the GUI thread, which cannot show a message box
+QStringList MidiPlayer::takeErrors()
+{
+	QStringList list = errors;
+	errors.clear();
+	return list;
 }
 
 MidiPlayer::~MidiPlayer()
 {
+	if ( !own_seq ) {
+		// the client is not ours to close, nor its output to drop
+		stopPumping();
+		if ( seq )	// none for a simulation
+			snd_seq_free_queue( seq, queue );
+		snd_seq_queue_status_free( status );
+		return;
+	}
 	stopPlayer();
 	reset();
 	app_settings.sync();
 	snd_seq_queue_status_free( status );
+	closeRawOut();
+	if ( announce_seq )
+		snd_seq_close( announce_seq );
+	if ( follow_seq )
+		snd_seq_close( follow_seq );
+	if ( watch_fd >= 0 )
+		close( watch_fd );
+	delete load;		// read but never used
 }
 
-/*
- * 31.25 kbaud, one start bit, eight data bits, two stop bits.
- * (The MIDI spec says one stop bit, but every transmitter uses two, just to be
- * sure, so we better not exceed that to avoid overflowing the output buffer.)
- */
-#define MIDI_BYTES_PER_SEC (31250 / (1 + 8 + 2))
-
 void MidiPlayer::handle_big_sysex(snd_seq_event_t *ev)
 {
 	unsigned int length;
@@ -67,134 +193,490 @@ void MidiPlayer::handle_big_sysex(snd_seq_event_t *ev)
 	if (length > MIDI_BYTES_PER_SEC)
 		ev->data.ext.len = MIDI_BYTES_PER_SEC;
 	event_size = snd_seq_event_length(ev);
-	if (event_size + 1 > snd_seq_get_output_buffer_size(seq)) {
+	if (!sim.on && event_size + 1 > snd_seq_get_output_buffer_size(seq)) {
 		err = snd_seq_drain_output(seq);
 		check_snd("drain output", err);
 		err = snd_seq_set_output_buffer_size(seq, event_size + 1);
 		check_snd("set output buffer size", err);
 	}
 	while (length > MIDI_BYTES_PER_SEC) {
-		err = snd_seq_event_output(seq, ev);
+		err = seq_output(*ev);
 		check_snd("output event", err);
-		err = snd_seq_drain_output(seq);
+		err = seq_drain();
 		check_snd("drain output", err);
-		err = snd_seq_sync_output_queue(seq);
+		err = seq_sync();
 		check_snd("sync output", err);
-		sleep(1);
+		seq_wait(1000);
 		ev->data.ext.ptr += MIDI_BYTES_PER_SEC;
 		length -= MIDI_BYTES_PER_SEC;
 	}
 	ev->data.ext.len = length;
 }
 
+// turn all_events into ready-to-send records, right after parsing:
+// a snd_seq_event_t for the queue and the wire bytes for rawmidi.
+// Only the destination and the queue are left to patch at play time.
+// With compact storage each event is packed as it is compiled, there are
+// no wire bytes, and all_events goes a block at a time behind it, so the
+// expanded song is never held twice.
+void MidiPlayer::compile_events()
+{
+	QElapsedTimer timer;
+	timer.start();
+	load->compiled.clear();
+	load->wire_index.clear();
+	load->wire.clear();
+	load->compiled.resetStats();
+	load->wire_index.resetStats();
+	if ( compact_store ) {
+		load->compiled.startPacked();
+	} else {
+		load->compiled.reserve( load->all_events.size() );
+		load->wire_index.reserve( load->all_events.size() + 1 );
+		// a hint only; read_smf() made sure the bytes fit, see MAX_WIRE_EVENTS
+		load->wire.reserve( qMin(load->all_events.size() * 3, static_cast<qint64>(INT_MAX / 2)) );
+	}
+
+	const qint64 block = ChunkedList<Song::event>::BLOCK_SIZE;
+	for ( qint64 n = 0; n < load->all_events.size(); ++ n ) {
+		compile_event( *load, load->all_events[n] );
+		if ( compact_store && (n + 1) % block == 0 ) {
+			note_peak();
+			load->all_events.freeBlock( n / block );
+		}
+	}
+	note_peak();
+	if ( compact_store )
+		load->all_events.clear();
+	else
+		load->wire_index.push_back( load->wire.size() );
+	load_stats.compile_ns = timer.nsecsElapsed();
+	load_stats.allocations += load->compiled.allocations() + load->wire_index.allocations() + 1;
+	qDebug() << "Compiled" << load->compiled.size() << "events," << load->wire.size() << "wire bytes in" << load_stats.compile_ns / 1000 << "us";
+}	// end compile_events
+
+// append one decoded event to the compiled lists of s; packed, there are
+// no wire bytes to append
+void MidiPlayer::compile_event( Song &s, const Song::event &e )
+{
+	snd_seq_event_t seq_ev;
+	snd_seq_event_t *ev = &seq_ev;
+	const Song::event *Event = &e;
+	unsigned ch = Event->data.d[0] & 0xF;
+	bool wired = !s.compiled.packed();
+	snd_seq_ev_clear(ev);
+	ev->type = Event->type;
+	ev->flags = SND_SEQ_TIME_STAMP_TICK;
+	ev->time.tick = Event->tick;
+	if ( wired )
+		s.wire_index.push_back( s.wire.size() );
+	switch ( ev->type ) {
+	case SND_SEQ_EVENT_NOTEON:
+	case SND_SEQ_EVENT_NOTEOFF:
+	case SND_SEQ_EVENT_KEYPRESS:
+		snd_seq_ev_set_fixed(ev);
+		ev->data.note.channel = ch;
+		ev->data.note.note = Event->data.d[1];
+		ev->data.note.velocity = Event->data.d[2];
+		break;
+	case SND_SEQ_EVENT_CONTROLLER:
+		snd_seq_ev_set_fixed(ev);
+		ev->data.control.channel = ch;
+		ev->data.control.param = Event->data.d[1];
+		ev->data.control.value = Event->data.d[2];
+		break;
+	case SND_SEQ_EVENT_PGMCHANGE:
+	case SND_SEQ_EVENT_CHANPRESS:
+		snd_seq_ev_set_fixed(ev);
+		ev->data.control.channel = ch;
+		ev->data.control.value = Event->data.d[1];
+		break;
+	case SND_SEQ_EVENT_PITCHBEND:
+		snd_seq_ev_set_fixed(ev);
+		ev->data.control.channel = ch;
+		ev->data.control.value = Event->data.d[1];
+		ev->data.control.value |= Event->data.d[2] << 7;
+		ev->data.control.value -= 0x2000;
+		break;
+	case SND_SEQ_EVENT_SYSEX:
+		// no wire bytes, the payload is shared, see Song::intern_sysex()
+		snd_seq_ev_set_variable(ev, Event->data.length, const_cast<unsigned char *>(Event->sysex));
+		s.compiled.push_back( *ev, Event->track );
+		return;
+	case SND_SEQ_EVENT_TEMPO:
+		snd_seq_ev_set_fixed(ev);
+		ev->dest.client = SND_SEQ_CLIENT_SYSTEM;
+		ev->dest.port = SND_SEQ_PORT_SYSTEM_TIMER;
+		ev->data.queue.param.value = Event->data.tempo;
+		s.compiled.push_back( *ev, Event->track );
+		return;
+	default:
+		parse_error( QString("Invalid event type %1") .arg(ev->type) );
+		s.compiled.push_back( *ev, Event->track );
+		return;
+	}	// end SWITCH ev->type
+	s.compiled.push_back( *ev, Event->track );
+	if ( !wired )
+		return;
+	// channel message, always with its full status byte
+	s.wire.append( raw_status(ev->type) | ch );
+	s.wire.append( Event->data.d[1] );
+	if ( ev->type != SND_SEQ_EVENT_PGMCHANGE && ev->type != SND_SEQ_EVENT_CHANPRESS )
+		s.wire.append( Event->data.d[2] );
+}	// end compile_event
+
+// play s from now on; not while an engine is playing the current song
+void MidiPlayer::setSong( const SongPtr &s )
+{
+	use_song( s );
+	set_queue_tempo();
+}
+
+// make s the song of the GUI side; the engines take it when they start,
+// or as a swap, see reloadFile()
+void MidiPlayer::use_song( const SongPtr &s )
+{
+	// the songs let go of are freed outside the lock the engine takes
+	SongPtr before, swapped;
+	{
+		QMutexLocker lock( &swap_lock );
+		before = song;
+		song = s;
+		swapped = retired;
+		retired.clear();
+	}
+	last_tick = song->last_tick;
+	song_length_seconds = song->length_seconds;
+	// size the track masks for this song
+	{
+		QMutexLocker lock( &mix_lock );
+		publish_mix();
+	}
+	// the same loop points on a reload, with the chase for this song
+	setLoop( loop.a, loop.b );
+}
+
+// the song's resolution and starting tempo, at the speed the user has set
+void MidiPlayer::set_queue_tempo()
+{
+	if ( !seq )
+		return;
+	snd_seq_queue_tempo_t *queue_tempo;
+	snd_seq_queue_tempo_alloca(&queue_tempo);
+	snd_seq_queue_tempo_set_tempo(queue_tempo, song->initial_tempo);
+	snd_seq_queue_tempo_set_ppq(queue_tempo, static_cast<int>(song->PPQ));
+	snd_seq_queue_tempo_set_skew(queue_tempo, speed_skew.load());
+	snd_seq_queue_tempo_set_skew_base(queue_tempo, SKEW_BASE);
+	int err = snd_seq_set_queue_tempo(seq, queue, queue_tempo);
+	check_snd("set queue tempo", err);
+}
+
+// SEQ_LOOKAHEAD_US in ticks at a tempo and the current speed
+qint64 MidiPlayer::lookahead( qint64 tempo )
+{
+	return qMax( 1LL, static_cast<qint64>(SEQ_LOOKAHEAD_US * play_song->PPQ / tempo * speed_skew.load() / SKEW_BASE) );
+}
+
 void MidiPlayer::run()
 {
 	int end_delay = 2;
-	unsigned ch;
 	int err;
-	// set data in (snd_seq_event_t ev) and output the event
-	// common settings for all events
+	if ( raw_out ) {
+		run_rawmidi();
+		return;
+	}
+	begin_pump();
+	bool more = pump();
+	// the first lookahead is queued, the queue may start
+	if ( pre.start_pending )
+		start_queue();
+	while ( more ) {
+		msleep( SEQ_POLL_MS );
+		more = pump();
+	}
+	if ( !cur.finished )
+		return;		// stopped, stopPlayer() drops the rest
+
+	// There are three possibilities for how to wait until all events have been played:
+	// 1) send an event back to us (like pmidi does), and wait for it;
+	// 2) wait for the EVENT_STOP notification for our queue which is sent
+	//    by the system timer port (this would require a subscription);
+	// 3) wait until the output pool is empty.
+	// The last is the simplest.
+	err = snd_seq_sync_output_queue(seq);
+	check_snd("sync output", err);
+	// a song of fewer notes than are timed
+	read_echoes();
+	report_start();
+	// give the last notes time to die away
+	if (end_delay > 0)
+		sleep(end_delay);
+}	// end play_midi
+
+// set the seq engine up to play from currentTick
+void MidiPlayer::begin_pump()
+{
+	Cursor &c = cur;
+	c.cpu_ns = 0;
+	c.wall_start = clock_ns(CLOCK_MONOTONIC);
+	start_song();
+	// everything before the start/resume point is skipped
+	c.events.reset( &play_song->compiled );
+	c.first = play_song->find_tick( currentTick );
+	c.last = play_song->compiled.size();
+	// the tempo in effect there sets the first lookahead
+	c.tempo = play_song->initial_tempo;
+	for ( qint64 i = c.first - 1; i >= 0; -- i )
+		if ( c.events[i].type == SND_SEQ_EVENT_TEMPO ) {
+			c.tempo = c.events[i].data.queue.param.value;
+			break;
+		}
+	// the queue runs ahead of the song by the loop passes before a pause
+	c.offset = resume_offset;
+	set_offset( 0, c.offset, c.offset );
+	c.ahead = lookahead( c.tempo );
+	c.horizon = currentTick + c.offset + c.ahead;
+	c.sent_tick = currentTick + c.offset;
+	c.pos = currentTick;
+	c.i = c.first;
+	c.setup_end = currentTick == 0 ? pre.end : 0;
+	pre.end = 0;
+	c.finished = false;
+	reset_voices();
+	reset_notes();
+	loop_seen = -1;
+	if ( currentTick > 0 )
+		resume_queue( c.sent_tick );
+	sync_begin();
+}	// end begin_pump
+
+// Queue the events up to the lookahead past the queue position and return,
+// true if there is more to come: call again in SEQ_POLL_MS or so.  At the
+// end of the song it queues the stop and returns false, as it does once
+// the player is stopping.
+bool MidiPlayer::pump()
+{
+	Cursor &c = cur;
+	if ( c.finished || stopping() )
+		return false;
+	qint64 cpu_start = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	if ( pre.timing )
+		read_echoes();
 	snd_seq_event_t ev;
-	snd_seq_ev_clear(&ev);
-	ev.queue = queue;
-	ev.source.port = 0;
-	ev.flags = SND_SEQ_TIME_STAMP_TICK;
-	// parse each event, already in sort order by 'tick' from parse_file
-	for ( QList<event>::iterator Event = all_events.begin(); Event != all_events.end(); ++ Event )
+	int err;
+	for ( ; ; ++ c.i )
 	{
-		// skip over everything except TEMPO, CONTROLLER, PROGRAM, ChannelPressure and SysEx changes until startTick is reached.
-		if ((Event->tick < currentTick) &&
-			(Event->type != SND_SEQ_EVENT_TEMPO ||
-			 Event->type != SND_SEQ_EVENT_CONTROLLER ||
-			 Event->type != SND_SEQ_EVENT_PGMCHANGE ||
-			 Event->type != SND_SEQ_EVENT_CHANPRESS ||
-			 Event->type != SND_SEQ_EVENT_SYSEX))
-		{
-			continue;
+		// the loop end counts as an event of its own, so the next pass is
+		// queued within the lookahead like everything else
+		refresh_loop();
+		qint64 tick = c.i < c.last ? c.events[c.i].time.tick : play_song->last_tick + 1;
+		// a reloaded song takes over between two ticks: at pos if nothing
+		// there has gone out yet, else right after it
+		if ( swap_serial.loadAcquire() != swap_seen ) {
+			bool fresh = c.i == 0 || c.events[c.i - 1].time.tick < c.pos;
+			if ( fresh || tick > c.pos ) {
+				qint64 at = fresh ? c.pos : c.pos + 1;
+				sync_until( at );
+				qint64 left = sync_ns( at );
+				qint64 next = swap_queue( at, c.offset, c.tempo );
+				c.events.reset( &play_song->compiled );
+				c.ahead = lookahead( c.tempo );
+				c.first += next - c.i;
+				c.last = play_song->compiled.size();
+				c.pos = at;
+				c.i = next - 1;
+				c.setup_end = 0;
+				sync_jump( left, at, false );
+				continue;
+			}
 		}
-		ev.time.tick = Event->tick;
-		ev.type = Event->type;
-		ev.dest = port;
-		ch = Event->data.d[0] & 0xF;
-		switch ( ev.type ) {
-		case SND_SEQ_EVENT_NOTEON:
-		case SND_SEQ_EVENT_NOTEOFF:
-		case SND_SEQ_EVENT_KEYPRESS:
-			snd_seq_ev_set_fixed(&ev);
-			ev.data.note.channel = ch;
-			ev.data.note.note = Event->data.d[1];
-			ev.data.note.velocity = Event->data.d[2];
-			break;
-		case SND_SEQ_EVENT_CONTROLLER:
-			snd_seq_ev_set_fixed(&ev);
-			ev.data.control.channel = ch;
-			ev.data.control.param = Event->data.d[1];
-			ev.data.control.value = Event->data.d[2];
-			break;
-		case SND_SEQ_EVENT_PGMCHANGE:
-		case SND_SEQ_EVENT_CHANPRESS:
-			snd_seq_ev_set_fixed(&ev);
-			ev.data.control.channel = ch;
-			ev.data.control.value = Event->data.d[1];
-			break;
-		case SND_SEQ_EVENT_PITCHBEND:
-			snd_seq_ev_set_fixed(&ev);
-			ev.data.control.channel = ch;
-			ev.data.control.value = Event->data.d[1];
-			ev.data.control.value |= Event->data.d[2] << 7;
-			ev.data.control.value -= 0x2000;
-			break;
-		case SND_SEQ_EVENT_SYSEX:
-			snd_seq_ev_set_variable(&ev, Event->data.length, Event->sysex.data());
-			handle_big_sysex(&ev);
+		bool wrap = play_loop.b > play_loop.a && c.pos < play_loop.b && tick >= play_loop.b;
+		if ( !wrap && c.i == c.last )
 			break;
-		case SND_SEQ_EVENT_TEMPO:
-			snd_seq_ev_set_fixed(&ev);
-			ev.dest.client = SND_SEQ_CLIENT_SYSTEM;
-			ev.dest.port = SND_SEQ_PORT_SYSTEM_TIMER;
+		qint64 due = (wrap ? play_loop.b : tick) + c.offset;
+		// stay within the lookahead, so mix changes are heard soon
+		if ( due > c.horizon ) {
+			err = seq_drain();
+			check_snd("drain output", err);
+			// the speed may have changed while we waited
+			c.ahead = lookahead( c.tempo );
+			c.horizon = queue_tick() + c.ahead;
+			if ( due > c.horizon ) {
+				sync_until( c.horizon + 1 - c.offset );
+				c.cpu_ns += clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+				return true;
+			}
+		}
+		// a changed mix: silence what it mutes behind what is already queued
+		if ( refresh_mix() ) {
+			QVector<int> muted = take_notes( true );
+			for ( int n = 0; n < muted.size(); ++ n ) {
+				snd_seq_event_t off;
+				snd_seq_ev_clear(&off);
+				snd_seq_ev_set_noteoff(&off, muted[n] >> 7, muted[n] & 0x7F, 0);
+				snd_seq_ev_schedule_tick(&off, queue, 0, c.sent_tick);
+				off.dest = port;
+				err = seq_output(off);
+				check_snd("output event", err);
+			}
+		}
+		// the clocks and quarter frames up to here go first
+		sync_until( wrap ? play_loop.b : tick );
+		if ( wrap ) {
+			qint64 left = sync_ns( play_loop.b );
+			bool moved = wrap_queue( c.offset, c.tempo );
+			c.ahead = lookahead( c.tempo );
+			if ( moved )
+				c.horizon = play_loop.a + c.ahead;
+			c.sent_tick = play_loop.a + c.offset;
+			c.pos = play_loop.a;
+			c.i = play_song->find_tick( play_loop.a ) - 1;
+			c.setup_end = 0;
+			sync_jump( left, play_loop.a, true );
+			continue;
+		}
+		c.pos = tick;
+		// sent in the pre-roll already
+		if ( c.i < c.setup_end && c.events[c.i].type != SND_SEQ_EVENT_TEMPO )
+			continue;
+		ev = c.events[c.i];
+		ev.time.tick += c.offset;
+		ev.queue = queue;
+		if ( ev.type == SND_SEQ_EVENT_TEMPO )
 			ev.data.queue.queue = queue;
-			ev.data.queue.param.value = Event->data.tempo;
-			break;
-		default:
-			QMessageBox::critical( m_parent, "MIDI Player", QString("Invalid event type %1") .arg(ev.type) );
-		}	// end SWITCH ev.type
+		else
+			ev.dest = port;
+		if ( ev.type == SND_SEQ_EVENT_SYSEX )
+			handle_big_sysex(&ev);
+		else if ( ev.type == SND_SEQ_EVENT_TEMPO ) {
+			sync_tempo( tick );
+			c.tempo = ev.data.queue.param.value;
+			c.ahead = lookahead( c.tempo );
+		}
+		else if ( !mix_pass( c.events.track(c.i), ev ) )
+			continue;
+		else if ( polyphony && (ev.type == SND_SEQ_EVENT_NOTEON || ev.type == SND_SEQ_EVENT_NOTEOFF) ) {
+			Cull cl = cull_note( ev );
+			if ( cl == CULL_DROP )
+				continue;
+			if ( cl == CULL_RETRIGGER ) {
+				snd_seq_event_t off = ev;
+				off.type = SND_SEQ_EVENT_NOTEOFF;
+				off.data.note.velocity = 0;
+				if ( transpose_note(off) ) {
+					err = seq_output(off);
+					check_snd("output event", err);
+				}
+			}
+		}
+		if ( (ev.type == SND_SEQ_EVENT_NOTEON || ev.type == SND_SEQ_EVENT_NOTEOFF ||
+			  ev.type == SND_SEQ_EVENT_KEYPRESS) && !transpose_note(ev) )
+			continue;
 		// do the actual output of the event to the MIDI queue
 		// this blocks when the output pool has been filled
-		err = snd_seq_event_output(seq, &ev);
+		err = seq_output(ev);
 		check_snd("output event", err);
-	}	// end for all_events iterator
+		c.sent_tick = ev.time.tick;
+		if ( pre.echoes && ev.type == SND_SEQ_EVENT_NOTEON && ev.data.note.velocity )
+			echo_note( ev.time.tick );
+	}	// end for compiled events
 
-	// schedule queue stop at end of song
-	snd_seq_ev_set_fixed(&ev);
+	// schedule queue stop at end of song, and the sync messages' Stop
+	sync_end( play_song->compiled.size() ? play_song->compiled.back().time.tick : 0 );
+	snd_seq_ev_clear(&ev);
+	ev.queue = queue;
+	ev.flags = SND_SEQ_TIME_STAMP_TICK;
 	ev.type = SND_SEQ_EVENT_STOP;
-	if ( all_events.size() )
-		ev.time.tick = all_events.back().tick;
+	if ( play_song->compiled.size() )
+		ev.time.tick = play_song->compiled.back().time.tick + c.offset;
 	else
 		ev.time.tick = 0;
 	ev.dest.client = SND_SEQ_CLIENT_SYSTEM;
 	ev.dest.port = SND_SEQ_PORT_SYSTEM_TIMER;
 	ev.data.queue.queue = queue;
-	err = snd_seq_event_output(seq, &ev);
+	err = seq_output(ev);
 	check_snd("output event", err);
 	// make sure that the sequencer sees all our events
-	err = snd_seq_drain_output(seq);
+	err = seq_drain();
 	check_snd("drain output", err);
-
-	// There are three possibilities for how to wait until all events have been played:
-	// 1) send an event back to us (like pmidi does), and wait for it;
-	// 2) wait for the EVENT_STOP notification for our queue which is sent
-	//    by the system timer port (this would require a subscription);
-	// 3) wait until the output pool is empty.
-	// The last is the simplest.
-	err = snd_seq_sync_output_queue(seq);
-	check_snd("sync output", err);
-	// give the last notes time to die away
-	if (end_delay > 0)
-		sleep(end_delay);
-}	// end play_midi
+	c.finished = true;
+
+	c.cpu_ns += clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+	qint64 sent = c.i - c.first;
+	qDebug() << "seq engine: cpu" << c.cpu_ns / 1000 << "us over"
+			 << (clock_ns(CLOCK_MONOTONIC) - c.wall_start) / 1000000 << "ms,"
+			 << (sent ? c.cpu_ns / sent : 0) << "ns per event";
+	if ( c.events.blocks )
+		qDebug() << "seq engine: decoded" << c.events.blocks << "blocks in" << c.events.decode_ns / 1000 << "us,"
+				 << (sent ? c.events.decode_ns / sent : 0) << "ns per event";
+	if ( polyphony )
+		qDebug() << "Culled" << culled << "notes over a budget of" << polyphony << "voices";
+	return false;
+}	// end pump
 
 
 //  FUNCTIONS
+void MidiPlayer::reset_voices()
+{
+	voices = 0;
+	memset( sounding, 0, sizeof(sounding) );
+	memset( drop_off, 0, sizeof(drop_off) );
+}
+
+// Decide at schedule time what to do with a note event under the polyphony
+// budget.  One voice per key and channel: a note on a key that is still
+// sounding keeps the louder of the two (the new one on a tie), anything past
+// the budget is dropped, and the note-off of every dropped note goes with it.
+MidiPlayer::Cull MidiPlayer::cull_note( const snd_seq_event_t &ev )
+{
+	unsigned ch = ev.data.note.channel & 0xF;
+	unsigned key = ev.data.note.note & 0x7F;
+	unsigned vel = ev.data.note.velocity;
+	if ( ev.type == SND_SEQ_EVENT_NOTEOFF || !vel ) {
+		if ( drop_off[ch][key] ) {
+			drop_off[ch][key] --;
+			return CULL_DROP;
+		}
+		if ( sounding[ch][key] ) {
+			sounding[ch][key] = 0;
+			voices --;
+		}
+		return CULL_SEND;
+	}
+	if ( sounding[ch][key] ) {
+		// one of the two notes loses its voice, and its note-off
+		culled ++;
+		drop_off[ch][key] ++;
+		if ( vel < sounding[ch][key] )
+			return CULL_DROP;
+		sounding[ch][key] = vel;
+		return CULL_RETRIGGER;
+	}
+	if ( voices >= polyphony ) {
+		culled ++;
+		drop_off[ch][key] ++;
+		return CULL_DROP;
+	}
+	sounding[ch][key] = vel;
+	voices ++;
+	return CULL_SEND;
+}	// end cull_note
+
+unsigned char MidiPlayer::raw_status( unsigned char type )
+{
+	// channel message status for a sequencer event type, 0 if none
+	switch ( type ) {
+	case SND_SEQ_EVENT_NOTEOFF:	return 0x80;
+	case SND_SEQ_EVENT_NOTEON:	return 0x90;
+	case SND_SEQ_EVENT_KEYPRESS:	return 0xA0;
+	case SND_SEQ_EVENT_CONTROLLER:	return 0xB0;
+	case SND_SEQ_EVENT_PGMCHANGE:	return 0xC0;
+	case SND_SEQ_EVENT_CHANPRESS:	return 0xD0;
+	case SND_SEQ_EVENT_PITCHBEND:	return 0xE0;
+	}
+	return 0;
+}
+
 void MidiPlayer::send_pgmchange( unsigned chan, unsigned value)
 {
 	snd_seq_event_t ev;
@@ -205,7 +687,7 @@ void MidiPlayer::send_pgmchange( unsigned chan, unsigned value)
 	snd_seq_ev_set_pgmchange( &ev, chan, value );
 	snd_seq_ev_set_direct(&ev);
 
-	snd_seq_event_output_direct(seq, &ev);
+	seq_direct(ev);
 	//snd_seq_drain_output(seq);
 }
 
@@ -220,7 +702,7 @@ void MidiPlayer::send_controller( unsigned chan, unsigned param, unsigned value)
 	snd_seq_ev_set_controller( &ev, chan, param, value );
 	ret = snd_seq_ev_set_direct(&ev);
 
-	snd_seq_event_output_direct(seq, &ev);
+	seq_direct(ev);
 	//snd_seq_drain_output(seq);
 }
 
@@ -234,7 +716,7 @@ void MidiPlayer::send_SysEx( const unsigned char *buf, int data_size )
 	ev.dest = port;
 	snd_seq_ev_set_sysex(&ev, data_size, (void *)buf);
 	snd_seq_ev_set_direct(&ev);
-	snd_seq_event_output_direct(seq, &ev);
+	seq_direct(ev);
 }
 
 void MidiPlayer::drain()
@@ -246,7 +728,8 @@ void MidiPlayer::drain()
 void MidiPlayer::init_seq()
 {
 	if (!seq) {
-		int err = snd_seq_open(&seq, "default", SND_SEQ_OPEN_OUTPUT, 0);
+		// input only for our own echoes, see echo_note()
+		int err = snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, 0);
 		check_snd("open sequencer", err);
 		err = snd_seq_set_client_name(seq, "midi_player");
 		check_snd("set client name", err);
@@ -270,7 +753,10 @@ void MidiPlayer::close_seq()
 
 void MidiPlayer::connect_port()
 {
-	if ( seq && (port_index >= 0)) {
+	if ( !seq || port_index < 0 )
+		return;
+	// a shared client's source port is the PlayerManager's
+	if ( own_seq && !source_ready ) {
 		//  create_source_port
 		snd_seq_port_info_t *pinfo;
 		snd_seq_port_info_alloca(&pinfo);
@@ -278,27 +764,42 @@ void MidiPlayer::connect_port()
 		snd_seq_port_info_set_port(pinfo, 0);
 		snd_seq_port_info_set_port_specified(pinfo, 1);
 		snd_seq_port_info_set_name(pinfo, "midi_player");
-		snd_seq_port_info_set_capability(pinfo, 0);
+		// writable for the echoes that time the first notes, stamped
+		// with the control queue's clock when they arrive
+		snd_seq_port_info_set_capability(pinfo, SND_SEQ_PORT_CAP_WRITE);
+		if ( ctl_queue >= 0 ) {
+			snd_seq_port_info_set_timestamping(pinfo, 1);
+			snd_seq_port_info_set_timestamp_real(pinfo, 1);
+			snd_seq_port_info_set_timestamp_queue(pinfo, ctl_queue);
+		}
 		snd_seq_port_info_set_type(pinfo,
 			SND_SEQ_PORT_TYPE_MIDI_GENERIC |
 			SND_SEQ_PORT_TYPE_APPLICATION);
 		int err = snd_seq_create_port(seq, pinfo);
 		check_snd("create port", err);
-
-		port = ports[port_index];
-		err = snd_seq_connect_to(seq, 0, port.client, port.port );
-		if (err < 0 && err!= -16)
-			QMessageBox::critical(m_parent, "MIDI Player", QString("%4 Cannot connect to port %1:%2 - %3") .arg(port.client) .arg(port.port) .arg(strerror(errno)) .arg(err));
-		qDebug() << "Connected port" << port.client << ":" << port.port ;
+		source_ready = err >= 0;
 	}
+
+	port = ports[port_index];
+	// subscribed already: nothing to do
+	if ( subscribed.client == port.client && subscribed.port == port.port )
+		return;
+	disconnect_port();
+	int err = snd_seq_connect_to(seq, 0, port.client, port.port );
+	if (err < 0 && err != -EBUSY)	// busy: subscribed already
+		check_snd(QString("connect to port %1:%2") .arg(port.client) .arg(port.port) .toLocal8Bit().constData(), err);
+	else
+		subscribed = port;
+	qDebug() << "Connected port" << port.client << ":" << port.port ;
 }	// end connect_port
 
 void MidiPlayer::disconnect_port()
 {
-	if ( seq && port.client ) {
+	if ( seq && subscribed.client ) {
 		int err;
-		err = snd_seq_disconnect_to(seq, 0, port.client, port.port );
-		qDebug() << "Disconnected current port" << port.client << ":" << port.port;
+		err = snd_seq_disconnect_to(seq, 0, subscribed.client, subscribed.port );
+		qDebug() << "Disconnected current port" << subscribed.client << ":" << subscribed.port;
+		subscribed.client = subscribed.port = 0;
 	}	// end if seq
 }	// end disconnect_port
 
@@ -313,6 +814,7 @@ void MidiPlayer::scanPorts()
 	snd_seq_client_info_set_client(cinfo, -1);
 
 	ports.clear();
+	port_names.clear();
 
 	while (snd_seq_query_next_client(seq, cinfo) >= 0) {
 		int client = snd_seq_client_info_get_client(cinfo);
@@ -329,6 +831,8 @@ void MidiPlayer::scanPorts()
 
 			addr = snd_seq_port_info_get_addr(pinfo);
 			ports << *addr;
+			// the name comes with the same query, no need to ask again
+			port_names << snd_seq_port_info_get_name(pinfo);
 			if ( (addr->client == port.client) && (addr->port == port.port) )
 				port_index = ports.size() - 1;
 		}
@@ -337,21 +841,132 @@ void MidiPlayer::scanPorts()
 
 const QStringList MidiPlayer::getPorts()
 {
-	snd_seq_port_info_t *pinfo;
-	QStringList names;
-	int i;
+	return port_names;
+}
 
-	snd_seq_port_info_alloca(&pinfo);
+// A second, input-only client listens to System:Announce, so hotplug
+// notifications never mix with the playback client's output buffer.
+void MidiPlayer::open_announce()
+{
+	int err = snd_seq_open(&announce_seq, "default", SND_SEQ_OPEN_INPUT, SND_SEQ_NONBLOCK);
+	if ( err < 0 ) {
+		check_snd("open announce client", err);
+		announce_seq = NULL;
+		return;
+	}
+	snd_seq_set_client_name(announce_seq, "midi_player monitor");
+	int in_port = snd_seq_create_simple_port(announce_seq, "announce",
+		SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_NO_EXPORT, SND_SEQ_PORT_TYPE_APPLICATION);
+	check_snd("create announce port", in_port);
+	err = snd_seq_connect_from(announce_seq, in_port, SND_SEQ_CLIENT_SYSTEM, SND_SEQ_PORT_SYSTEM_ANNOUNCE);
+	check_snd("subscribe to announcements", err);
+}
 
+int MidiPlayer::announceFd()
+{
+	struct pollfd pfd;
+	if ( !announce_seq || snd_seq_poll_descriptors(announce_seq, &pfd, 1, POLLIN) != 1 )
+		return -1;
+	return pfd.fd;
+}
+
+// add, refresh or drop one port after an announcement, true if the list changed
+bool MidiPlayer::update_port( const snd_seq_addr_t &addr )
+{
+	snd_seq_port_info_t *pinfo;
+	snd_seq_port_info_alloca(&pinfo);
+	int i;
 	for ( i = 0; i < ports.size(); i ++ )
-	{
-		snd_seq_get_any_port_info( seq, ports[i].client, ports[i].port, pinfo );
-		names << snd_seq_port_info_get_name( pinfo );
+		if ( ports[i].client == addr.client && ports[i].port == addr.port )
+			break;
+	// gone again, or no longer something we can play to
+	if ( snd_seq_get_any_port_info(announce_seq, addr.client, addr.port, pinfo) < 0 ||
+		 (snd_seq_port_info_get_capability(pinfo) & (SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE))
+			!= (SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE) )
+		return remove_ports( addr.client, addr.port );
+	QString name = snd_seq_port_info_get_name(pinfo);
+	if ( i < ports.size() ) {
+		if ( port_names[i] == name )
+			return false;
+		port_names[i] = name;
+		return true;
 	}
+	ports << addr;
+	port_names << name;
+	qDebug() << "Port" << addr.client << ":" << addr.port << name << "appeared";
+	// the port we were told to use is back; take it over a stand-in only
+	// between songs
+	if ( addr.client == preferred.client && addr.port == preferred.port &&
+		 (port_index < 0 || !isRunning()) ) {
+		qDebug() << "Reconnecting to preferred port";
+		if ( port_index >= 0 )
+			closePort();
+		openPort( ports.size() - 1 );
+	}
+	return true;
+}
 
-	return names;
+// drop the ports of a client (all of them if port < 0), true if any went
+bool MidiPlayer::remove_ports( int client, int port_num )
+{
+	bool changed = false;
+	for ( int i = ports.size() - 1; i >= 0; i -- ) {
+		if ( ports[i].client != client || (port_num >= 0 && ports[i].port != port_num) )
+			continue;
+		qDebug() << "Port" << ports[i].client << ":" << ports[i].port << port_names[i] << "went away";
+		if ( ports[i].client == subscribed.client && ports[i].port == subscribed.port )
+			subscribed.client = subscribed.port = 0;	// the kernel dropped it
+		ports.removeAt(i);
+		port_names.removeAt(i);
+		if ( i == port_index )
+			port_index = -1;	// don't keep sending to a stale address
+		else if ( i < port_index )
+			port_index --;
+		changed = true;
+	}
+	return changed;
 }
 
+// apply all pending announcements to the port list, 1 if it changed
+int MidiPlayer::handleAnnounce()
+{
+	snd_seq_event_t *ev;
+	bool changed = false;
+	int err;
+	if ( !announce_seq )
+		return 0;
+	while ( (err = snd_seq_event_input(announce_seq, &ev)) >= 0 || err == -ENOSPC ) {
+		if ( err == -ENOSPC ) {
+			// announcements were lost, only a full scan can catch up
+			qDebug() << "Announce queue overrun, rescanning ports";
+			int old_index = port_index;
+			port_index = -1;
+			// ours may have gone and come back, subscribe again to be sure
+			subscribed.client = subscribed.port = 0;
+			scanPorts();
+			if ( port_index < 0 && old_index >= 0 )
+				qDebug() << "Current port is gone";
+			changed = true;
+			continue;
+		}
+		switch ( ev->type ) {
+		case SND_SEQ_EVENT_PORT_START:
+		case SND_SEQ_EVENT_PORT_CHANGE:
+			changed |= update_port( ev->data.addr );
+			break;
+		case SND_SEQ_EVENT_PORT_EXIT:
+			changed |= remove_ports( ev->data.addr.client, ev->data.addr.port );
+			break;
+		case SND_SEQ_EVENT_CLIENT_EXIT:
+			changed |= remove_ports( ev->data.addr.client );
+			break;
+		default:
+			break;
+		}
+	}
+	return changed;
+}	// end handleAnnounce
+
 void MidiPlayer::getRawDev( const QString &buf ) {
 	signed int card_num = -1;
 	signed int dev_num = -1;
@@ -422,15 +1037,33 @@ int MidiPlayer::openPort( int index )
 
 	app_settings.setValue( "seq/client", port.client );
 	app_settings.setValue( "seq/port", port.port );
+	preferred = port;
+	setEngine( static_cast<Engine>(app_settings.value( QString("engine/%1-%2") .arg(port.client) .arg(port.port), ENGINE_SEQ ).toInt()) );
+	setSync( app_settings.value( QString("sync/%1-%2") .arg(port.client) .arg(port.port), 0 ).toInt() );
 
 	return 0;
 }
 
+// play to client:port_num, -1 if there is no such port
+int MidiPlayer::connectTo( int client, int port_num )
+{
+	for ( int i = 0; i < ports.size(); i ++ )
+		if ( ports[i].client == client && ports[i].port == port_num ) {
+			port_index = i;
+			connect_port();
+			return 0;
+		}
+	return -1;
+}
+
+// the queue lasts as long as the player, init() normally allocates it
 int MidiPlayer::openPort()
 {
 	init_seq();
-	queue = snd_seq_alloc_named_queue(seq, "midi_player");
-	check_snd("create queue", queue);
+	if ( queue < 0 ) {
+		queue = snd_seq_alloc_named_queue(seq, "midi_player");
+		check_snd("create queue", queue);
+	}
 	connect_port();
 
 	return 0;
@@ -448,39 +1081,166 @@ int MidiPlayer::ready()
 {
 	if ( !seq )
 		return 0;
-	if ( !queue )
+	if ( queue < 0 )
 		return 0;
 
 	return 1;
 }
 
+void MidiPlayer::setEngine( Engine e )
+{
+	engine = e;
+	if ( port_index >= 0 )
+		app_settings.setValue( QString("engine/%1-%2") .arg(port.client) .arg(port.port), engine );
+}
+
+void MidiPlayer::setSync( int flags )
+{
+	sync_out = flags & (SYNC_CLOCK | SYNC_MTC);
+	if ( port_index >= 0 )
+		app_settings.setValue( QString("sync/%1-%2") .arg(port.client) .arg(port.port), sync_out );
+}
+
+void MidiPlayer::setPreroll( Reset r )
+{
+	preroll_reset = r;
+	app_settings.setValue( "playback/preroll", r );
+}
+
+void MidiPlayer::setCompact( bool on )
+{
+	compact_store = on;
+	app_settings.setValue( "playback/compact", on );
+}
+
+void MidiPlayer::setHighDensity( bool on )
+{
+	polyphony = on ? qMax(1, app_settings.value("playback/polyphony", 64).toInt()) : 0;
+	app_settings.setValue( "playback/high_density", on );
+}
+
 unsigned MidiPlayer::getTick()
 {
+	if ( raw_out )
+		return raw_tick.load();
 	snd_seq_get_queue_status( seq, queue, status );
-	return snd_seq_queue_status_get_tick_time( status );
+	return song_tick( snd_seq_queue_status_get_tick_time( status ) );
 }
 
 void MidiPlayer::startPlayer()
 {
 	init_seq();
 	connect_port();
+	currentTick = paused_tick = 0;
+	resume_offset = 0;
+	seek_state.clear();
+	seek_tempo = 0;
+	culled = 0;
+	raw_tick.store(0);
+	// the rawmidi engine falls back to the queue if the device won't open
+	if ( engine == ENGINE_RAWMIDI && openRawOut() ) {
+		pre.play_ns = clock_ns(CLOCK_MONOTONIC);
+		pre.timing = true;
+		pre.timed = 0;
+		start();
+		return;
+	}
+	// the pre-roll goes out on the control queue, and the song's queue
+	// starts behind it once the engine has queued the first lookahead
+	if ( ctl_queue >= 0 ) {
+		int err = snd_seq_stop_queue(seq, queue, NULL);
+		check_snd("stop queue", err);
+		err = snd_seq_control_queue(seq, queue, SND_SEQ_EVENT_SETPOS_TICK, 0, NULL);
+		check_snd("set queue position", err);
+		send_preroll();
+		start();
+		return;
+	}
 	// queue won't actually start until it is drained
 	int err = snd_seq_start_queue(seq, queue, NULL);
 	check_snd("start queue", err);
-	currentTick = 0;
 	start();
 }
 
 void MidiPlayer::stopPlayer()
 {
-	if ( isRunning() )
-		terminate();
+	if ( isRunning() ) {
+		// both engines poll for interruption while they wait on the clock
+		requestInterruption();
+		if ( !wait(500) )
+			terminate();
+		wait();
+	}
+	closeRawOut();
 	snd_seq_drop_output(seq);
 	snd_seq_drain_output(seq);
+	sync_stop();
+	// stopped before the first notes were all timed, or the queue started
+	report_start();
+	pre.echoes = 0;
+	pre.start_pending = false;
+}
+
+// startPlayer() for an engine thread pool: the caller pumps from here on
+void MidiPlayer::startPumping()
+{
+	connect_port();
+	currentTick = paused_tick = 0;
+	resume_offset = 0;
+	seek_state.clear();
+	seek_tempo = 0;
+	culled = 0;
+	halted.store( 0 );
+	int err = snd_seq_start_queue(seq, queue, NULL);
+	check_snd("start queue", err);
+	begin_pump();
+}
+
+// stopPlayer() for a pumped player; other players on the client play on
+void MidiPlayer::stopPumping()
+{
+	halted.store( 1 );
+	if ( !seq )
+		return;
+	int err = snd_seq_drain_output(seq);
+	check_snd("drain output", err);
+	drop_queued();
+	snd_seq_stop_queue(seq, queue, NULL);
+	sync_stop();
+	for ( int x = 0; x < 16; x ++ )
+	{
+		send_controller( x, 123, 0 );
+		send_controller( x, 120, 0 );
+	}
+	snd_seq_drain_output(seq);
+}
+
+// take back what this player has queued, where snd_seq_drop_output() would
+// take everything the client has
+void MidiPlayer::drop_queued()
+{
+	snd_seq_remove_events_t *rm;
+	snd_seq_remove_events_alloca(&rm);
+	snd_seq_remove_events_set_condition(rm, SND_SEQ_REMOVE_OUTPUT | SND_SEQ_REMOVE_DEST);
+	snd_seq_remove_events_set_queue(rm, queue);
+	snd_seq_remove_events_set_dest(rm, &port);
+	int err = snd_seq_remove_events(seq, rm);
+	check_snd("remove events", err);
+	// and the tempo changes
+	snd_seq_addr_t timer;
+	timer.client = SND_SEQ_CLIENT_SYSTEM;
+	timer.port = SND_SEQ_PORT_SYSTEM_TIMER;
+	snd_seq_remove_events_set_dest(rm, &timer);
+	err = snd_seq_remove_events(seq, rm);
+	check_snd("remove events", err);
 }
 
 void MidiPlayer::resumePlayer()
 {
+	if ( engine == ENGINE_RAWMIDI && openRawOut() ) {
+		start();
+		return;
+	}
 	snd_seq_continue_queue(seq, queue, NULL);
 	snd_seq_drain_output(seq);
 	start();
@@ -488,16 +1248,28 @@ void MidiPlayer::resumePlayer()
 
 void MidiPlayer::pausePlayer()
 {
-	snd_seq_queue_status_t *status;
-
+	if ( raw_out ) {
+		stopPlayer();
+		currentTick = paused_tick = raw_tick.load();
+		silence();
+		return;
+	}
 	stopPlayer();
 	snd_seq_stop_queue(seq, queue, NULL);
 	snd_seq_get_queue_status(seq, queue, status);
-	currentTick = snd_seq_queue_status_get_tick_time(status);
+	pause_at( snd_seq_queue_status_get_tick_time(status) );
 	snd_seq_drain_output(seq);
 	silence();
 }
 
+// the song stopped at queue_tick: where it goes on from, on the queue too
+void MidiPlayer::pause_at( qint64 queue_tick )
+{
+	currentTick = song_tick( queue_tick );
+	resume_offset = queue_tick - currentTick;
+	paused_tick = currentTick;
+}
+
 void MidiPlayer::silence()
 {
 	if ( seq )
@@ -550,6 +1322,36 @@ void MidiPlayer::reset()
 	}
 }
 
+void MidiPlayer::setSpeed( double factor )
+{
+	speed_skew.store( static_cast<int>(qBound(0.25, factor, 4.0) * SKEW_BASE + 0.5) );
+	apply_skew();
+}
+
+// tell the queue about the speed; the position stays where it is and
+// nothing already queued has to be sent again
+void MidiPlayer::apply_skew()
+{
+	if ( !seq )
+		return;
+	snd_seq_event_t ev;
+	snd_seq_ev_clear(&ev);
+	ev.type = SND_SEQ_EVENT_QUEUE_SKEW;
+	ev.dest.client = SND_SEQ_CLIENT_SYSTEM;
+	ev.dest.port = SND_SEQ_PORT_SYSTEM_TIMER;
+	ev.data.queue.queue = queue;
+	ev.data.queue.param.skew.value = speed_skew.load();
+	ev.data.queue.param.skew.base = SKEW_BASE;
+	snd_seq_ev_set_direct(&ev);
+	int err = snd_seq_event_output_direct(seq, &ev);
+	check_snd("set queue skew", err);
+}
+
+void MidiPlayer::setTranspose( int semitones )
+{
+	transpose_by.store( qBound(-127, semitones, 127) );
+}
+
 void MidiPlayer::setVolume(int val) {
 	unsigned char buf[8];
 	if (seq) {
@@ -3,49 +3,233 @@
 
 #include <QtDebug>
 #include <QThread>
+#include <QAtomicInt>
+#include <QVector>
+#include <QByteArray>
+#include <QStringList>
+#include <QMutex>
 #include <QMessageBox>
+#include <QTextStream>
 
 #include <alsa/asoundlib.h>
+#include <time.h>
+
+#include "song.h"
+
+/*
+ * 31.25 kbaud, one start bit, eight data bits, two stop bits.
+ * (The MIDI spec says one stop bit, but every transmitter uses two, just to be
+ * sure, so we better not exceed that to avoid overflowing the output buffer.)
+ */
+#define MIDI_BYTES_PER_SEC (31250 / (1 + 8 + 2))
+
+// how much of a track the parser decodes between two progress updates
+#define LOAD_CHECK_BYTES (64 * 1024)
+// the wire bytes of a song are one QByteArray indexed by int, at most 3 of
+// them an event
+#define MAX_WIRE_EVENTS ((INT_MAX - 1) / 3)
 
 class PlayerWindow;
+class MidiIndex;
 
 class MidiPlayer : public QThread
 {
 public:
 	MidiPlayer(PlayerWindow *parent = 0);
+	// a session on a client shared with other players, see PlayerManager
+	MidiPlayer(snd_seq_t *shared);
 	~MidiPlayer();
 
+	void init();
+	QStringList takeErrors();
+
 	void scanPorts();
 	const QStringList getPorts();
+	// port hotplug: watch announceFd() for reading, then call handleAnnounce()
+	int announceFd();
+	int handleAnnounce();
 	const int getPortIndex() { return port_index; }
 
 	int openPort( int index );
 	int openPort();
 	int closePort();
+	int connectTo( int client, int port_num );	// without touching the settings
 
 	void send_pgmchange( unsigned chan, unsigned value );
 	void send_controller( unsigned chan, unsigned param, unsigned value);
 	void send_SysEx( const unsigned char *buf, int len );
 	void drain();
 
+	// device resets and other setup as timed messages, see control.cpp
+	struct TimedMessage {
+		int ms;			// from the start of the sequence
+		QByteArray bytes;	// one message, none for the wait at the end
+	};
+	typedef QVector<TimedMessage> ControlSequence;
+	enum Reset { RESET_NONE, RESET_GM, RESET_GS, RESET_XG, RESET_MT32 };
+	static ControlSequence resetSequence( Reset r );
+	bool sendSequence( const ControlSequence &s );	// stopped or paused only
+	// a reset sent ahead of every play from the start, the song after it
+	void setPreroll( Reset r );
+	Reset preroll() { return preroll_reset; }
+
 	int ready();
 	unsigned getTick();
 
 	int parseFile(QString &filename);
+	// parseFile() in two steps, for a loader thread: readFile() builds the
+	// next song without touching the current one, useLoad() swaps it in
+	// on the GUI thread
+	int readFile( QString &file_name );
+	void useLoad();
+	void cancelLoad() { load_cancel.store( 1 ); }
+	struct LoadProgress {
+		int bytes, file_bytes;		// decoded so far, of the file
+		int tracks, num_tracks;
+	};
+	LoadProgress loadProgress();
+	// the song, for the caller to free elsewhere; an empty one replaces it
+	SongPtr takeSong();
+	// the loaded song, to play the same one on other players
+	SongPtr getSong() { return song; }
+	void setSong( const SongPtr &s );
+
+	// watch mode: watchFd() becomes readable when the directory of the
+	// watched file changes, handleWatch() tells whether the file was saved;
+	// see reload.cpp
+	bool setWatch( const QString &file_name );	// empty: stop watching
+	int watchFd() { return watch_fd; }
+	bool handleWatch();
+	// decode the changed tracks only and swap the result in, while playing
+	// too; 1 if done, 0 if the old song stays, -1 if it must be read again
+	// in full: the tracks or the timing changed, the song is packed, or,
+	// stopped, too much changed to decode on the GUI thread
+	int reloadFile( QString &file_name );
 
 	void startPlayer();
 	void stopPlayer();
 	void pausePlayer();
 	void resumePlayer();
+	void seek( qint64 tick );	// while paused, see notes.cpp
 	void silence();
 	void reset();
 
+	// the seq engine a step at a time, for a pool of engine threads to run
+	// instead of the player's own; see PlayerManager
+	void startPumping();
+	bool pump();		// queue what is due, false once all is queued or stopped
+	void stopPumping();
+
 	void setVolume(int val);
 
+	// live controls, heard within the lookahead of the playing engine
+	void setSpeed( double factor );		// 0.25 .. 4, scales the tempo
+	double getSpeed() { return static_cast<double>(speed_skew.load()) / SKEW_BASE; }
+	void setTranspose( int semitones );	// all channels but drums
+	int getTranspose() { return transpose_by.load(); }
+
+	// playback engines, selectable per destination port
+	enum Engine {
+		ENGINE_SEQ,		// ALSA sequencer queue (default)
+		ENGINE_RAWMIDI		// direct rawmidi writes, own clock
+	};
+	void setEngine( Engine e );
+	Engine getEngine() { return engine; }
+
+	// timing messages for the destination to follow the song by, chosen
+	// per destination port and sent by the seq engine from the next Play
+	// on; see sync.cpp
+	enum Sync { SYNC_CLOCK = 1, SYNC_MTC = 2 };
+	void setSync( int flags );
+	int getSync() { return sync_out; }
+
+	// follow an external MIDI Clock: watch followFd() for reading, then
+	// call handleFollow() and act on what it returns; see follow.cpp
+	enum FollowAction {
+		FOLLOW_START = 1,	// play from the top
+		FOLLOW_RUN = 2,		// the master started or stopped, see followRunning()
+		FOLLOW_SEEK = 4		// play on from followPosition()
+	};
+	bool setFollow( bool on );
+	bool following() { return fol.on; }
+	int followFd();
+	int handleFollow();
+	bool followRunning() { return fol.running; }
+	qint64 followPosition() { return fol.seek_tick; }
+	struct FollowStats {
+		bool locked;
+		double bpm;		// the master's
+		double jitter_us;	// of its clocks' arrival, rms
+		double drift_ms;	// the song behind the master, < 0 ahead
+	};
+	FollowStats followStats();
+
+	// high density mode: cull notes beyond the polyphony budget at play time
+	void setHighDensity( bool on );
+	bool highDensity() { return polyphony > 0; }
+	qint64 culledNotes() { return culled; }
+
+	// compact storage for machines short of memory: songs loaded from now
+	// on keep their events packed, see EventList
+	void setCompact( bool on );
+	bool compact() { return compact_store; }
+
+	// what the last parseFile() cost
+	struct LoadStats {
+		qint64 file_bytes;
+		qint64 events;
+		qint64 allocations;	// arena and event list blocks
+		qint64 arena_bytes;	// payload storage
+		qint64 sysex_bytes;	// of all SysEx events
+		qint64 sysex_shared;	// of those, stored once for several events
+		qint64 index_ns;
+		qint64 parse_ns;	// decode and merge
+		qint64 compile_ns;
+		qint64 event_bytes;	// what the compiled events take
+		qint64 peak_bytes;	// the most the song held at once while loading
+		qint64 pack_ns;		// compact storage only: Song::pack()
+	};
+	const LoadStats &loadStats() { return load_stats; }
+
+	// mute and solo, heard within the lookahead of the playing engine; see mix.cpp
+	void setChannelMute( int channel, bool on );
+	void setChannelSolo( int channel, bool on );
+	void setTrackMute( int track, bool on );
+	void setTrackSolo( int track, bool on );
+	void clearMix();
+	int trackCount() { return song->tracks; }
+
+	// A-B loop over [a, b), wrapped ahead of time by the engines; see loop.cpp
+	void setLoop( qint64 a, qint64 b );	// ticks, b <= a turns it off
+	void setLoopTime( double a, double b );	// seconds of song time
+	void clearLoop() { setLoop( 0, 0 ); }
+	qint64 loopStart() { return loop.a; }
+	qint64 loopEnd() { return loop.b; }	// 0 = no loop
+
+	// The seq engine with no ALSA at all, on a virtual queue whose clock
+	// jumps ahead whenever the engine would wait: the loaded song plays as
+	// fast as the engine goes, the same every time.  Each event goes to
+	// log as the queue would play it, with its wall time and tick.  The
+	// script pauses, resumes, seeks and changes the speed or the loop at
+	// wall times of its own; see simulate.cpp
+	enum SimAction { SIM_PAUSE, SIM_RESUME, SIM_SEEK, SIM_SPEED, SIM_LOOP };
+	struct SimStep {
+		qint64 ms;		// wall time from Play
+		SimAction action;
+		double a, b;		// the tick, the speed, the loop points
+	};
+	struct SimStats {
+		qint64 events;		// played by the queue
+		qint64 wall_ns;		// virtual, from Play to the end of the song or script
+		qint64 engine_ns;	// real, spent pumping
+		qint64 pumps;
+	};
+	SimStats simulate( const QVector<SimStep> &script, QTextStream &log );
+
 	int queue;
 
-	int currentTick;
-	int last_tick;
+	qint64 currentTick;
+	qint64 last_tick;
 	double song_length_seconds;
 
 protected:
@@ -53,53 +237,280 @@ protected:
 
 private:
 	PlayerWindow *m_parent;
-
-	struct event {
-		struct event *next;		// linked list
-		unsigned char type;		// SND_SEQ_EVENT_xxx
-		unsigned char port;		// port index, generally not used
-		unsigned int tick;
-		union {
-			unsigned char d[3];	// channel and data bytes
-			int tempo;
-			unsigned int length;	// length of sysex data
-		} data;
-		std::vector<unsigned char> sysex;
-	};  // end struct event definition
-
-	struct track {
-		struct event *first_event;	// list of all events in this track
-		int end_tick;			// length of this track
-		struct event *current_event;	// used while loading and playing
-	};  // end struct track definition
+	void setup();
 
 	snd_seq_t *seq;
+	bool own_seq;			// false for a session on a shared client
 	snd_seq_addr_t port;
 	int port_index;
+	// the source port and its one subscription, kept until the destination
+	// changes; see connect_port()
+	bool source_ready;
+	snd_seq_addr_t subscribed;	// client 0 = none
+	snd_seq_addr_t preferred;	// the port from the settings, reconnected when it returns
+	snd_seq_t *announce_seq;	// own input client, subscribed to System:Announce
+	void open_announce();
+	bool update_port( const snd_seq_addr_t &addr );
+	bool remove_ports( int client, int port_num = -1 );
 	QString midi_dev;
 
-	bool minor_key;
-	int sf;  // sharps/flats
-	double BPM, PPQ;
-
 	QList<snd_seq_addr_t> ports;
-	QList<struct event> all_events;
+	QStringList port_names;		// filled by scanPorts() along with ports
+	QStringList errors;		// see takeErrors()
+	SongPtr song;			// the one we play, never null
+	Song *load;			// the one parseFile() is building
+	LoadStats load_stats;
+	bool compact_store;		// see setCompact()
+	// readFile() progress, for the GUI thread while a loader thread runs it
+	QAtomicInt load_bytes, load_size, load_tracks, load_num_tracks;
+	QAtomicInt load_cancel;		// set by cancelLoad()
+	int load_check;			// file_offset of the next progress update
+	void parse_error( const QString &msg );
+	QVector<qint64> track_start;	// first event of each track while parsing
+	void merge_tracks();
+	void compile_events();
+	void compile_event( Song &s, const Song::event &e );
+	void note_peak( qint64 extra = 0 );
+	void use_song( const SongPtr &s );
+	void set_queue_tempo();
+	static unsigned char raw_status( unsigned char type );
+
+	// polyphony budget, see cull_note()
+	enum Cull {
+		CULL_SEND,		// play the event
+		CULL_DROP,		// swallow it
+		CULL_RETRIGGER		// release the sounding note on that key first
+	};
+	int polyphony;			// voices at once, 0 = no culling
+	int voices;
+	unsigned char sounding[16][128];	// velocity of the sounding note, 0 = none
+	int drop_off[16][128];		// note-offs of culled notes still to swallow
+	qint64 culled;
+	void reset_voices();
+	Cull cull_note( const snd_seq_event_t &ev );
+
+	// mute/solo settings from the GUI thread, guarded by mix_lock
+	QMutex mix_lock;
+	quint16 channel_mute, channel_solo;
+	QVector<quint32> track_mute, track_solo;	// one bit per track
+	quint32 mix_channels;		// what is audible, built by publish_mix()
+	QVector<quint32> mix_tracks;
+	QAtomicInt mix_serial;		// bumped on every change
+	void publish_mix();
+	// the playback thread's copy, see refresh_mix()
+	int mix_seen;
+	quint32 play_channels;
+	QVector<quint32> play_tracks;
+	const quint32 *play_track_bits;
+	unsigned short note_count[16][128];	// note-ons let through, not yet released
+	quint16 note_track[16][128];		// track of the latest of them
+	bool refresh_mix();
+	void reset_notes();
+	QVector<int> take_notes( bool muted_only );
+	QVector<int> take_track_notes( const QVector<quint32> &tracks );
+
+	// A-B loop, set from the GUI thread under loop_lock
+	struct Loop {
+		qint64 a, b;			// [a, b) in ticks, b <= a = none
+		QVector<snd_seq_event_t> chase;	// the state at a of what [a, b) changes
+		QByteArray chase_wire;		// the same as MIDI bytes, full status
+		unsigned tempo;			// in effect at a, 0 if [a, b) keeps it
+	};
+	QMutex loop_lock;
+	Loop loop;
+	QAtomicInt loop_serial;		// bumped on every change
+	void build_chase( Loop &l );
+	qint64 tick_at_time( double seconds );
+	// the playback thread's copy, see refresh_loop()
+	int loop_seen;
+	Loop play_loop;
+	bool refresh_loop();
+	bool wrap_queue( qint64 &offset, qint64 &tempo );
+	// queue tick = song tick + offset, the offset grows by b - a at each
+	// wrap; the seq engine publishes it for getTick() under loop_lock
+	qint64 wrap_at, offset_before, offset_after;
+	qint64 resume_offset;		// of the stopped queue, for run()
+	// a jump: the state to chase, from the song at tick to the song at another
+	void seek_chase( qint64 from, qint64 to, QVector<snd_seq_event_t> &chase, unsigned &tempo );
+	qint64 paused_tick;		// where the device state is from
+	QVector<snd_seq_event_t> seek_state;	// what seek() left for the engine to chase
+	unsigned seek_tempo;		// and the tempo, 0 if the same
+	QVector<snd_seq_event_t> held_notes( qint64 tick );
+	void resume_queue( qint64 at );
+	void set_offset( qint64 at, qint64 before, qint64 after );
+	qint64 song_tick( qint64 queue_tick );
+
+	// speed as queue skew, 1.0 = SKEW_BASE; the rawmidi clock reads it too
+	enum { SKEW_BASE = 0x10000 };
+	QAtomicInt speed_skew;
+	void apply_skew();
+	// transposition, per emitted note so its note-off follows it
+	QAtomicInt transpose_by;
+	short sent_key[16][128];	// key a note-on went out as, -1 = none
+	inline bool transpose_note( snd_seq_event_t &ev );
+	inline bool audible( unsigned ch, unsigned track );
+	inline bool mix_pass( unsigned track, const snd_seq_event_t &ev );
 
 	snd_seq_queue_status_t *status;
+	qint64 lookahead( qint64 tempo );
+
+	// control sequences on a queue of their own, see control.cpp
+	int ctl_queue;			// always running, -1 = none
+	Reset preroll_reset;
+	int queue_control( const ControlSequence &s );
+	// the start of a play from the top: the pre-roll, the queue start
+	// behind it and the timing of the first notes
+	struct Preroll {
+		qint64 end;			// compiled events sent ahead, for begin_pump()
+		bool start_pending;		// the engine starts the queue, see start_queue()
+		qint64 play_ns, start_ns;	// Play, and the queue start, on the control queue's clock
+		bool timing;			// first notes still to time
+		int echoes, timed;		// sent, and back
+		qint64 first_ns, late_sum, late_max;
+	};
+	Preroll pre;
+	qint64 song_setup( const Song &s, ControlSequence &out, int ms );
+	void send_preroll();
+	void start_queue();
+	void echo_note( unsigned tick );
+	void read_echoes();
+	void time_note( qint64 at, qint64 due );
+	void report_start();
+	qint64 tick_ns( qint64 tick );
+
+	// where the seq engine is between two pump() calls
+	struct Cursor {
+		qint64 first, last, i;		// compiled events: start, end, next
+		EventList::Reader events;	// of play_song
+		qint64 tempo, ahead;		// in effect, and the lookahead in ticks
+		qint64 offset;			// queue tick - song tick, see wrap_queue()
+		qint64 horizon;			// latest queue tick we may schedule now
+		unsigned sent_tick;		// of the last event handed to the queue
+		qint64 setup_end;		// events before it went out in the pre-roll
+		qint64 pos;			// song tick reached, for the loop end
+		// MIDI Clock and MTC, see sync_begin()
+		int sync;			// Sync flags of this play
+		qint64 anchor_tick, anchor_ns;	// a song tick and its song time
+		qint64 sync_real;		// queue real time - song time
+		qint64 next_clock, next_quarter;	// counted from the song's start
+		bool resume_clock;		// a Continue goes with the next clock
+		qint64 cpu_ns, wall_start;
+		bool finished;			// the whole song is queued
+	};
+	Cursor cur;
+	QAtomicInt halted;		// set by stopPumping()
+	inline bool stopping();
+	void begin_pump();
+	void drop_queued();
+
+	// MIDI Clock and MTC along the song, see sync.cpp
+	int sync_out;			// Sync flags of the destination port
+	void sync_begin();
+	void sync_locate( qint64 tick );
+	void sync_until( qint64 end );
+	void sync_tempo( qint64 tick );
+	qint64 sync_ns( qint64 tick );
+	void sync_jump( qint64 left_ns, qint64 to, bool locate );
+	void sync_end( qint64 end );
+	void sync_stop();
+	void sync_output( snd_seq_event_t &ev );
+
+	// following an external MIDI Clock, on the GUI thread; see follow.cpp
+	snd_seq_t *follow_seq;		// own input client, its queue stamps the clocks
+	int follow_queue;
+	struct Follow {
+		bool on;
+		bool running;			// the master's transport
+		int actions;			// FollowAction bits for handleFollow()
+		qint64 seek_tick;
+		qint64 clocks;			// next clock, counted from the song's start
+		int lock;			// clocks since the filter started over
+		double last_ns, period_ns;	// filtered time of the last clock, and the period
+		double jitter_sq;		// mean square of the arrival error
+		double drift_ns;		// the song behind the master
+		double speed_before;		// set again when following stops
+	};
+	Follow fol;
+	void follow_clock( qint64 t );
+	void follow_drive();
+
+	// the song the engine plays: song, unless a swap is pending
+	SongPtr play_song;
+	// a reloaded song for the playing engine, set under swap_lock
+	QMutex swap_lock;
+	SongPtr swap_song;
+	QVector<quint32> swap_tracks;	// one bit per changed track
+	SongPtr retired;		// swapped out, for the GUI side to free
+	QAtomicInt swap_serial;		// bumped on every reload while playing
+	int swap_seen;
+	void start_song();
+	qint64 take_swap( qint64 at, QVector<int> &notes, QVector<snd_seq_event_t> &chase, unsigned &tempo );
+	qint64 swap_queue( qint64 at, qint64 offset, qint64 &tempo );
+	void swap_chase( const Song &from, const Song &to, qint64 tick, QVector<snd_seq_event_t> &chase, unsigned &tempo );
+	static void chase_wire( const QVector<snd_seq_event_t> &chase, QByteArray &wire );
+	void splice_song( const Song &old, const QVector<quint32> &changed );
+	int watch_fd, watch_wd;		// inotify, on the directory of the file
+	QString watch_name;
 
 	void handle_big_sysex(snd_seq_event_t *ev);
 
+	// where the seq engine's events go and whose clock it reads: the queue,
+	// or a simulation's; see simulate.cpp
+	inline bool port_gone( const snd_seq_event_t &ev );
+	inline int seq_output( snd_seq_event_t &ev );
+	inline int seq_direct( snd_seq_event_t &ev );
+	inline int seq_drain();
+	int seq_sync();			// wait until all queued has played
+	void seq_wait( int ms );
+	qint64 queue_tick( qint64 *real_ns = 0 );
+	void pause_at( qint64 queue_tick );
+	struct Queued {
+		snd_seq_event_t ev;
+		QByteArray data;		// a copy of the variable part
+	};
+	struct Sim {
+		bool on;
+		QTextStream *log;
+		qint64 wall_ns;			// virtual, from Play
+		bool running;			// the queue
+		bool paused;			// by the script
+		qint64 real_ns;			// queue real time, stands while stopped
+		double base_tick;		// queue tick at real time base_ns,
+		qint64 base_ns;			// from where tempo and skew hold
+		qint64 tempo;
+		int skew;
+		QVector<Queued> ticked, timed;	// by tick, by real time
+		int next_ticked, next_timed;	// played already before them
+		qint64 events;
+	};
+	Sim sim;
+	int sim_output( snd_seq_event_t &ev, bool direct );
+	double sim_tick_ns();
+	void sim_rebase();
+	void sim_advance( qint64 wall_ns );
+	bool sim_next( qint64 &real_ns, bool &timed );
+	void sim_play( const Queued &q );
+	void sim_drop();
+	void sim_step( const SimStep &s, bool &pumping );
+
+	// rawmidi engine, see rawmidi_player.cpp
+	Engine engine;
+	snd_rawmidi_t *raw_out;
+	QAtomicInt raw_tick;	// playback position of the rawmidi clock
+	int openRawOut();
+	void closeRawOut();
+	void run_rawmidi();
+	int raw_write( const unsigned char *buf, int len, qint64 &wire_free );
+	bool raw_release( const QVector<int> &keys, unsigned char &running, qint64 &wire_free );
+	bool raw_control( const ControlSequence &s, qint64 &wire_free );
+
 	inline void check_snd(const char *, int);
-	inline int read_id(void);
 	inline int read_byte(void);
+	inline bool at_eof(void);
 	inline void skip(int);
-	static bool tick_comp(const struct event& e1, const struct event& e2);
-	int read_int(int);
 	int read_var(void);
-	int read_32_le(void);
-	int read_smf(QString &);
-	int read_riff(QString &);
-	int read_track(int, QString &);
+	int read_smf(QString &, const MidiIndex &);
+	int read_track(int, int, QString &);
 	void play_midi(unsigned int);
 
 	void init_seq();
@@ -108,28 +519,138 @@ private:
 	void disconnect_port();
 	void getRawDev( const QString &buf = QString() );
 
-	FILE *file;
+	const unsigned char *file_data;	// mapped image of the file being parsed
+	int file_size;
 	int file_offset;
+	bool smpte_timing;		// of the file being parsed
+	qint64 prev_tick;		// of its last tempo change, for length_seconds
 };
 
 // INLINE function
 void MidiPlayer::check_snd(const char *operation, int err)
 {//qDebug() << "trying " << operation;
 	// error handling for ALSA functions
-	if (err < 0)
-		QMessageBox::critical( static_cast<QWidget *> (m_parent), "MIDI Player", QString("Cannot %1\n%2") .arg(operation) .arg(snd_strerror(err)) );
+	if (err < 0) {
+		QString msg = QString("Cannot %1\n%2") .arg(operation) .arg(snd_strerror(err));
+		if ( !m_parent || QThread::currentThread() != thread() ) {
+			qDebug() << msg;
+			errors << msg;
+		} else
+			QMessageBox::critical( static_cast<QWidget *> (m_parent), "MIDI Player", msg );
+	}
 }
-// helper functions, most are INLINE
-int MidiPlayer::read_id(void) {
-	return read_32_le();
+// the port went away (see remove_ports()): what is addressed to it is
+// dropped, while the queue's own events keep the song going to its end
+bool MidiPlayer::port_gone(const snd_seq_event_t &ev)
+{
+	return port_index < 0 && ev.dest.client != SND_SEQ_CLIENT_SYSTEM &&
+		   ev.dest.client == port.client && ev.dest.port == port.port;
+}
+// an event for the queue
+int MidiPlayer::seq_output(snd_seq_event_t &ev)
+{
+	if (sim.on)
+		return sim_output(ev, false);
+	if (port_gone(ev))
+		return 0;
+	return snd_seq_event_output(seq, &ev);
+}
+// an event right away, past the output buffer
+int MidiPlayer::seq_direct(snd_seq_event_t &ev)
+{
+	if (sim.on)
+		return sim_output(ev, true);
+	if (port_gone(ev))
+		return 0;
+	return snd_seq_event_output_direct(seq, &ev);
+}
+int MidiPlayer::seq_drain()
+{
+	if (sim.on)
+		return 0;
+	return snd_seq_drain_output(seq);
+}
+// the engine should give up: stopPlayer() or stopPumping()
+bool MidiPlayer::stopping()
+{
+	return isInterruptionRequested() || halted.load();
+}
+// one AND of the channel and track masks
+bool MidiPlayer::audible(unsigned ch, unsigned track)
+{
+	return (play_channels >> ch) & (play_track_bits[track >> 5] >> (track & 31)) & 1;
+}
+// should a compiled event of track go out under the current mix.  Only notes are
+// muted: controllers, programs and bends keep the device state right for
+// the moment the part is heard again.  A note-off goes out if its note-on did.
+bool MidiPlayer::mix_pass(unsigned track, const snd_seq_event_t &ev)
+{
+	unsigned ch = ev.data.note.channel;	// same place in snd_seq_ev_ctrl_t
+	switch (ev.type) {
+	case SND_SEQ_EVENT_NOTEON:
+		if (ev.data.note.velocity) {
+			if (!audible(ch, track))
+				return false;
+			note_count[ch][ev.data.note.note] ++;
+			note_track[ch][ev.data.note.note] = track;
+			return true;
+		}
+		// fall through, velocity 0 is a note-off
+	case SND_SEQ_EVENT_NOTEOFF:
+		if (!note_count[ch][ev.data.note.note])
+			return false;
+		note_count[ch][ev.data.note.note] --;
+		return true;
+	case SND_SEQ_EVENT_KEYPRESS:
+		return audible(ch, track);
+	}
+	return true;
+}
+// move a note event by the current transposition, false to drop it.
+// A note-off goes out on the key its note-on went out on.
+bool MidiPlayer::transpose_note(snd_seq_event_t &ev)
+{
+	unsigned ch = ev.data.note.channel;
+	unsigned key = ev.data.note.note;
+	if (ch == 9)
+		return true;	// drums: a different key is a different instrument
+	int to = sent_key[ch][key];
+	if (ev.type == SND_SEQ_EVENT_NOTEON && ev.data.note.velocity) {
+		to = key + transpose_by.load();
+		if (to < 0 || to > 127)
+			to = -1;
+		sent_key[ch][key] = to;
+	} else if (to < 0) {
+		to = key + transpose_by.load();
+		if (to < 0 || to > 127)
+			return false;
+	} else if (ev.type != SND_SEQ_EVENT_KEYPRESS)
+		sent_key[ch][key] = -1;
+	if (to < 0)
+		return false;
+	ev.data.note.note = to;
+	return true;
 }
+// helper functions, most are INLINE
 int MidiPlayer::read_byte(void) {
+	// past the end every read still advances, like getc() on a FILE
+	if (file_offset < file_size)
+		return file_data[file_offset++];
 	++file_offset;
-	return getc(file);
+	return EOF;
+}
+bool MidiPlayer::at_eof(void) {
+	return file_offset > file_size;
 }
 void MidiPlayer::skip(int bytes) {
-	while (bytes > 0)
-		read_byte(), --bytes;
+	if (bytes > 0)
+		file_offset += bytes;
+}
+// nanoseconds on the given clock (CLOCK_MONOTONIC, CLOCK_THREAD_CPUTIME_ID)
+static inline qint64 clock_ns(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return static_cast<qint64>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
 }
 
 #endif // PLAYER_H
@@ -0,0 +1,221 @@
+// playermanager.cpp   -- part of MIDI_PLAYER
+// several players on one sequencer client, pumped by a small pool of
+// engine threads; see playermanager.h
+// contains:
+//      PlayerManager()
+//      addSession()
+//      sessionCount()
+//      session()
+//      load()
+//      share()
+//      play()
+//      stop()
+//      cycle()
+//      takeStats()
+
+#include "playerwindow.h"	// hack!
+#include "player.h"
+#include "playermanager.h"
+
+#include <QThread>
+#include <QMutexLocker>
+
+// how long a worker sleeps between two passes over its sessions; like
+// SEQ_POLL_MS in player.cpp, well inside the engine's lookahead
+#define POOL_POLL_MS 10
+
+class PlayerManager::Worker : public QThread
+{
+public:
+	Worker(PlayerManager *manager, int index) : manager(manager), index(index) {}
+
+protected:
+	void run() {
+		while ( !isInterruptionRequested() ) {
+			manager->cycle( index );
+			msleep( POOL_POLL_MS );
+		}
+	}
+
+private:
+	PlayerManager *manager;
+	int index;
+};
+
+PlayerManager::PlayerManager( int threads )
+{
+	cycles = cycle_sum_ns = cycle_max_ns = 0;
+	cpu_mark = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+	wall_mark = clock_ns(CLOCK_MONOTONIC);
+	int err = snd_seq_open(&seq, "default", SND_SEQ_OPEN_OUTPUT, 0);
+	if ( err < 0 ) {
+		qDebug() << "Cannot open sequencer" << snd_strerror(err);
+		seq = NULL;
+		return;
+	}
+	snd_seq_set_client_name(seq, "midi_player");
+	// port 0, the source of every session's events
+	err = snd_seq_create_simple_port(seq, "midi_player", 0,
+		SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+	if ( err < 0 )
+		qDebug() << "Cannot create port" << snd_strerror(err);
+	for ( int w = 0; w < qMax(1, threads); ++ w ) {
+		workers << new Worker( this, w );
+		workers.back()->start( QThread::TimeCriticalPriority );
+	}
+	qDebug() << "Player manager: client" << snd_seq_client_id(seq) << "with" << workers.size() << "engine threads";
+}
+
+PlayerManager::~PlayerManager()
+{
+	for ( int w = 0; w < workers.size(); ++ w )
+		workers[w]->requestInterruption();
+	for ( int w = 0; w < workers.size(); ++ w ) {
+		workers[w]->wait();
+		delete workers[w];
+	}
+	for ( int n = 0; n < sessions.size(); ++ n ) {
+		stop( n );
+		delete sessions[n]->player;
+		delete sessions[n];
+	}
+	if ( seq )
+		snd_seq_close( seq );
+}
+
+int PlayerManager::addSession( int client, int port_num )
+{
+	if ( !seq )
+		return -1;
+	MidiPlayer *player = new MidiPlayer( seq );
+	player->init();
+	if ( player->connectTo(client, port_num) < 0 ) {
+		delete player;
+		return -1;
+	}
+	Session *s = new Session;
+	s->player = player;
+	s->active = false;
+	QMutexLocker lock( &sessions_lock );
+	sessions << s;
+	qDebug() << "Session" << sessions.size() - 1 << "on queue" << player->queue << "to" << client << ":" << port_num;
+	return sessions.size() - 1;
+}
+
+int PlayerManager::sessionCount()
+{
+	QMutexLocker lock( &sessions_lock );
+	return sessions.size();
+}
+
+MidiPlayer *PlayerManager::session( int n )
+{
+	return at( n )->player;
+}
+
+// session n; addSession() may grow the list meanwhile, but a session is
+// only deleted with the manager, so the pointer stays good unlocked
+PlayerManager::Session *PlayerManager::at( int n )
+{
+	QMutexLocker lock( &sessions_lock );
+	return sessions[n];
+}
+
+bool PlayerManager::load( int n, QString &file_name )
+{
+	stop( n );
+	Session *s = at( n );
+	QMutexLocker engine( &s->engine_lock );
+	return s->player->parseFile( file_name );
+}
+
+// the parsed song is immutable, the two sessions hold the same copy
+void PlayerManager::share( int from, int to )
+{
+	stop( to );
+	Session *s = at( to );
+	QMutexLocker engine( &s->engine_lock );
+	s->player->setSong( at(from)->player->getSong() );
+}
+
+void PlayerManager::play( int n )
+{
+	Session *s = at( n );
+	QMutexLocker engine( &s->engine_lock );
+	QMutexLocker out( &out_lock );
+	s->player->startPumping();
+	s->active = true;
+}
+
+void PlayerManager::stop( int n )
+{
+	Session *s = at( n );
+	QMutexLocker engine( &s->engine_lock );
+	if ( !s->active )
+		return;
+	QMutexLocker out( &out_lock );
+	s->player->stopPumping();
+	s->active = false;
+}
+
+bool PlayerManager::playing( int n )
+{
+	Session *s = at( n );
+	QMutexLocker engine( &s->engine_lock );
+	return s->active;
+}
+
+void PlayerManager::setSpeed( int n, double factor )
+{
+	Session *s = at( n );
+	QMutexLocker out( &out_lock );
+	s->player->setSpeed( factor );
+}
+
+// one pass of worker w over its sessions.  The client's output buffer is
+// shared, so only the pumping itself is serialized; each session's lock
+// keeps play() and stop() out while it is pumped.
+void PlayerManager::cycle( int w )
+{
+	qint64 start = clock_ns(CLOCK_MONOTONIC);
+	QList<Session *> mine;
+	{
+		QMutexLocker lock( &sessions_lock );
+		for ( int n = w; n < sessions.size(); n += workers.size() )
+			mine << sessions[n];
+	}
+	for ( int n = 0; n < mine.size(); ++ n ) {
+		QMutexLocker engine( &mine[n]->engine_lock );
+		if ( !mine[n]->active )
+			continue;
+		QMutexLocker out( &out_lock );
+		// at the end of the song the queue plays out and stops by itself
+		if ( !mine[n]->player->pump() )
+			mine[n]->active = false;
+	}
+	qint64 ns = clock_ns(CLOCK_MONOTONIC) - start;
+	QMutexLocker lock( &stats_lock );
+	cycles ++;
+	cycle_sum_ns += ns;
+	cycle_max_ns = qMax( cycle_max_ns, ns );
+}	// end cycle
+
+PlayerManager::Stats PlayerManager::takeStats()
+{
+	Stats st;
+	st.playing = 0;
+	int count = sessionCount();
+	for ( int n = 0; n < count; ++ n )
+		st.playing += playing( n );
+	qint64 cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+	qint64 wall = clock_ns(CLOCK_MONOTONIC);
+	QMutexLocker lock( &stats_lock );
+	st.cycles = cycles;
+	st.cycle_avg_ns = cycles ? cycle_sum_ns / cycles : 0;
+	st.cycle_max_ns = cycle_max_ns;
+	st.cpu_load = wall > wall_mark ? static_cast<double>(cpu - cpu_mark) / (wall - wall_mark) : 0;
+	cycles = cycle_sum_ns = cycle_max_ns = 0;
+	cpu_mark = cpu;
+	wall_mark = wall;
+	return st;
+}
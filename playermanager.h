@@ -0,0 +1,69 @@
+#ifndef PLAYERMANAGER_H
+#define PLAYERMANAGER_H
+
+#include <QString>
+#include <QList>
+#include <QMutex>
+
+#include <alsa/asoundlib.h>
+
+class MidiPlayer;
+
+// Any number of players in one process, each with its own queue and
+// destination, on one sequencer client.  A few engine threads pump all of
+// them instead of a thread per player, and a song loaded once is played
+// by as many sessions as want it.  Sessions use the seq engine only.
+class PlayerManager
+{
+public:
+	PlayerManager(int threads = 2);
+	~PlayerManager();
+
+	bool ready() { return seq != NULL; }
+
+	// a new session playing to client:port_num, its index or -1
+	int addSession( int client, int port_num );
+	int sessionCount();
+	MidiPlayer *session( int n );
+
+	bool load( int n, QString &file_name );	// parse a file for session n
+	void share( int from, int to );		// play the song of 'from' on 'to' too
+	void play( int n );
+	void stop( int n );
+	bool playing( int n );
+	void setSpeed( int n, double factor );
+
+	// what the engine threads did since the last call
+	struct Stats {
+		int playing;		// sessions
+		qint64 cycles;		// passes of a thread over its sessions
+		qint64 cycle_avg_ns;
+		qint64 cycle_max_ns;
+		double cpu_load;	// process CPU time over wall time, 1 = one core
+	};
+	Stats takeStats();
+
+private:
+	class Worker;
+	friend class Worker;
+
+	struct Session {
+		MidiPlayer *player;
+		QMutex engine_lock;	// held while a worker pumps it
+		bool active;
+	};
+
+	snd_seq_t *seq;
+	QMutex out_lock;		// the shared client's output buffer
+	QMutex sessions_lock;		// the list; a session stays until the end
+	QList<Session *> sessions;
+	Session *at( int n );
+	QList<Worker *> workers;	// worker w pumps sessions w, w + workers, ...
+	void cycle( int w );
+
+	QMutex stats_lock;
+	qint64 cycles, cycle_sum_ns, cycle_max_ns;
+	qint64 cpu_mark, wall_mark;
+};
+
+#endif // PLAYERMANAGER_H
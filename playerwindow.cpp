@@ -2,6 +2,9 @@
 
 #include "playerwindow.h"
 #include "player.h"
+#include "mixerdialog.h"
+#include "pianoroll.h"
+#include "library.h"
 
 #include "ui_midi_player.h"
 
@@ -11,40 +14,169 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <vector>
+#include <limits.h>
 #include <algorithm>
 #include <QTimer>
 #include <QFileDialog>
+#include <QFileInfo>
+#include <QGridLayout>
+#include <QLabel>
+#include <QShowEvent>
+#include <QSocketNotifier>
+#include <QProgressDialog>
+#include <QStatusBar>
 #include <iostream>
 
+// opens the sequencer and scans the ports while the window comes up
+class StartupThread : public QThread
+{
+public:
+	StartupThread(MidiPlayer *player, QObject *parent) : QThread(parent), player(player) {}
+protected:
+	void run() { player->init(); }
+private:
+	MidiPlayer *player;
+};
+
+// how often the progress of a load is shown, and after how long
+#define LOAD_POLL_MS 50
+#define LOAD_DIALOG_MS 300
+// how often the position is shown, more often with the piano roll open
+#define DISPLAY_MS 200
+#define ROLL_DISPLAY_MS 40
+
+// reads the file for the player while the window carries on, see startLoad()
+class LoadThread : public QThread
+{
+public:
+	LoadThread(MidiPlayer *player, const QString &file, const SongPtr &old, QObject *parent)
+		: QThread(parent), ok(0), player(player), file(file), old(old) {}
+	int ok;
+protected:
+	void run() {
+		// the song played so far goes first, and with it the GUI thread's
+		// share of freeing its millions of events
+		QElapsedTimer clock;
+		clock.start();
+		old.clear();
+		qDebug() << "Freed the previous song in" << clock.elapsed() << "ms";
+		ok = player->readFile( file );
+	}
+private:
+	MidiPlayer *player;
+	QString file;
+	SongPtr old;
+};
+
 // constructor
 PlayerWindow::PlayerWindow(QWidget *parent) :
     QMainWindow(parent),
 	ui(new Ui::PlayerWindow)
 {
+	startup_clock.start();
+	first_frame = false;
+	announce = NULL;
+	watcher = NULL;
+	clock_in = NULL;
+	loader = NULL;
+	load_dialog = NULL;
+	song_fresh = false;
 	ui->setupUi(this);
 	timer = new QTimer(this);
+	timer->setInterval(DISPLAY_MS);
 	connect(timer, SIGNAL(timeout()), this, SLOT(tickDisplay()));
+	load_timer = new QTimer(this);
+	load_timer->setInterval(LOAD_POLL_MS);
+	connect(load_timer, SIGNAL(timeout()), this, SLOT(loadProgress()));
 
 	player = new MidiPlayer( this );
-
-	ui->PortBox->clear();
-	ui->PortBox->addItems( player->getPorts() );
-	ui->PortBox->setCurrentIndex( player->getPortIndex() );
+	mixer = NULL;
+	roll = NULL;
+	library = NULL;
+	file_info = NULL;
+	progress_shift = 0;
+	loop_a = loop_b = -1;
+	ui->HighDensity_box->setChecked( player->highDensity() );
+	ui->Compact_box->setChecked( player->compact() );
+	ui->Preroll_box->setCurrentIndex( player->preroll() );
+
+	// nothing talks to the player until init() is done
+	ui->centralWidget->setEnabled(false);
+	statusBar()->showMessage("Connecting to the sequencer...");
+	startup = new StartupThread( player, this );
+	connect(startup, SIGNAL(finished()), this, SLOT(playerReady()));
+	startup->start();
 }   // end constructor
 
 PlayerWindow::~PlayerWindow()
 {
+	startup->wait();
+	if ( loader ) {
+		player->cancelLoad();
+		loader->wait();
+		player->useLoad();
+	}
+	delete announce;
+	delete watcher;
+	delete clock_in;
 	ui->Play_button->setChecked(false);
 	delete player;
+	delete library;
 	delete ui;
 }   // end destructor
 
+void PlayerWindow::showEvent(QShowEvent *event)
+{
+	QMainWindow::showEvent(event);
+	// the first paint is queued right behind the show
+	if ( !first_frame )
+		QTimer::singleShot(0, this, SLOT(firstFrame()));
+}
+
+void PlayerWindow::firstFrame()
+{
+	if ( first_frame )
+		return;
+	first_frame = true;
+	qDebug() << "Time to first frame:" << startup_clock.elapsed() << "ms";
+}
+
+void PlayerWindow::playerReady()
+{
+	fillPorts();
+	// from now on the port list follows the sequencer's announcements
+	if ( player->announceFd() >= 0 ) {
+		announce = new QSocketNotifier( player->announceFd(), QSocketNotifier::Read, this );
+		connect(announce, SIGNAL(activated(int)), this, SLOT(portsChanged()));
+	}
+	ui->centralWidget->setEnabled(true);
+	statusBar()->clearMessage();
+	qDebug() << "Time to ready:" << startup_clock.elapsed() << "ms," << player->getPorts().size() << "ports";
+	QStringList errors = player->takeErrors();
+	if ( !errors.isEmpty() )
+		QMessageBox::critical(this, "MIDI Player", errors.join("\n"));
+}
 //  SLOTS
 void PlayerWindow::on_Open_button_clicked()
 {
-	QString fn = QFileDialog::getOpenFileName(this,
-		"Open MIDI File", playfile,
+	if ( !library ) {
+		library = new MidiLibrary;
+		library->loadIndex();
+	}
+	// Qt's own dialog, so it has room for a line about the selected file
+	QFileDialog dialog(this, "Open MIDI File", playfile,
 		"MIDI files (*.mid *.MID);;Any (*.*)");
+	dialog.setOption(QFileDialog::DontUseNativeDialog);
+	dialog.setFileMode(QFileDialog::ExistingFile);
+	file_info = new QLabel(&dialog);
+	QGridLayout *grid = qobject_cast<QGridLayout *>(dialog.layout());
+	if ( grid )
+		grid->addWidget(file_info, grid->rowCount(), 0, 1, grid->columnCount());
+	connect(&dialog, SIGNAL(currentChanged(QString)), this, SLOT(showFileInfo(QString)));
+	bool accepted = dialog.exec();
+	file_info = NULL;
+	library->saveIndex();
+	QString fn = accepted ? dialog.selectedFiles().value(0) : QString();
 	if ( fn.isEmpty() )
 		return;
 
@@ -52,33 +184,250 @@ void PlayerWindow::on_Open_button_clicked()
 	ui->Play_button->setEnabled(false);
 	ui->Pause_button->setEnabled(false);
 	ui->MidiFile_display->clear();
-	player->closePort();
 
 	ui->MidiFile_display->setText(fn);
 	ui->MIDI_length_display->setText("00:00");
 	player->openPort();
 	playfile = fn;
-	if ( !player->parseFile(playfile) )
-	{
-		QMessageBox::critical(this, "MIDI Player", QString("Invalid file"));
+	startLoad( false );
+}   // end on_Open_button_clicked
+
+// the rest of opening a file, once it is loaded
+void PlayerWindow::songOpened()
+{
+	// a new song starts with everything audible
+	player->clearMix();
+	if ( mixer )
+		mixer->reload();
+	// and without loop points, looping the whole of it if Loop is on
+	loop_a = loop_b = -1;
+	applyLoop();
+	if ( ui->Watch_box->isChecked() )
+		player->setWatch( playfile );
+	showLength();
+	ui->Play_button->setEnabled(true);
+
+	// played as it is, not read again
+	song_fresh = true;
+	emit ui->Play_button->setChecked( true );
+}   // end songOpened
+
+// Read playfile on a thread of its own, with a progress dialog that can
+// cancel it; then finish opening it, or play it.  The window stays
+// responsive meanwhile, but takes no input.
+void PlayerWindow::startLoad( bool play )
+{
+	load_play = play;
+	load_cancelled = false;
+	load_stall = 0;
+	ui->centralWidget->setEnabled(false);
+	if ( mixer )
+		mixer->setEnabled(false);
+	if ( roll )
+		roll->clear();
+	// the old song is freed by the loader; nothing plays it or shows it any more
+	loader = new LoadThread( player, playfile, player->takeSong(), this );
+	connect(loader, SIGNAL(finished()), this, SLOT(loadFinished()));
+	load_dialog = new QProgressDialog( QString("Loading %1").arg(QFileInfo(playfile).fileName()), "Cancel", 0, 0, this );
+	load_dialog->setWindowModality(Qt::WindowModal);
+	load_dialog->setMinimumDuration(LOAD_DIALOG_MS);
+	connect(load_dialog, SIGNAL(canceled()), this, SLOT(cancelLoad()));
+	load_clock.start();
+	load_poll.start();
+	load_timer->start();
+	loader->start();
+}   // end startLoad
+
+// keep the dialog up to date, and see how late the event loop comes round
+void PlayerWindow::loadProgress()
+{
+	load_stall = qMax( load_stall, load_poll.restart() - LOAD_POLL_MS );
+	if ( load_cancelled )
+		return;
+	MidiPlayer::LoadProgress p = player->loadProgress();
+	if ( !p.file_bytes )
+		return;
+	load_dialog->setMaximum(p.file_bytes);
+	load_dialog->setValue(qMin(p.bytes, p.file_bytes - 1));	// the end closes it
+	if ( p.num_tracks && p.tracks == p.num_tracks )
+		load_dialog->setLabelText( QString("Preparing %1").arg(QFileInfo(playfile).fileName()) );
+	else
+		load_dialog->setLabelText( QString("Loading %1: %2 of %3 KB, track %4 of %5")
+								   .arg(QFileInfo(playfile).fileName()) .arg(p.bytes / 1024) .arg(p.file_bytes / 1024)
+								   .arg(p.tracks + 1) .arg(p.num_tracks) );
+}
+
+void PlayerWindow::cancelLoad()
+{
+	load_cancelled = true;
+	player->cancelLoad();
+}
+
+void PlayerWindow::loadFinished()
+{
+	loadProgress();
+	load_timer->stop();
+	int ok = loader->ok;
+	loader->deleteLater();
+	loader = NULL;
+	load_dialog->deleteLater();
+	load_dialog = NULL;
+	player->useLoad();
+	ui->centralWidget->setEnabled(true);
+	if ( mixer )
+		mixer->setEnabled(true);
+	if ( roll )
+		roll->reload();
+	qDebug() << "Loaded in" << load_clock.elapsed() << "ms, longest GUI stall" << load_stall << "ms";
+	if ( !ok ) {
+		if ( load_cancelled )
+			statusBar()->showMessage( "Loading cancelled", 3000 );
+		else {
+			QStringList errors = player->takeErrors();
+			QMessageBox::critical(this, "MIDI Player", errors.isEmpty() ? QString("Invalid file") : errors.join("\n"));
+		}
+		ui->Play_button->setChecked(false);
 		return;
-	}   // parseFile
+	}
+	if ( !load_play ) {
+		songOpened();
+		return;
+	}
+	// queue won't actually start until it is drained
+	timer->start();
+	player->startPlayer();
+}   // end loadFinished
+
+// the progress bar and the length display for the loaded song
+void PlayerWindow::showLength()
+{
 	qDebug() << "last tick: " << player->last_tick;
-	ui->progressBar->setRange(0, player->last_tick);
+	for ( progress_shift = 0; (player->last_tick >> progress_shift) > INT_MAX; progress_shift ++ )
+		;
+	ui->progressBar->setRange(0, player->last_tick >> progress_shift);
 	ui->progressBar->setTickInterval(player->song_length_seconds < 240 ?
-										player->last_tick / player->song_length_seconds * 10 :
-										player->last_tick / player->song_length_seconds * 30 );
+										(player->last_tick >> progress_shift) / player->song_length_seconds * 10 :
+										(player->last_tick >> progress_shift) / player->song_length_seconds * 30 );
 	ui->progressBar->setTickPosition(QSlider::TicksAbove);
-	ui->Play_button->setEnabled(true);
 
 	QString time;
 	time = QString::number( static_cast<int>(player->song_length_seconds / 60)).rightJustified( 2, '0' );
 	time += ":";
 	time += QString::number(static_cast<int>(player->song_length_seconds) % 60).rightJustified(2,'0');
 	ui->MIDI_length_display->setText( time );
+}
 
-	emit ui->Play_button->setChecked( true );
-}   // end on_Open_button_clicked
+void PlayerWindow::on_Watch_box_toggled(bool checked)
+{
+	if ( !checked ) {
+		player->setWatch( QString() );
+		return;
+	}
+	if ( !player->setWatch( playfile ) ) {
+		statusBar()->showMessage( "Cannot watch the file", 3000 );
+		ui->Watch_box->setChecked(false);
+		return;
+	}
+	if ( !watcher ) {
+		watcher = new QSocketNotifier( player->watchFd(), QSocketNotifier::Read, this );
+		connect(watcher, SIGNAL(activated(int)), this, SLOT(fileChanged()));
+	}
+}
+
+// play along with an external MIDI Clock: the player keeps the speed to
+// it, the window plays, pauses and seeks as its transport does
+void PlayerWindow::on_Follow_box_toggled(bool checked)
+{
+	if ( !player->setFollow( checked ) ) {
+		statusBar()->showMessage( "Cannot open the clock input", 3000 );
+		ui->Follow_box->setChecked(false);
+		return;
+	}
+	if ( checked && !clock_in ) {
+		clock_in = new QSocketNotifier( player->followFd(), QSocketNotifier::Read, this );
+		connect(clock_in, SIGNAL(activated(int)), this, SLOT(followClock()));
+	}
+	ui->Speed_box->setEnabled( !checked );
+}
+
+void PlayerWindow::followClock()
+{
+	int what = player->handleFollow();
+	if ( !what || loader || !ui->Play_button->isEnabled() )
+		return;
+	if ( what & MidiPlayer::FOLLOW_START ) {
+		if ( ui->Play_button->isChecked() )
+			ui->Play_button->setChecked(false);
+		ui->Play_button->setChecked(true);
+		return;
+	}
+	bool playing = ui->Play_button->isChecked();
+	if ( (what & MidiPlayer::FOLLOW_SEEK) && playing )
+		seekTo( player->followPosition() );
+	if ( !(what & MidiPlayer::FOLLOW_RUN) )
+		return;
+	if ( player->followRunning() ) {
+		// from a stop, the song plays from the top until it is seen to be off
+		if ( !playing )
+			ui->Play_button->setChecked(true);
+		else if ( ui->Pause_button->isChecked() )
+			ui->Pause_button->setChecked(false);
+	} else if ( playing && !ui->Pause_button->isChecked() )
+		ui->Pause_button->setChecked(true);
+}   // end followClock
+
+// the watched file was saved: swap in what changed, playing on
+void PlayerWindow::fileChanged()
+{
+	if ( !player->handleWatch() || playfile.isEmpty() || loader )
+		return;
+	QElapsedTimer clock;
+	clock.start();
+	int ok = player->reloadFile( playfile );
+	if ( ok < 0 && !player->isRunning() ) {
+		// not playing: read it again on the load thread, as Open does
+		ui->Play_button->setChecked(false);
+		startLoad( false );
+		return;
+	}
+	if ( ok < 0 ) {
+		// the tracks or the timing changed, play it again from the start
+		statusBar()->showMessage( "The file changed throughout, restarting", 3000 );
+		ui->Play_button->setChecked(false);
+		ui->Play_button->setChecked(true);
+		return;
+	}
+	if ( !ok ) {
+		statusBar()->showMessage( "Cannot reload the file, playing the old one", 3000 );
+		return;
+	}
+	showLength();
+	if ( roll )
+		roll->reload();
+	statusBar()->showMessage( QString("Reloaded in %1 ms") .arg(clock.elapsed()), 3000 );
+}
+
+// what the library knows of the file under the cursor in the open dialog
+void PlayerWindow::showFileInfo(const QString &path)
+{
+	if ( !file_info )
+		return;
+	file_info_path = QFileInfo(path).absoluteFilePath();
+	MidiInfo info;
+	if ( !QFileInfo(path).isFile() )
+		file_info->clear();
+	else if ( library->lookup(path, info, this, "fileInfoRead") || !info.error.isEmpty() )
+		file_info->setText( MidiLibrary::describe(info) );
+	else
+		file_info->setText( "Reading..." );
+}
+
+// the library has read a file for showFileInfo(); still the one selected?
+void PlayerWindow::fileInfoRead(const QString &path)
+{
+	if ( file_info && path == file_info_path )
+		showFileInfo( path );
+}
 
 void PlayerWindow::on_Play_button_toggled(bool checked)
 {
@@ -86,17 +435,22 @@ void PlayerWindow::on_Play_button_toggled(bool checked)
 	{
 		ui->Pause_button->setEnabled(true);
 		ui->Open_button->setEnabled(false);
+		ui->RawMidi_box->setEnabled(false);
+		ui->Clock_box->setEnabled(false);
+		ui->MTC_box->setEnabled(false);
+		ui->HighDensity_box->setEnabled(false);
 		ui->Play_button->setText("Stop");
 		ui->progressBar->setEnabled(true);
 
 		player->openPort();
-		if ( !player->parseFile(playfile) )
-		{
-			QMessageBox::critical(this, "MIDI Player", QString("Invalid file"));
+		// the file is read again for each play, unless Open just did
+		if ( !song_fresh ) {
+			startLoad( true );
 			return;
-		}   // parseFile
+		}
+		song_fresh = false;
 		// queue won't actually start until it is drained
-		timer->start(200);
+		timer->start();
 		player->startPlayer();
 	}
 	else
@@ -106,10 +460,18 @@ void PlayerWindow::on_Play_button_toggled(bool checked)
 
 		player->stopPlayer();
 		player->reset();
+		// errors from the playback thread, only the first one matters
+		QStringList errors = player->takeErrors();
+		if ( !errors.isEmpty() )
+			QMessageBox::critical(this, "MIDI Player", QString("%1\n(%2 errors during playback)") .arg(errors.first()) .arg(errors.size()));
+		if ( player->highDensity() )
+			statusBar()->showMessage( QString("%1 notes culled") .arg(player->culledNotes()) );
 		ui->progressBar->blockSignals(true);
 		ui->progressBar->setValue(0);
 		ui->progressBar->blockSignals(false);
 		ui->MIDI_time_display->setText("00:00");
+		if ( roll )
+			roll->setPosition(-1);
 		if (ui->Pause_button->isChecked()) {
 			ui->Pause_button->blockSignals(true);
 			ui->Pause_button->setChecked(false);
@@ -119,6 +481,10 @@ void PlayerWindow::on_Play_button_toggled(bool checked)
 		ui->Pause_button->setEnabled(false);
 		ui->Play_button->setText("Play");
 		ui->Open_button->setEnabled(true);
+		ui->RawMidi_box->setEnabled(true);
+		ui->Clock_box->setEnabled(true);
+		ui->MTC_box->setEnabled(true);
+		ui->HighDensity_box->setEnabled(true);
 		ui->progressBar->setEnabled(false);
 	}
 }   // end on_Play_button_toggled
@@ -146,9 +512,29 @@ void PlayerWindow::on_Panic_button_clicked()
 	player->silence();
 }   // end on_Panic_button_clicked
 
+void PlayerWindow::on_Mix_button_clicked()
+{
+	if ( !mixer )
+		mixer = new MixerDialog( player, this );
+	mixer->show();
+	mixer->raise();
+}   // end on_Mix_button_clicked
+
+void PlayerWindow::on_Roll_button_clicked()
+{
+	if ( !roll ) {
+		roll = new PianoRoll( player, this );
+		connect(roll, SIGNAL(seek(qint64)), this, SLOT(seekTo(qint64)));
+		// a smooth playhead from now on
+		timer->setInterval(ROLL_DISPLAY_MS);
+	}
+	roll->show();
+	roll->raise();
+}   // end on_Roll_button_clicked
+
 void PlayerWindow::on_progressBar_sliderPressed()
 {
-	if ( player->ready() || ui->Pause_button->isChecked() )
+	if ( !ui->Play_button->isChecked() || ui->Pause_button->isChecked() )
 		return;
 	// stop the timer and queue
 	if ( timer->isActive() )
@@ -158,57 +544,59 @@ void PlayerWindow::on_progressBar_sliderPressed()
 
 void PlayerWindow::on_progressBar_sliderReleased()
 {
-#if 0
-	snd_seq_event_t ev;
-	snd_seq_ev_clear(&ev);
-	snd_seq_ev_set_direct(&ev);
-	snd_seq_get_queue_status(seq, queue, status);
-	unsigned int current_tick = snd_seq_queue_status_get_tick_time(status);
-	const snd_seq_real_time_t *current_time = snd_seq_queue_status_get_real_time(status);
-	qDebug() << "Resetting queue from tick" << current_tick << "at" << current_time->tv_sec;
-	// reset queue position
-	snd_seq_ev_is_tick(&ev);
-	snd_seq_ev_set_queue_pos_tick(&ev, queue, 0);
-	snd_seq_event_output(seq, &ev);
-	snd_seq_drain_output(seq);
-	// scan the event queue for the closest tick >= 'x'
-	for (std::vector<event>::iterator Event=all_events.begin(); Event!=all_events.end(); ++Event)  {
-		if (static_cast<int>(Event->tick) >= ui->progressBar->sliderPosition()) {
-			ev.time.tick = Event->tick;
-			break;
-		}
-	}
-	ev.dest.client = SND_SEQ_CLIENT_SYSTEM;
-	ev.dest.port = SND_SEQ_PORT_SYSTEM_TIMER;
-	snd_seq_ev_set_queue_pos_tick(&ev, queue, ev.time.tick);
-	snd_seq_event_output(seq, &ev);
-	snd_seq_drain_output(seq);
-	snd_seq_real_time_t *new_time = new snd_seq_real_time_t;
-	double x = static_cast<double>(ev.time.tick)/all_events.back().tick;
-	new_time->tv_sec = (x*song_length_seconds);
-	new_time->tv_nsec = 0;
-	snd_seq_ev_set_queue_pos_real(&ev, queue, new_time);
-	// continue the timer
-	if (ui->Pause_button->isChecked()) return;
-	snd_seq_continue_queue(seq, queue, NULL);
-	snd_seq_drain_output(seq);
-	current_time = snd_seq_queue_status_get_real_time(status);
-	qDebug() << "to tick" << ev.time.tick << "at" << new_time->tv_sec;
-	startPlayer(ev.time.tick);
+	if ( !ui->Play_button->isChecked() )
+		return;
+	qint64 tick = static_cast<qint64>(ui->progressBar->sliderPosition()) << progress_shift;
+	player->seek( tick );
+	ui->MIDI_time_display->setText( timeText(player->currentTick) );
+	// paused, it stays paused at the new place
+	if ( ui->Pause_button->isChecked() )
+		return;
 	timer->start();
-#endif
+	player->resumePlayer();
 }   // end on_progressBar_sliderReleased
 
+// a click in the piano roll, or the master's clock: play on from there,
+// or stay paused there
+void PlayerWindow::seekTo( qint64 tick )
+{
+	if ( !ui->Play_button->isChecked() || loader )
+		return;
+	bool running = !ui->Pause_button->isChecked();
+	if ( running ) {
+		timer->stop();
+		player->pausePlayer();
+	}
+	player->seek( tick );
+	ui->progressBar->blockSignals(true);
+	ui->progressBar->setValue(player->currentTick >> progress_shift);
+	ui->progressBar->blockSignals(false);
+	ui->MIDI_time_display->setText( timeText(player->currentTick) );
+	if ( roll )
+		roll->setPosition( player->currentTick );
+	if ( !running )
+		return;
+	timer->start();
+	player->resumePlayer();
+}   // end seekTo
+
 void PlayerWindow::tickDisplay() {
 	// do timestamp display
 	unsigned int current_tick = player->getTick();
 	ui->progressBar->blockSignals(true);
-	ui->progressBar->setValue(current_tick);
+	ui->progressBar->setValue(current_tick >> progress_shift);
 	ui->progressBar->blockSignals(false);
-	double new_seconds = static_cast<double>(current_tick) / player->last_tick;
-	new_seconds *= player->song_length_seconds;
-	ui->MIDI_time_display->setText(QString::number(static_cast<int>(new_seconds)/60).rightJustified(2,'0')+":"+QString::number(static_cast<int>(new_seconds)%60).rightJustified(2,'0'));
-	if ( current_tick >= player->last_tick ) {
+	ui->MIDI_time_display->setText( timeText(current_tick) );
+	if ( roll )
+		roll->setPosition(current_tick);
+	if ( player->following() ) {
+		MidiPlayer::FollowStats s = player->followStats();
+		if ( s.locked )
+			statusBar()->showMessage( QString("Clock %1 BPM, jitter %2 us, drift %3 ms")
+				.arg(s.bpm, 0, 'f', 1) .arg(s.jitter_us, 0, 'f', 0) .arg(s.drift_ms, 0, 'f', 1) );
+	}
+	// a loop reaching to the end never gets there
+	if ( current_tick >= player->last_tick && current_tick >= player->loopEnd() ) {
 		sleep(1);
 		ui->Play_button->setChecked(false);
 	}
@@ -218,75 +606,156 @@ void PlayerWindow::on_MIDI_Volume_valueChanged(int val) {
 	player->setVolume( val );
 }
 
+void PlayerWindow::on_Speed_box_valueChanged(double factor)
+{
+	player->setSpeed( factor );
+}
+
+void PlayerWindow::on_Transpose_box_valueChanged(int semitones)
+{
+	player->setTranspose( semitones );
+}
+
+// playback position in ticks, 0 when stopped
+qint64 PlayerWindow::position()
+{
+	if ( ui->Pause_button->isChecked() )
+		return player->currentTick;
+	if ( timer->isActive() )
+		return player->getTick();
+	return 0;
+}
+
+QString PlayerWindow::timeText( qint64 tick )
+{
+	double seconds = player->last_tick ? static_cast<double>(tick) / player->last_tick * player->song_length_seconds : 0;
+	return QString::number(static_cast<int>(seconds)/60).rightJustified(2,'0')+":"+QString::number(static_cast<int>(seconds)%60).rightJustified(2,'0');
+}
+
+void PlayerWindow::on_LoopA_button_clicked()
+{
+	loop_a = position();
+	if ( loop_b <= loop_a )
+		loop_b = -1;
+	applyLoop();
+}
+
+void PlayerWindow::on_LoopB_button_clicked()
+{
+	qint64 tick = position();
+	if ( tick <= qMax(loop_a, 0LL) ) {
+		statusBar()->showMessage( "The loop end must come after its start", 3000 );
+		return;
+	}
+	loop_b = tick;
+	applyLoop();
+}
+
+void PlayerWindow::on_Loop_box_toggled(bool)
+{
+	applyLoop();
+}
+
+// hand the loop to the player, from A (or the start) to B (or the end)
+void PlayerWindow::applyLoop()
+{
+	qint64 a = loop_a >= 0 ? loop_a : 0;
+	qint64 b = loop_b >= 0 ? loop_b : player->last_tick + 1;
+	ui->LoopA_button->setText( loop_a >= 0 ? "A " + timeText(loop_a) : QString("A") );
+	ui->LoopB_button->setText( loop_b >= 0 ? "B " + timeText(loop_b) : QString("B") );
+	if ( ui->Loop_box->isChecked() )
+		player->setLoop( a, b );
+	else
+		player->clearLoop();
+}
+
 void PlayerWindow::on_PortBox_activated(int index)
 {
 	qDebug() << "Index changed";
 
-	player->closePort();
+	// moves the subscription over, if it is another port
 	player->openPort( index );
+	showPortOptions();
+}
+
+void PlayerWindow::on_RawMidi_box_toggled(bool checked)
+{
+	player->setEngine( checked ? MidiPlayer::ENGINE_RAWMIDI : MidiPlayer::ENGINE_SEQ );
+}
+
+void PlayerWindow::on_Clock_box_toggled(bool checked)
+{
+	int sync = player->getSync() & ~MidiPlayer::SYNC_CLOCK;
+	player->setSync( checked ? sync | MidiPlayer::SYNC_CLOCK : sync );
+}
+
+void PlayerWindow::on_MTC_box_toggled(bool checked)
+{
+	int sync = player->getSync() & ~MidiPlayer::SYNC_MTC;
+	player->setSync( checked ? sync | MidiPlayer::SYNC_MTC : sync );
+}
+
+// what the player keeps for the port it plays to
+void PlayerWindow::showPortOptions()
+{
+	ui->RawMidi_box->setChecked( player->getEngine() == MidiPlayer::ENGINE_RAWMIDI );
+	ui->Clock_box->setChecked( player->getSync() & MidiPlayer::SYNC_CLOCK );
+	ui->MTC_box->setChecked( player->getSync() & MidiPlayer::SYNC_MTC );
 }
 
-void PlayerWindow::on_butRescan_clicked()
+void PlayerWindow::on_HighDensity_box_toggled(bool checked)
+{
+	player->setHighDensity( checked );
+}
+
+void PlayerWindow::on_Compact_box_toggled(bool checked)
+{
+	player->setCompact( checked );
+}
+
+void PlayerWindow::fillPorts()
 {
-	player->scanPorts();
 	ui->PortBox->clear();
 	ui->PortBox->addItems( player->getPorts() );
 	ui->PortBox->setCurrentIndex( player->getPortIndex() );
+	showPortOptions();
 }
 
-static const unsigned char sysex_reset_GM[] = { 0xF0, 0x7E, 0x7F, 0x09, 0x01, 0xF7 };
-static const unsigned char sysex_reset_GS[] =
-	//{ 0xF0, 0x42, 0x12, 0x40, 0x00, 0x7F, 0x00, 0x41, 0xF7 };	// from GS_RESET.MID
-	{ 0xF0, 0x41, 0x10, 0x42, 0x12, 0x40, 0x00, 0x7F, 0x00, 0x41, 0xF7 };
-static const unsigned char sysex_reset_XG[] = { 0xF0, 0x43, 0x10, 0x4C, 0x00, 0x00, 0x7E, 0x00, 0xF7 };
+void PlayerWindow::portsChanged()
+{
+	if ( player->handleAnnounce() )
+		fillPorts();
+}
+
+// a reset goes out paced on the sequencer's clock, nothing waits for it
+void PlayerWindow::sendReset( int which )
+{
+	if ( !player->sendSequence( MidiPlayer::resetSequence(static_cast<MidiPlayer::Reset>(which)) ) )
+		statusBar()->showMessage( "Cannot send a reset while playing", 3000 );
+}
 
 void PlayerWindow::on_butResetGM_clicked()
 {
-	player->send_SysEx( sysex_reset_GM, sizeof(sysex_reset_GM) );
+	sendReset( MidiPlayer::RESET_GM );
 }
 
 void PlayerWindow::on_butResetGS_clicked()
 {
-	player->send_SysEx( sysex_reset_GS, sizeof(sysex_reset_GS) );
+	sendReset( MidiPlayer::RESET_GS );
 }
 
 void PlayerWindow::on_butResetXG_clicked()
 {
-	player->send_SysEx( sysex_reset_XG, sizeof(sysex_reset_XG) );
+	sendReset( MidiPlayer::RESET_XG );
 }
 
 void PlayerWindow::on_butResetMT32_clicked()
 {
-	static const unsigned char sysex_mt32_p2[] = { 0xF0, 0x41, 0x10, 0x42, 0x12, 0x40, 0x10, 0x0E, 0x00, 0x22, 0xF7 };
-	static const unsigned char sysex_mt32_p3[] = { 0xF0, 0x41, 0x10, 0x42, 0x12, 0x40, 0x01, 0x31, 0x00, 0x04, 0x35, 0x6A, 0x6B, 0xF7 };
-	unsigned i;
-
-	player->send_SysEx( sysex_reset_GS, sizeof(sysex_reset_GS) );
-	usleep(10000);
-	player->drain();
-
-	for ( i = 0; i < 10; i ++ )
-	{
-		// MT32 bank
-		player->send_controller( i, 0, 127 );
-		player->drain();
-		// reverb
-		player->send_controller( i, 91, 64 );
-		player->drain();
-		usleep(10000);
-	}
-
-	for ( i = 0; i < 10; i ++ )
-	{
-		unsigned char sysex_mt32_p1[] = { 0xF0, 0x41, 0x10, 0x42, 0x12, 0x40, 0x20 + i, 0x04, 0x04, 0x18 - i, 0xF7 };
-		player->send_SysEx( sysex_mt32_p1, sizeof(sysex_mt32_p1) );
-		usleep(10000);
-		player->drain();
-	}
-
-	player->send_SysEx( sysex_mt32_p2, sizeof(sysex_mt32_p2) );
-	usleep(10000);
-	player->drain();
+	sendReset( MidiPlayer::RESET_MT32 );
+}
 
-	player->send_SysEx( sysex_mt32_p3, sizeof(sysex_mt32_p3) );
+// the reset to send ahead of the song on every Play
+void PlayerWindow::on_Preroll_box_activated(int index)
+{
+	player->setPreroll( static_cast<MidiPlayer::Reset>(index) );
 }
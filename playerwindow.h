@@ -3,8 +3,16 @@
 
 #include <QMainWindow>
 #include <QTimer>
+#include <QElapsedTimer>
 
 class MidiPlayer;
+class MixerDialog;
+class PianoRoll;
+class MidiLibrary;
+class QLabel;
+class QSocketNotifier;
+class QProgressDialog;
+class LoadThread;
 
 namespace Ui {
 	class PlayerWindow;
@@ -19,7 +27,11 @@ public:
 	PlayerWindow(QWidget *parent = 0);
 	~PlayerWindow();
 
+	// measure startup from here instead of from the constructor
+	void setStartupClock( const QElapsedTimer &clock ) { startup_clock = clock; }
+
 protected:
+	void showEvent(QShowEvent *event);
 
 private:
 	Ui::PlayerWindow *ui;
@@ -27,23 +39,79 @@ private:
 	QTimer *timer;
 
 	MidiPlayer *player;
+	MixerDialog *mixer;	// created on first use
+	PianoRoll *roll;	// likewise
+	MidiLibrary *library;	// the index behind the file dialog, created on first use
+	QLabel *file_info;	// in the open file dialog while it is up
+	QString file_info_path;	// what it is about
+	QThread *startup;	// runs MidiPlayer::init()
+	QSocketNotifier *announce;	// port hotplug, see portsChanged()
+	QSocketNotifier *watcher;	// the loaded file, see fileChanged()
+	QSocketNotifier *clock_in;	// an external MIDI Clock, see followClock()
+	// loading on a thread of its own, see startLoad()
+	LoadThread *loader;		// while it runs
+	QProgressDialog *load_dialog;
+	QTimer *load_timer;
+	QElapsedTimer load_clock, load_poll;
+	qint64 load_stall;		// longest wait of the event loop, ms
+	bool load_play;			// play when done, else finish opening
+	bool load_cancelled;
+	bool song_fresh;		// just opened, Play need not read it again
+	QElapsedTimer startup_clock;
+	bool first_frame;
 	QString playfile;
+	int progress_shift;	// ticks >> progress_shift fit the slider's int range
+	qint64 loop_a, loop_b;	// loop points in ticks, -1 = not set
+	qint64 position();
+	QString timeText( qint64 tick );
+	void applyLoop();
+	void showLength();
+	void startLoad( bool play );
+	void songOpened();
+	void sendReset( int which );
+	void showPortOptions();
 
 private slots:
+	void firstFrame();
+	void playerReady();
+	void fillPorts();
 	void on_progressBar_sliderReleased();
 	void on_progressBar_sliderPressed();
+	void seekTo(qint64 tick);
 	void on_Pause_button_toggled(bool checked);
 	void on_Play_button_toggled(bool checked);
 	void on_Panic_button_clicked();
+	void on_Mix_button_clicked();
+	void on_Roll_button_clicked();
 	void on_Open_button_clicked();
+	void showFileInfo(const QString &path);
+	void fileInfoRead(const QString &path);
 	void on_MIDI_Volume_valueChanged(int);
+	void on_Speed_box_valueChanged(double factor);
+	void on_Transpose_box_valueChanged(int semitones);
+	void on_LoopA_button_clicked();
+	void on_LoopB_button_clicked();
+	void on_Loop_box_toggled(bool checked);
 	void tickDisplay();
 	void on_PortBox_activated(int index);
-	void on_butRescan_clicked();
+	void on_RawMidi_box_toggled(bool checked);
+	void on_Clock_box_toggled(bool checked);
+	void on_MTC_box_toggled(bool checked);
+	void on_HighDensity_box_toggled(bool checked);
+	void on_Compact_box_toggled(bool checked);
+	void portsChanged();
+	void on_Watch_box_toggled(bool checked);
+	void fileChanged();
+	void on_Follow_box_toggled(bool checked);
+	void followClock();
+	void loadProgress();
+	void cancelLoad();
+	void loadFinished();
 	void on_butResetGM_clicked();
 	void on_butResetGS_clicked();
 	void on_butResetXG_clicked();
 	void on_butResetMT32_clicked();
+	void on_Preroll_box_activated(int index);
 };
 
 #endif // MIDI_PLAYER_H
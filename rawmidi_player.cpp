@@ -0,0 +1,402 @@
+// rawmidi_player.cpp   -- part of MIDI_PLAYER
+// alternative playback engine: write the MIDI bytes straight to the rawmidi
+// device behind the selected port, timed with clock_nanosleep() against the
+// tempo map instead of the sequencer queue
+// contains:
+//      openRawOut()
+//      closeRawOut()
+//      run_rawmidi()
+//      raw_write()
+//      raw_release()
+//      raw_control()
+
+#include "playerwindow.h"	// hack!
+#include "player.h"
+
+#include "ui_midi_player.h" // hack!
+
+#include <math.h>
+
+#define NSEC_PER_SEC 1000000000LL
+// wire time of one byte
+#define MIDI_NSEC_PER_BYTE (NSEC_PER_SEC / MIDI_BYTES_PER_SEC)
+// lead time between starting the thread and the first event
+#define RAW_START_DELAY (20 * 1000000LL)
+// never sleep longer than this without checking for a stop request
+#define RAW_SLEEP_SLICE (50 * 1000000LL)
+// how long a speed change may wait to be noticed
+#define RAW_SPEED_SLICE (5 * 1000000LL)
+// how far writes may run ahead of the wire, and the largest single write
+#define RAW_PACE_AHEAD (10 * 1000000LL)
+#define RAW_CHUNK 32
+
+// sleep on CLOCK_MONOTONIC until 'when', false if a stop was requested
+static bool raw_sleep_until( QThread *thread, qint64 when )
+{
+	for (;;) {
+		qint64 now = clock_ns(CLOCK_MONOTONIC);
+		if ( now >= when )
+			return true;
+		if ( thread->isInterruptionRequested() )
+			return false;
+		qint64 wake = qMin( when, now + RAW_SLEEP_SLICE );
+		struct timespec ts;
+		ts.tv_sec = wake / NSEC_PER_SEC;
+		ts.tv_nsec = wake % NSEC_PER_SEC;
+		clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL );
+	}
+}
+
+int MidiPlayer::openRawOut()
+{
+	if ( raw_out )
+		return 1;
+	midi_dev.clear();
+	getRawDev( m_parent->ui->PortBox->currentText() );
+	if ( midi_dev.isEmpty() ) {
+		QMessageBox::critical(m_parent, "MIDI Player", QString("No rawmidi device behind port %1:%2, using the sequencer") .arg(port.client) .arg(port.port));
+		return 0;
+	}
+	// the sequencer holds the substream open while we are subscribed to it
+	disconnect_port();
+	int err = snd_rawmidi_open(NULL, &raw_out, midi_dev.toLocal8Bit().data(), 0);
+	if ( err < 0 ) {
+		check_snd("open rawmidi", err);
+		raw_out = NULL;
+		connect_port();
+		return 0;
+	}
+	qDebug() << "Opened rawmidi" << midi_dev;
+	return 1;
+}
+
+void MidiPlayer::closeRawOut()
+{
+	if ( raw_out ) {
+		snd_rawmidi_drop( raw_out );
+		snd_rawmidi_close( raw_out );
+		raw_out = NULL;
+		qDebug() << "Closed rawmidi" << midi_dev;
+		connect_port();
+	}
+}
+
+// write len bytes, never getting more than RAW_PACE_AHEAD ahead of the wire
+int MidiPlayer::raw_write( const unsigned char *buf, int len, qint64 &wire_free )
+{
+	while ( len > 0 ) {
+		qint64 now = clock_ns(CLOCK_MONOTONIC);
+		if ( wire_free < now )
+			wire_free = now;
+		else if ( wire_free - now > RAW_PACE_AHEAD &&
+				  !raw_sleep_until(this, wire_free - RAW_PACE_AHEAD) )
+			return 0;
+		ssize_t n = snd_rawmidi_write( raw_out, buf, qMin(len, RAW_CHUNK) );
+		if ( n < 0 ) {
+			qDebug() << "rawmidi write failed:" << snd_strerror(n);
+			return 0;
+		}
+		wire_free += n * MIDI_NSEC_PER_BYTE;
+		buf += n;
+		len -= n;
+	}
+	return 1;
+}
+
+// note-offs for keys (channel << 7 | key), in running status; false if a
+// write failed
+bool MidiPlayer::raw_release( const QVector<int> &keys, unsigned char &running, qint64 &wire_free )
+{
+	for ( int n = 0; n < keys.size(); ++ n ) {
+		unsigned char off[3] = { static_cast<unsigned char>(0x90 | keys[n] >> 7), static_cast<unsigned char>(keys[n] & 0x7F), 0 };
+		int skip = off[0] == running;
+		if ( !raw_write( off + skip, 3 - skip, wire_free ) )
+			return false;
+		running = off[0];
+	}
+	return true;
+}
+
+// a control sequence at its times from now, false if stopped
+bool MidiPlayer::raw_control( const ControlSequence &s, qint64 &wire_free )
+{
+	qint64 start = clock_ns(CLOCK_MONOTONIC);
+	for ( int n = 0; n < s.size(); ++ n ) {
+		const TimedMessage &m = s[n];
+		if ( !raw_sleep_until(this, start + m.ms * 1000000LL) )
+			return false;
+		if ( !m.bytes.isEmpty() &&
+			 !raw_write(reinterpret_cast<const unsigned char *>(m.bytes.constData()), m.bytes.size(), wire_free) )
+			return false;
+	}
+	return true;
+}
+
+void MidiPlayer::run_rawmidi()
+{
+	// song time to CLOCK_MONOTONIC; a speed change re-anchors it at the
+	// current position, so playback carries on from there at the new rate
+	struct {
+		qint64 wall, song;	// a moment where both are known
+		int skew;
+		qint64 at( qint64 song_ns ) const {
+			return wall + static_cast<qint64>(static_cast<double>(song_ns - song) * SKEW_BASE / skew);
+		}
+		void set_skew( int s, qint64 now ) {
+			song += static_cast<qint64>(static_cast<double>(now - wall) * skew / SKEW_BASE);
+			wall = now;
+			skew = s;
+		}
+		// sleep until song_ns is due, in short steps while the speed may
+		// change; returns when it was due
+		qint64 wait( QThread *thread, const QAtomicInt &speed, qint64 song_ns ) {
+			for (;;) {
+				qint64 now = clock_ns(CLOCK_MONOTONIC);
+				if ( speed.load() != skew )
+					set_skew( speed.load(), now );
+				qint64 target = at( song_ns );
+				if ( now >= target || !raw_sleep_until(thread, qMin(target, now + RAW_SPEED_SLICE)) )
+					return target;
+			}
+		}
+	} song_clock;
+	int end_delay = 2;
+	start_song();
+	int ppq = static_cast<int>(play_song->PPQ);
+	qint64 tempo = play_song->initial_tempo;	// usec per quarter
+	qint64 song_ns = 0;		// song time of prev_tick
+	qint64 prev_tick = 0;
+	bool started = false;		// the clock is anchored
+	qint64 wire_free = 0;		// when the UART will have sent all we wrote
+	unsigned char running = 0;	// running status
+	// lateness of each write against its tempo map time
+	qint64 late_max = 0, late_sum = 0;
+	double late_sq = 0;
+	int late_count = 0;
+	qint64 cpu_start = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	qint64 wall_start = clock_ns(CLOCK_MONOTONIC);
+
+	const unsigned char *bytes = reinterpret_cast<const unsigned char *>(play_song->wire.constData());
+	EventList::Reader events;
+	events.reset( &play_song->compiled );
+	reset_voices();
+	reset_notes();
+	qint64 pos = currentTick;	// song tick reached, for the loop end
+	loop_seen = -1;
+	// a song from the start: the reset chosen for it and the song's own
+	// setup go first, paced, and the clock starts behind them
+	qint64 setup_end = 0;
+	if ( currentTick == 0 ) {
+		ControlSequence s = resetSequence( preroll_reset );
+		setup_end = song_setup( *play_song, s, s.isEmpty() ? 0 : s.last().ms );
+		if ( !raw_control( s, wire_free ) )
+			return;
+		qDebug() << "rawmidi engine: pre-roll of" << s.size() << "messages took" << (clock_ns(CLOCK_MONOTONIC) - wall_start) / 1000 << "us";
+	}
+	for ( qint64 i = 0; ; ++ i )
+	{
+		refresh_loop();
+		qint64 tick = i < play_song->compiled.size() ? events[i].time.tick : play_song->last_tick + 1;
+		// anchor the clock at the first event from the start/resume point
+		if ( !started && tick >= currentTick ) {
+			song_clock.song = song_ns + static_cast<qint64>(currentTick - prev_tick) * tempo * 1000 / ppq;
+			song_clock.wall = clock_ns(CLOCK_MONOTONIC) + RAW_START_DELAY;
+			song_clock.skew = speed_skew.load();
+			started = true;
+			// picked up in the middle: what a seek left to chase, then the
+			// notes held there, when the first of them is due
+			if ( currentTick > 0 ) {
+				song_clock.wait( this, speed_skew, song_clock.song );
+				if ( isInterruptionRequested() )
+					break;
+				refresh_mix();
+				QVector<snd_seq_event_t> resume = seek_state + held_notes( currentTick );
+				seek_state.clear();
+				seek_tempo = 0;
+				QByteArray wire;
+				chase_wire( resume, wire );
+				if ( !wire.isEmpty() ) {
+					if ( !raw_write( reinterpret_cast<const unsigned char *>(wire.constData()), wire.size(), wire_free ) )
+						break;
+					running = 0;
+				}
+			}
+		}
+		// a reloaded song takes over between two ticks, when it is due: at
+		// pos if nothing there has gone out yet, else right after it
+		if ( started && swap_serial.loadAcquire() != swap_seen ) {
+			bool fresh = i == 0 || events[i - 1].time.tick < pos;
+			if ( fresh || tick > pos ) {
+				qint64 at = fresh ? pos : pos + 1;
+				song_ns += (at - prev_tick) * tempo * 1000 / ppq;
+				prev_tick = pos = at;
+				song_clock.wait( this, speed_skew, song_ns );
+				if ( isInterruptionRequested() )
+					break;
+				QVector<int> notes;
+				QVector<snd_seq_event_t> chase;
+				unsigned new_tempo;
+				i = take_swap( at, notes, chase, new_tempo ) - 1;
+				bytes = reinterpret_cast<const unsigned char *>(play_song->wire.constData());
+				events.reset( &play_song->compiled );
+				if ( !raw_release( notes, running, wire_free ) )
+					break;
+				QByteArray wire;
+				chase_wire( chase, wire );
+				if ( !wire.isEmpty() ) {
+					if ( !raw_write( reinterpret_cast<const unsigned char *>(wire.constData()), wire.size(), wire_free ) )
+						break;
+					running = 0;
+				}
+				if ( new_tempo )
+					tempo = new_tempo;
+				setup_end = 0;
+				continue;
+			}
+		}
+		// the loop end: release what sounds and chase the loop start's state
+		// right when it is due, then carry on from there in the same song time
+		if ( started && play_loop.b > play_loop.a && pos < play_loop.b && tick >= play_loop.b ) {
+			song_ns += (play_loop.b - prev_tick) * tempo * 1000 / ppq;
+			song_clock.wait( this, speed_skew, song_ns );
+			if ( isInterruptionRequested() )
+				break;
+			QVector<int> notes = take_notes( false );
+			if ( !raw_release( notes, running, wire_free ) )
+				break;
+			reset_voices();
+			const QByteArray &chase = play_loop.chase_wire;
+			if ( !chase.isEmpty() ) {
+				if ( !raw_write( reinterpret_cast<const unsigned char *>(chase.constData()), chase.size(), wire_free ) )
+					break;
+				running = 0;
+			}
+			QByteArray held;
+			chase_wire( held_notes( play_loop.a ), held );
+			if ( !held.isEmpty() ) {
+				if ( !raw_write( reinterpret_cast<const unsigned char *>(held.constData()), held.size(), wire_free ) )
+					break;
+				running = 0;
+			}
+			if ( play_loop.tempo )
+				tempo = play_loop.tempo;
+			prev_tick = pos = play_loop.a;
+			raw_tick.store( pos );
+			i = play_song->find_tick( play_loop.a ) - 1;
+			setup_end = 0;
+			continue;
+		}
+		if ( i == play_song->compiled.size() )
+			break;
+		const snd_seq_event_t &ev = events[i];
+		song_ns += (ev.time.tick - prev_tick) * tempo * 1000 / ppq;
+		prev_tick = ev.time.tick;
+		if ( ev.type == SND_SEQ_EVENT_TEMPO ) {
+			tempo = ev.data.queue.param.value;
+			continue;
+		}
+		if ( !started )
+			continue;
+		pos = tick;
+		if ( i < setup_end )
+			continue;	// sent in the pre-roll
+
+		// wait for the event, in short steps while the speed may change
+		qint64 target = song_clock.wait( this, speed_skew, song_ns );
+		if ( isInterruptionRequested() )
+			break;
+		// a changed mix silences what it mutes right away
+		if ( refresh_mix() ) {
+			QVector<int> muted = take_notes( true );
+			if ( !raw_release( muted, running, wire_free ) )
+				break;
+		}
+		if ( !mix_pass( events.track(i), ev ) )
+			continue;
+		Cull cull = CULL_SEND;
+		if ( polyphony && (ev.type == SND_SEQ_EVENT_NOTEON || ev.type == SND_SEQ_EVENT_NOTEOFF) ) {
+			cull = cull_note( ev );
+			if ( cull == CULL_DROP )
+				continue;
+		}
+		qint64 late = clock_ns(CLOCK_MONOTONIC) - target;
+		late_count ++;
+		late_sum += late;
+		late_sq += static_cast<double>(late) * late;
+		if ( late > late_max )
+			late_max = late;
+		if ( pre.timing && ev.type == SND_SEQ_EVENT_NOTEON && ev.data.note.velocity )
+			time_note( target + late, target );
+		raw_tick.store(ev.time.tick);
+
+		const unsigned char *p;
+		int len;
+		unsigned char msg[3];
+		if ( play_song->compiled.packed() ) {
+			// no wire bytes kept, the event makes them
+			len = EventList::message( ev, msg );
+			p = msg;
+		} else {
+			p = bytes + play_song->wire_index[i];
+			len = play_song->wire_index[i + 1] - play_song->wire_index[i];
+		}
+		if ( ev.type == SND_SEQ_EVENT_SYSEX ) {
+			p = static_cast<const unsigned char *>( ev.data.ext.ptr );
+			len = ev.data.ext.len;
+		}
+		if ( !len )
+			continue;
+		if ( cull == CULL_RETRIGGER ) {
+			// note-on with velocity 0 releases the key, and keeps running status
+			snd_seq_event_t release = ev;
+			release.type = SND_SEQ_EVENT_NOTEOFF;
+			if ( transpose_note(release) ) {
+				unsigned char off[3] = { static_cast<unsigned char>(0x90 | ev.data.note.channel), release.data.note.note, 0 };
+				int skip = off[0] == running;
+				if ( !raw_write( off + skip, 3 - skip, wire_free ) )
+					break;
+				running = off[0];
+			}
+		}
+		// the wire bytes carry the file's key, patch in the transposed one
+		unsigned char moved[3];
+		if ( ev.type == SND_SEQ_EVENT_NOTEON || ev.type == SND_SEQ_EVENT_NOTEOFF || ev.type == SND_SEQ_EVENT_KEYPRESS ) {
+			snd_seq_event_t note = ev;
+			if ( !transpose_note(note) )
+				continue;
+			moved[0] = p[0];
+			moved[1] = note.data.note.note;
+			moved[2] = p[2];
+			p = moved;
+		}
+		if ( ev.type == SND_SEQ_EVENT_SYSEX )
+			running = 0;	// sysex and escaped data cancel running status
+		else if ( *p == running )
+			p ++, len --;
+		else
+			running = *p;
+		if ( !raw_write( p, len, wire_free ) )
+			break;
+	}	// end for compiled events
+
+	if ( !isInterruptionRequested() )
+		snd_rawmidi_drain( raw_out );
+
+	if ( late_count ) {
+		double mean = static_cast<double>(late_sum) / late_count;
+		double dev = sqrt( qMax(0.0, late_sq / late_count - mean * mean) );
+		qDebug() << "rawmidi engine:" << late_count << "events, lateness mean" << mean / 1000 << "us, stddev"
+				 << dev / 1000 << "us, max" << late_max / 1000 << "us";
+	}
+	qDebug() << "rawmidi engine: cpu" << (clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start) / 1000 << "us over"
+			 << (clock_ns(CLOCK_MONOTONIC) - wall_start) / 1000000 << "ms";
+	if ( events.blocks )
+		qDebug() << "rawmidi engine: decoded" << events.blocks << "blocks in" << events.decode_ns / 1000 << "us";
+	if ( polyphony )
+		qDebug() << "Culled" << culled << "notes over a budget of" << polyphony << "voices";
+	report_start();
+
+	// give the last notes time to die away
+	if ( end_delay > 0 && !isInterruptionRequested() )
+		sleep(end_delay);
+}	// end run_rawmidi
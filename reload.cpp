@@ -0,0 +1,362 @@
+// reload.cpp   -- part of MIDI_PLAYER
+// watch mode: follow the loaded file as it is saved, decode only the
+// tracks whose chunks changed, splice them into a copy of the song and
+// hand that to the playing engine, which takes it over between two ticks
+// and chases the state the edit changed
+// contains:
+//      setWatch()
+//      handleWatch()
+//      reloadFile()
+//      splice_song()
+//      start_song()
+//      take_swap()
+//      swap_queue()
+
+#include "playerwindow.h"	// hack!
+#include "player.h"
+#include "midi_index.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QElapsedTimer>
+#include <QMutexLocker>
+
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+
+// changed track bytes a stopped player still splices on the GUI thread,
+// some tens of ms of decoding
+#define RELOAD_SPLICE_BYTES (1024 * 1024)
+
+static bool test_bit( const QVector<quint32> &bits, unsigned n )
+{
+	return (n >> 5) < static_cast<unsigned>(bits.size()) && ((bits[n >> 5] >> (n & 31)) & 1);
+}
+
+// the wire bytes of events [first, end) of s
+static void append_wire( QByteArray &wire, const Song &s, qint64 first, qint64 end )
+{
+	if ( first < end )
+		wire.append( s.wire.constData() + s.wire_index[first], s.wire_index[end] - s.wire_index[first] );
+}
+
+// Editors that save by writing a new file and renaming it over the old one
+// replace the inode, so the watch is on the directory, for the name.
+bool MidiPlayer::setWatch( const QString &file_name )
+{
+	if ( watch_fd < 0 ) {
+		watch_fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+		if ( watch_fd < 0 ) {
+			qDebug() << "Cannot start watching files:" << strerror(errno);
+			return false;
+		}
+	}
+	if ( watch_wd >= 0 )
+		inotify_rm_watch( watch_fd, watch_wd );
+	watch_wd = -1;
+	watch_name.clear();
+	if ( file_name.isEmpty() )
+		return true;
+	QFileInfo info( file_name );
+	watch_wd = inotify_add_watch( watch_fd, QFile::encodeName(info.absolutePath()).constData(), IN_CLOSE_WRITE | IN_MOVED_TO );
+	if ( watch_wd < 0 ) {
+		qDebug() << "Cannot watch" << info.absolutePath() << strerror(errno);
+		return false;
+	}
+	watch_name = info.fileName();
+	qDebug() << "Watching" << info.absoluteFilePath();
+	return true;
+}
+
+// read what inotify has, true if the watched file was written or moved in
+bool MidiPlayer::handleWatch()
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	bool saved = false;
+	ssize_t len;
+	while ( (len = read(watch_fd, buf, sizeof(buf))) > 0 ) {
+		for ( char *p = buf; p < buf + len; ) {
+			const struct inotify_event *ev = reinterpret_cast<const struct inotify_event *>(p);
+			if ( ev->wd == watch_wd && ev->len && QFile::decodeName(ev->name) == watch_name )
+				saved = true;
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+	return saved;
+}
+
+int MidiPlayer::reloadFile( QString &file_name )
+{
+	QElapsedTimer timer;
+	timer.start();
+	QFile midi_file(file_name);
+	// the parser and the index count in int
+	if ( midi_file.size() > INT_MAX ) {
+		qDebug() << "Cannot reload" << file_name << "- too big," << midi_file.size() << "bytes";
+		return 0;
+	}
+	if ( !midi_file.open(QIODevice::ReadOnly) || !(file_data = midi_file.map(0, midi_file.size())) ) {
+		qDebug() << "Cannot reload" << file_name << "-" << midi_file.errorString();
+		file_data = NULL;
+		return 0;
+	}
+	file_size = midi_file.size();
+	MidiIndex index;
+	bool indexed = index.build(file_data, file_size);
+	if ( indexed && (index.num_tracks != song->tracks || index.time_division != song->division) ) {
+		// another layout: nothing to keep, and ticks may mean something else
+		midi_file.unmap(const_cast<uchar *>(file_data));
+		file_data = NULL;
+		qDebug() << "Reload: the tracks or the timing changed";
+		return -1;
+	}
+	if ( !indexed ) {
+		// likely caught halfway through a save; the next one comes soon
+		qDebug() << "Reload:" << index.error.arg(file_name);
+		midi_file.unmap(const_cast<uchar *>(file_data));
+		file_data = NULL;
+		return 0;
+	}
+
+	// the tracks whose chunks changed, one bit each
+	QVector<quint32> changed( (song->tracks + 31) >> 5, 0 );
+	QVector<quint64> hashes( song->tracks );
+	int count = 0;
+	for ( int j = 0; j < song->tracks; ++ j ) {
+		const MidiIndex::Chunk &chunk = index.tracks[j];
+		hashes[j] = Song::hash( file_data + chunk.offset, qMin(chunk.length, file_size - chunk.offset) );
+		if ( j >= song->track_hash.size() || hashes[j] != song->track_hash[j] ) {
+			changed[j >> 5] |= 1u << (j & 31);
+			count ++;
+		}
+	}
+	if ( !count ) {
+		midi_file.unmap(const_cast<uchar *>(file_data));
+		file_data = NULL;
+		qDebug() << "Reload: no track changed";
+		return 1;
+	}
+	// the splice decodes on the caller's thread, the GUI's; stopped, a big
+	// edit is better read again on the load thread
+	qint64 changed_bytes = 0;
+	for ( int j = 0; j < song->tracks; ++ j )
+		if ( test_bit(changed, j) )
+			changed_bytes += index.tracks[j].length;
+	if ( changed_bytes > RELOAD_SPLICE_BYTES && !isRunning() ) {
+		midi_file.unmap(const_cast<uchar *>(file_data));
+		file_data = NULL;
+		qDebug() << "Reload:" << changed_bytes << "bytes changed";
+		return -1;
+	}
+	if ( song->compiled.packed() ) {
+		// compact storage has not kept the events a splice starts from
+		midi_file.unmap(const_cast<uchar *>(file_data));
+		file_data = NULL;
+		qDebug() << "Reload: the song is packed";
+		return -1;
+	}
+
+	// decode the changed tracks the way read_smf() does, into a song of
+	// their own with the header of the old one
+	load = new Song;
+	load->tracks = song->tracks;
+	load->format = index.format;
+	load->division = song->division;
+	load->track_hash = hashes;
+	load->PPQ = song->PPQ;
+	load->initial_tempo = song->initial_tempo;
+	load->BPM = 60000000.0 / song->initial_tempo;
+	load->sf = song->sf;
+	load->minor_key = song->minor_key;
+	smpte_timing = !!(song->division & 0x8000);
+	prev_tick = 0;
+	load_cancel.store( 0 );
+	load_check = LOAD_CHECK_BYTES;
+	track_start.clear();
+	int ok = 1;
+	for ( int j = 0; ok && j < song->tracks; ++ j ) {
+		if ( !test_bit(changed, j) )
+			continue;
+		track_start.append( load->all_events.size() );
+		file_offset = index.tracks[j].offset;
+		ok = read_track(j, file_offset + index.tracks[j].length, file_name);
+	}
+	midi_file.unmap(const_cast<uchar *>(file_data));
+	file_data = NULL;
+	if ( !ok ) {
+		delete load;
+		load = NULL;
+		return 0;
+	}
+	merge_tracks();
+	qint64 decode_ns = timer.nsecsElapsed();
+
+	// the splice keeps at most all of both
+	if ( song->all_events.size() + load->all_events.size() > MAX_WIRE_EVENTS ) {
+		qDebug() << "Reload:" << file_name << "too many events";
+		delete load;
+		load = NULL;
+		return 0;
+	}
+	splice_song( *song, changed );
+	load->last_tick = load->all_events.size() ? load->all_events.back().tick : 0;
+	if ( load->last_tick > UINT_MAX ) {
+		qDebug() << "Reload:" << file_name << "too long," << load->last_tick << "ticks";
+		delete load;
+		load = NULL;
+		return 0;
+	}
+	load->index_notes();
+	load->build_roll();
+	load->build_tempo_map();
+	load->length_seconds = load->tempo_map.usec( load->last_tick ) / 1000000;
+
+	SongPtr next( load );
+	load = NULL;
+	if ( isRunning() ) {
+		QMutexLocker lock( &swap_lock );
+		// a swap the engine has not taken yet is replaced, its tracks too
+		if ( swap_song )
+			for ( int w = 0; w < changed.size(); ++ w )
+				changed[w] |= swap_tracks.value(w);
+		swap_song = next;
+		swap_tracks = changed;
+		swap_serial.ref();
+	}
+	use_song( next );
+	qDebug() << "Reloaded" << count << "of" << song->tracks << "tracks in" << timer.nsecsElapsed() / 1000
+			 << "us: decode" << decode_ns / 1000 << "us, splice" << (timer.nsecsElapsed() - decode_ns) / 1000 << "us";
+	return 1;
+}	// end reloadFile
+
+// Build the rest of load from old: its events of the unchanged tracks,
+// ready compiled, merged with the freshly decoded ones in load, which are
+// compiled on the way.  Equal ticks keep track order, as merge_tracks()
+// does, so the result is what a full parse would give.
+void MidiPlayer::splice_song( const Song &old, const QVector<quint32> &changed )
+{
+	ChunkedList<Song::event> fresh;
+	fresh.swap( load->all_events );
+	qint64 size = old.all_events.size() + fresh.size();
+	load->all_events.reserve( size );
+	load->compiled.reserve( size );
+	load->wire_index.reserve( size + 1 );
+	load->wire.reserve( old.wire.size() );
+	// the wire bytes of kept events go over a run at a time
+	qint64 run = 0, run_end = 0;
+	int wire_at = 0;
+	qint64 i = 0, k = 0;
+	while ( i < old.all_events.size() || k < fresh.size() ) {
+		if ( i < old.all_events.size() && test_bit(changed, old.all_events[i].track) ) {
+			++ i;
+			continue;
+		}
+		if ( k == fresh.size() || (i < old.all_events.size() &&
+			 (old.all_events[i].tick < fresh[k].tick ||
+			  (old.all_events[i].tick == fresh[k].tick && old.all_events[i].track < fresh[k].track))) ) {
+			// unchanged: copy it over as compiled, the payload into our arena
+			Song::event e = old.all_events[i];
+			snd_seq_event_t ev = old.compiled[i];
+			if ( e.type == SND_SEQ_EVENT_SYSEX ) {
+				e.sysex = load->intern_sysex( false, e.sysex, e.data.length );
+				ev.data.ext.ptr = const_cast<unsigned char *>(e.sysex);
+			}
+			load->all_events.push_back( e );
+			load->compiled.push_back( ev, e.track );
+			if ( run_end != i ) {
+				append_wire( load->wire, old, run, run_end );
+				run = i;
+			}
+			run_end = i + 1;
+			load->wire_index.push_back( wire_at );
+			wire_at += old.wire_index[i + 1] - old.wire_index[i];
+			++ i;
+		} else {
+			append_wire( load->wire, old, run, run_end );
+			run = run_end = 0;
+			load->all_events.push_back( fresh[k] );
+			compile_event( *load, fresh[k] );
+			wire_at = load->wire.size();
+			++ k;
+		}
+	}
+	append_wire( load->wire, old, run, run_end );
+	load->wire_index.push_back( load->wire.size() );
+}	// end splice_song
+
+// engines: start on the song of the GUI side, a pending swap is moot
+void MidiPlayer::start_song()
+{
+	QMutexLocker lock( &swap_lock );
+	play_song = song;
+	swap_song.clear();
+	swap_seen = swap_serial.load();
+}
+
+// engines: take over the reloaded song at song tick 'at'.  What still
+// sounds of the changed tracks comes back in notes, as take_notes() hands
+// it out, and the state the new song has at 'at' where it differs in chase
+// and tempo, see swap_chase().  Returns the index to go on from.
+qint64 MidiPlayer::take_swap( qint64 at, QVector<int> &notes, QVector<snd_seq_event_t> &chase, unsigned &tempo )
+{
+	SongPtr old = play_song;
+	QVector<quint32> tracks;
+	{
+		QMutexLocker lock( &swap_lock );
+		swap_seen = swap_serial.load();
+		if ( swap_song )
+			play_song = swap_song;
+		tracks = swap_tracks;
+		swap_song.clear();
+	}
+	notes = take_track_notes( tracks );
+	tempo = 0;
+	if ( play_song != old )
+		swap_chase( *old, *play_song, at, chase, tempo );
+	// the old song is freed by the GUI side, not here
+	{
+		QMutexLocker lock( &swap_lock );
+		retired = old;
+	}
+	qDebug() << "Swapped in the reloaded song at tick" << at << "-" << notes.size() << "notes released,"
+			 << chase.size() << "events chased" << (tempo ? "and the tempo" : "");
+	return play_song->find_tick( at );
+}
+
+// seq engine: take the swap, with the releases and the chase at 'at' on
+// the queue right behind what is queued already
+qint64 MidiPlayer::swap_queue( qint64 at, qint64 offset, qint64 &tempo )
+{
+	QVector<int> notes;
+	QVector<snd_seq_event_t> chase;
+	unsigned new_tempo;
+	qint64 next = take_swap( at, notes, chase, new_tempo );
+	snd_seq_event_t ev;
+	int err;
+	for ( int n = 0; n < notes.size(); ++ n ) {
+		snd_seq_ev_clear(&ev);
+		snd_seq_ev_set_noteoff(&ev, notes[n] >> 7, notes[n] & 0x7F, 0);
+		snd_seq_ev_schedule_tick(&ev, queue, 0, at + offset);
+		ev.dest = port;
+		err = seq_output(ev);
+		check_snd("output event", err);
+	}
+	for ( int n = 0; n < chase.size(); ++ n ) {
+		ev = chase[n];
+		snd_seq_ev_schedule_tick(&ev, queue, 0, at + offset);
+		ev.dest = port;
+		err = seq_output(ev);
+		check_snd("output event", err);
+	}
+	if ( new_tempo ) {
+		snd_seq_ev_clear(&ev);
+		snd_seq_ev_set_queue_tempo(&ev, queue, new_tempo);
+		snd_seq_ev_schedule_tick(&ev, queue, 0, at + offset);
+		err = seq_output(ev);
+		check_snd("output event", err);
+		tempo = new_tempo;
+	}
+	return next;
+}	// end swap_queue
@@ -0,0 +1,362 @@
+// simulate.cpp   -- part of MIDI_PLAYER
+// the seq engine against a virtual queue: no ALSA client, no port and no
+// waiting.  What the engine outputs is kept here by tick or by real time,
+// as the queue would keep it, and played when the virtual clock gets
+// there; tempo changes and the skew move the clock on, a Stop to the timer
+// stops it.  The clock moves only where the engine would wait: by the
+// poll of run(), the second handle_big_sysex() sleeps, and to the steps
+// of the script.  So a song plays out in the time the engine takes, and
+// the log of every run of it is the same: a line an event played, the
+// wall time in microseconds from Play, the queue tick, and the event.
+// contains:
+//      simulate()
+//      sim_step()
+//      seq_sync()
+//      seq_wait()
+//      queue_tick()
+//      sim_output()
+//      sim_tick_ns()
+//      sim_rebase()
+//      sim_advance()
+//      sim_next()
+//      sim_play()
+//      sim_drop()
+
+#include "playerwindow.h"	// hack!
+#include "player.h"
+
+#include <limits.h>
+#include <math.h>
+
+#define NSEC_PER_SEC 1000000000LL
+#define NSEC_PER_MSEC 1000000LL
+// the seq engine's poll while it is a lookahead ahead, see run()
+#define SIM_POLL_MS 10
+// events played before the first still queued are let go in batches
+#define SIM_COMPACT 4096
+// SysEx bytes the log shows
+#define SIM_SYSEX_BYTES 16
+
+static QString hex( unsigned char c )
+{
+	return QString( "%1" ).arg( c, 2, 16, QChar('0') ).toUpper();
+}
+
+// Play the loaded song from the top as startPlayer() would, with the queue
+// started at once; the pre-roll is left out.  The script's steps are in
+// the order of their times.
+MidiPlayer::SimStats MidiPlayer::simulate( const QVector<SimStep> &script, QTextStream &log )
+{
+	SimStats st;
+	memset( &st, 0, sizeof(st) );
+	Sim &s = sim;
+	s.on = true;
+	s.log = &log;
+	// a destination apart from the timer, whatever the settings say
+	snd_seq_addr_t dest = port;
+	port.client = SND_SEQ_ADDRESS_SUBSCRIBERS;
+	port.port = SND_SEQ_ADDRESS_UNKNOWN;
+	s.wall_ns = s.real_ns = s.base_ns = 0;
+	s.base_tick = 0;
+	s.running = true;
+	s.paused = false;
+	s.tempo = song->initial_tempo;
+	s.skew = speed_skew.load();
+	s.ticked.clear();
+	s.timed.clear();
+	s.next_ticked = s.next_timed = 0;
+	s.events = 0;
+	currentTick = paused_tick = 0;
+	resume_offset = 0;
+	seek_state.clear();
+	seek_tempo = 0;
+	culled = 0;
+	halted.store( 0 );
+	begin_pump();
+	bool pumping = true;
+	int step = 0;
+	for ( ; ; ) {
+		if ( pumping ) {
+			qint64 start = clock_ns(CLOCK_MONOTONIC);
+			pumping = pump();
+			st.engine_ns += clock_ns(CLOCK_MONOTONIC) - start;
+			st.pumps ++;
+		}
+		if ( !pumping && step == script.size() )
+			break;
+		// on to the engine's next poll, or the next step if that is sooner
+		qint64 at = pumping ? s.wall_ns + SIM_POLL_MS * NSEC_PER_MSEC : LLONG_MAX;
+		if ( step < script.size() )
+			at = qMin( at, qMax(s.wall_ns, script[step].ms * NSEC_PER_MSEC) );
+		sim_advance( at );
+		while ( step < script.size() && script[step].ms * NSEC_PER_MSEC <= s.wall_ns )
+			sim_step( script[step++], pumping );
+	}
+	// the rest of the song plays out
+	seq_sync();
+	log.flush();
+	st.events = s.events;
+	st.wall_ns = s.wall_ns;
+	s.on = false;
+	port = dest;
+	s.ticked.clear();
+	s.timed.clear();
+	return st;
+}	// end simulate
+
+// a step of the script, as the GUI would take it
+void MidiPlayer::sim_step( const SimStep &step, bool &pumping )
+{
+	Sim &s = sim;
+	switch ( step.action ) {
+	case SIM_PAUSE:
+		if ( s.paused )
+			break;
+		// pausePlayer(): the engine stops, what it queued is dropped, the
+		// queue stops where it is and the notes are silenced
+		pumping = false;
+		sim_drop();
+		s.running = false;
+		s.paused = true;
+		pause_at( queue_tick() );
+		for ( int x = 0; x < 16; x ++ )
+		{
+			send_controller( x, 123, 0 );
+			send_controller( x, 120, 0 );
+		}
+		qDebug() << "Simulation: paused at tick" << currentTick;
+		break;
+	case SIM_RESUME:
+		if ( !s.paused )
+			break;
+		// resumePlayer(): the queue continues and the engine picks the
+		// song up where it was left
+		s.running = true;
+		s.paused = false;
+		begin_pump();
+		pumping = true;
+		break;
+	case SIM_SEEK:
+		if ( s.paused )
+			seek( static_cast<qint64>(step.a) );
+		break;
+	case SIM_SPEED:
+		sim_rebase();
+		setSpeed( step.a );
+		s.skew = speed_skew.load();
+		break;
+	case SIM_LOOP:
+		setLoop( static_cast<qint64>(step.a), static_cast<qint64>(step.b) );
+		break;
+	}
+}	// end sim_step
+
+// wait until all queued has played
+int MidiPlayer::seq_sync()
+{
+	if ( !sim.on )
+		return snd_seq_sync_output_queue( seq );
+	qint64 real;
+	bool timed;
+	while ( sim.running && sim_next(real, timed) )
+		sim_advance( sim.wall_ns + real - sim.real_ns );
+	return 0;
+}
+
+void MidiPlayer::seq_wait( int ms )
+{
+	if ( sim.on )
+		sim_advance( sim.wall_ns + ms * NSEC_PER_MSEC );
+	else
+		msleep( ms );
+}
+
+// the queue's tick now, and its real time if asked
+qint64 MidiPlayer::queue_tick( qint64 *real_ns )
+{
+	if ( sim.on ) {
+		if ( real_ns )
+			*real_ns = sim.real_ns;
+		return static_cast<qint64>( floor(sim.base_tick + (sim.real_ns - sim.base_ns) / sim_tick_ns()) );
+	}
+	snd_seq_queue_status_t *qstatus;
+	snd_seq_queue_status_alloca( &qstatus );
+	int err = snd_seq_get_queue_status( seq, queue, qstatus );
+	check_snd("get queue status", err);
+	if ( real_ns ) {
+		const snd_seq_real_time_t *rt = snd_seq_queue_status_get_real_time( qstatus );
+		*real_ns = rt->tv_sec * NSEC_PER_SEC + rt->tv_nsec;
+	}
+	return snd_seq_queue_status_get_tick_time( qstatus );
+}	// end queue_tick
+
+// An event for the virtual queue: after everything due no later than it,
+// as the queue keeps them.  The variable part is copied, as ALSA copies it
+// into its output buffer.  A direct event plays right away.
+int MidiPlayer::sim_output( snd_seq_event_t &ev, bool direct )
+{
+	Sim &s = sim;
+	Queued q;
+	q.ev = ev;
+	if ( snd_seq_ev_is_variable(&ev) )
+		q.data = QByteArray( static_cast<const char *>(ev.data.ext.ptr), ev.data.ext.len );
+	if ( direct || ev.queue == SND_SEQ_QUEUE_DIRECT ) {
+		sim_play( q );
+		return 0;
+	}
+	bool real = snd_seq_ev_is_real(&ev);
+	QVector<Queued> &to = real ? s.timed : s.ticked;
+	int lo = real ? s.next_timed : s.next_ticked;
+	int hi = to.size();
+	qint64 due = real ? ev.time.time.tv_sec * NSEC_PER_SEC + ev.time.time.tv_nsec : ev.time.tick;
+	// mostly in order already
+	while ( lo < hi ) {
+		const snd_seq_event_t &e = to[hi - 1].ev;
+		qint64 at = real ? e.time.time.tv_sec * NSEC_PER_SEC + e.time.time.tv_nsec : e.time.tick;
+		if ( at <= due )
+			break;
+		-- hi;
+	}
+	to.insert( hi, q );
+	return 0;
+}	// end sim_output
+
+// real time per queue tick, at the tempo and skew in effect
+double MidiPlayer::sim_tick_ns()
+{
+	return sim.tempo * 1000.0 / play_song->PPQ * SKEW_BASE / sim.skew;
+}
+
+// where the queue is now, before its tempo or skew changes
+void MidiPlayer::sim_rebase()
+{
+	Sim &s = sim;
+	s.base_tick += (s.real_ns - s.base_ns) / sim_tick_ns();
+	s.base_ns = s.real_ns;
+}
+
+// the virtual clock on to wall_ns, the queue playing what falls due
+// meanwhile while it runs
+void MidiPlayer::sim_advance( qint64 wall_ns )
+{
+	Sim &s = sim;
+	qint64 real;
+	bool timed;
+	while ( s.running && sim_next(real, timed) && real - s.real_ns <= wall_ns - s.wall_ns ) {
+		s.wall_ns += real - s.real_ns;
+		s.real_ns = real;
+		if ( timed )
+			sim_play( s.timed[s.next_timed ++] );
+		else
+			sim_play( s.ticked[s.next_ticked ++] );
+	}
+	if ( s.running )
+		s.real_ns += wall_ns - s.wall_ns;
+	s.wall_ns = wall_ns;
+	if ( s.next_ticked > SIM_COMPACT ) {
+		s.ticked.remove( 0, s.next_ticked );
+		s.next_ticked = 0;
+	}
+	if ( s.next_timed > SIM_COMPACT ) {
+		s.timed.remove( 0, s.next_timed );
+		s.next_timed = 0;
+	}
+}	// end sim_advance
+
+// the queue real time of the next event to play, a tick event first of
+// two at the same time; false if none is left
+bool MidiPlayer::sim_next( qint64 &real_ns, bool &timed )
+{
+	Sim &s = sim;
+	bool any = false;
+	if ( s.next_ticked < s.ticked.size() ) {
+		double ticks = s.ticked[s.next_ticked].ev.time.tick - s.base_tick;
+		real_ns = qMax( s.real_ns, s.base_ns + static_cast<qint64>(ceil(ticks * sim_tick_ns())) );
+		timed = false;
+		any = true;
+	}
+	if ( s.next_timed < s.timed.size() ) {
+		const snd_seq_real_time_t &t = s.timed[s.next_timed].ev.time.time;
+		qint64 at = qMax( s.real_ns, t.tv_sec * NSEC_PER_SEC + t.tv_nsec );
+		if ( !any || at < real_ns ) {
+			real_ns = at;
+			timed = true;
+		}
+		any = true;
+	}
+	return any;
+}	// end sim_next
+
+// an event reaches its destination, or the timer: a line of the log
+void MidiPlayer::sim_play( const Queued &q )
+{
+	Sim &s = sim;
+	const snd_seq_event_t &ev = q.ev;
+	bool queued = ev.queue != SND_SEQ_QUEUE_DIRECT && snd_seq_ev_is_tick(&ev);
+	QTextStream &log = *s.log;
+	log << s.wall_ns / 1000 << ' ' << (queued ? ev.time.tick : queue_tick()) << ' ';
+	bool timer = ev.dest.client == SND_SEQ_CLIENT_SYSTEM && ev.dest.port == SND_SEQ_PORT_SYSTEM_TIMER;
+	unsigned char msg[3];
+	int len = EventList::message( ev, msg );
+	for ( int k = 0; k < len; ++ k )
+		log << (k ? " " : "") << hex( msg[k] );
+	if ( !len ) switch ( ev.type ) {
+	case SND_SEQ_EVENT_SYSEX:
+		for ( int k = 0; k < q.data.size() && k < SIM_SYSEX_BYTES; ++ k )
+			log << (k ? " " : "") << hex( q.data[k] );
+		if ( q.data.size() > SIM_SYSEX_BYTES )
+			log << " .. " << q.data.size() << " bytes";
+		break;
+	case SND_SEQ_EVENT_TEMPO:
+		sim_rebase();
+		s.tempo = ev.data.queue.param.value;
+		log << "tempo " << s.tempo;
+		break;
+	case SND_SEQ_EVENT_SETPOS_TICK:
+		s.base_tick = ev.data.queue.param.time.tick;
+		s.base_ns = s.real_ns;
+		log << "position";
+		break;
+	case SND_SEQ_EVENT_START:
+		if ( timer ) {
+			s.base_tick = 0;
+			s.base_ns = s.real_ns;
+			s.running = true;
+		}
+		log << (timer ? "queue start" : "start");
+		break;
+	case SND_SEQ_EVENT_CONTINUE:
+		if ( timer )
+			s.running = true;
+		log << (timer ? "queue continue" : "continue");
+		break;
+	case SND_SEQ_EVENT_STOP:
+		if ( timer )
+			s.running = false;
+		log << (timer ? "queue stop" : "stop");
+		break;
+	case SND_SEQ_EVENT_CLOCK:
+		log << "clock";
+		break;
+	case SND_SEQ_EVENT_SONGPOS:
+		log << "position " << ev.data.control.value;
+		break;
+	case SND_SEQ_EVENT_QFRAME:
+		log << "quarter frame " << hex( ev.data.control.value );
+		break;
+	default:
+		log << "event " << ev.type;
+		break;
+	}
+	log << '\n';
+	s.events ++;
+}	// end sim_play
+
+// what is queued and not yet played goes, as with snd_seq_drop_output()
+void MidiPlayer::sim_drop()
+{
+	Sim &s = sim;
+	s.ticked.clear();
+	s.timed.clear();
+	s.next_ticked = s.next_timed = 0;
+}
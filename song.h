@@ -0,0 +1,130 @@
+#ifndef SONG_H
+#define SONG_H
+
+#include <QtGlobal>
+#include <QByteArray>
+#include <QSharedPointer>
+#include <QVector>
+#include <QHash>
+#include <string.h>
+#include <limits.h>
+
+#include <alsa/asoundlib.h>
+
+#include "chunked_list.h"
+#include "arena.h"
+#include "event_list.h"
+#include "tempo_map.h"
+
+// Everything parseFile() makes of a file.  Nothing changes it once it is
+// loaded, so any number of players can play one copy at the same time,
+// each from its own position on its own queue; see SongPtr.
+struct Song
+{
+	struct event {
+		unsigned char type;		// SND_SEQ_EVENT_xxx
+		unsigned char port;		// port index, generally not used
+		quint16 track;			// index of the MTrk chunk
+		qint64 tick;
+		union {
+			unsigned char d[3];	// channel and data bytes
+			int tempo;
+			unsigned int length;	// length of sysex data
+		} data;
+		const unsigned char *sysex;	// payload, in the song arena
+	};  // end struct event definition
+
+	ChunkedList<event> all_events;	// decoded, in tick order
+	Arena arena;			// payloads of the events, see intern_sysex()
+	qint64 sysex_bytes;		// in the SysEx events
+	qint64 sysex_shared;		// of those, in payloads stored for an earlier event
+
+	// ready-to-send form of all_events, see MidiPlayer::compile_events()
+	EventList compiled;		// with the track of each
+	QByteArray wire;		// MIDI bytes of every channel event, full status;
+					// SysEx is sent from its payload
+	ChunkedList<int> wire_index;	// start of each event in wire, plus the end
+
+	// every note from its note-on to its release, see index_notes()
+	struct note {
+		qint64 on, off;			// ticks
+		quint16 track;
+		unsigned char channel, key, velocity;
+	};
+	ChunkedList<note> notes;	// in note-on order
+	ChunkedList<qint64> note_reach;	// latest off of each subtree, see sounding()
+
+	// note density per key for the piano roll, see build_roll(): level 0
+	// has cells of roll_bucket ticks, each level above half as many of
+	// twice the length.  A cell holds how much of its time the key
+	// sounds, 0 = never, 255 = all of it.
+	qint64 roll_bucket;
+	QVector<QByteArray> roll;	// [level][cell * 128 + key]
+
+	int tracks;
+	int format;
+	int division;			// as in the header, SMPTE or not
+	QVector<quint64> track_hash;	// of each MTrk chunk, see hash()
+	double PPQ;
+	unsigned initial_tempo;		// usec per quarter at tick 0
+	double BPM;			// while parsing: of the tempo in effect
+	int sf;				// key signature: sharps/flats
+	bool minor_key;
+	qint64 last_tick;
+	double length_seconds;
+	TempoMap tempo_map;		// of the compiled events, see build_tempo_map()
+
+	Song() : sysex_bytes(0), sysex_shared(0), roll_bucket(1), tracks(0), format(0), division(0), PPQ(96), initial_tempo(500000), BPM(120), sf(0),
+		minor_key(false), last_tick(0), length_seconds(0) {}
+
+	// index of the first compiled event at or after tick
+	qint64 find_tick( qint64 tick ) const { return compiled.find_tick( tick ); }
+
+	// pair the note-ons and note-offs of all_events into notes; see notes.cpp
+	void index_notes();
+	// the notes sounding at tick, on <= tick < off, in note-on order
+	void sounding( qint64 tick, QVector<qint64> &found ) const;
+	// those sounding anywhere in [from, to); false if there are more than
+	// limit, found then holds some of them
+	bool overlapping( qint64 from, qint64 to, QVector<qint64> &found, int limit = INT_MAX ) const;
+	void build_roll();
+	// the tempo changes of compiled, for tick and time lookups
+	void build_tempo_map();
+
+	// cheap enough to run over every chunk on each load, good enough to
+	// tell which tracks a save changed; see MidiPlayer::reloadFile()
+	static quint64 hash( const unsigned char *p, qint64 len ) {
+		quint64 h = 0x9E3779B97F4A7C15ULL ^ static_cast<quint64>(len);
+		qint64 n = 0;
+		for ( ; n + 8 <= len; n += 8 ) {
+			quint64 w;
+			memcpy( &w, p + n, 8 );
+			h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+			h ^= h >> 32;
+		}
+		for ( ; n < len; ++ n )
+			h = (h ^ p[n]) * 0x100000001B3ULL;
+		return h;
+	}
+
+	// the arena copy of a SysEx payload, a 0xF0 if f0 and n bytes from src,
+	// shared by every event with the same bytes; see file_parser.cpp
+	const unsigned char *intern_sysex( bool f0, const unsigned char *src, unsigned n );
+	// compact storage: the compiled events packed, and what only loading
+	// and reloading use let go; no wire bytes either
+	void pack();
+
+private:
+	struct payload {
+		const unsigned char *data;
+		unsigned length;
+	};
+	QHash<quint64, payload> sysex_pool;	// by hash() of the bytes after a 0xF0
+
+	Song( const Song & );
+	Song &operator=( const Song & );
+};
+
+typedef QSharedPointer<const Song> SongPtr;
+
+#endif // SONG_H
@@ -0,0 +1,232 @@
+// sync.cpp   -- part of MIDI_PLAYER
+// timing messages for the destination to follow the song by: MIDI Clock,
+// 24 to the quarter note, with Start, Stop, Continue and Song Position
+// Pointer, and MIDI Time Code quarter frames with a full frame at every
+// jump.  The seq engine puts them on the song's queue as it pumps the
+// song: the clocks at their ticks, so the tempo map and the speed move
+// them like any note; the quarter frames at the queue's real time, which
+// the speed moves too.  Either is chosen per destination port, see
+// setSync(); with neither the engine sends nothing more.
+// contains:
+//      sync_begin()
+//      sync_locate()
+//      sync_until()
+//      sync_tempo()
+//      sync_ns()
+//      sync_jump()
+//      sync_end()
+//      sync_stop()
+//      sync_output()
+
+#include "playerwindow.h"	// hack!
+#include "player.h"
+
+#define NSEC_PER_SEC 1000000000LL
+#define CLOCKS_PER_QUARTER 24
+// a song position counts sixteenths
+#define CLOCKS_PER_SPP 6
+#define SPP_MAX 0x3FFF
+// 25 frames per second, MTC rate code 1
+#define MTC_FPS 25
+#define MTC_RATE 1
+#define MTC_QUARTER_NS (NSEC_PER_SEC / (MTC_FPS * 4))
+
+// hours, minutes, seconds and frames of song time ns
+static void timecode( qint64 ns, int tc[4] )
+{
+	qint64 frames = ns * MTC_FPS / NSEC_PER_SEC;
+	tc[0] = frames / (MTC_FPS * 3600) % 24;
+	tc[1] = frames / (MTC_FPS * 60) % 60;
+	tc[2] = frames / MTC_FPS % 60;
+	tc[3] = frames % MTC_FPS;
+}
+
+// The engine picks the song up at cur.pos, queue tick cur.sent_tick.  The
+// flags are taken for the whole play.  From the top the queue's real time
+// starts with it; elsewhere it carries on from the pause, where the queue
+// tells how far apart the two times are.
+void MidiPlayer::sync_begin()
+{
+	Cursor &c = cur;
+	c.sync = sync_out;
+	if ( !c.sync )
+		return;
+	c.anchor_tick = c.pos;
+	c.anchor_ns = play_song->tempo_map.ns( c.pos );
+	c.sync_real = 0;
+	if ( c.pos > 0 ) {
+		qint64 real;
+		qint64 at = queue_tick( &real ) - c.offset;
+		c.sync_real = real - sync_ns( at );
+	}
+	sync_locate( c.pos );
+	qDebug() << "Sync:" << (c.sync & SYNC_CLOCK ? "MIDI Clock" : "") << (c.sync & SYNC_MTC ? "MTC" : "")
+			 << "from tick" << c.pos;
+}
+
+// tell the destination where the song is, at song tick: a Start from the
+// top, else a Stop and the Song Position Pointer, and a Continue on the
+// first clock of the next sixteenth; the time code in full
+void MidiPlayer::sync_locate( qint64 tick )
+{
+	Cursor &c = cur;
+	snd_seq_event_t ev;
+	qint64 at = tick + c.offset;
+	if ( c.sync & SYNC_CLOCK ) {
+		qint64 ppq = static_cast<qint64>(play_song->PPQ);
+		qint64 spp = (tick * 4 + ppq - 1) / ppq;
+		snd_seq_ev_clear(&ev);
+		snd_seq_ev_schedule_tick(&ev, queue, 0, at);
+		if ( spp == 0 ) {
+			ev.type = SND_SEQ_EVENT_START;
+			sync_output( ev );
+		} else {
+			ev.type = SND_SEQ_EVENT_STOP;
+			sync_output( ev );
+			if ( spp <= SPP_MAX ) {
+				ev.type = SND_SEQ_EVENT_SONGPOS;
+				ev.data.control.value = spp;
+				sync_output( ev );
+			}
+		}
+		c.next_clock = spp * CLOCKS_PER_SPP;
+		c.resume_clock = spp > 0;
+	}
+	if ( c.sync & SYNC_MTC ) {
+		int tc[4];
+		timecode( c.anchor_ns, tc );
+		unsigned char full[10] = { 0xF0, 0x7F, 0x7F, 0x01, 0x01,
+			static_cast<unsigned char>(MTC_RATE << 5 | tc[0]), static_cast<unsigned char>(tc[1]),
+			static_cast<unsigned char>(tc[2]), static_cast<unsigned char>(tc[3]), 0xF7 };
+		snd_seq_ev_clear(&ev);
+		snd_seq_ev_set_sysex(&ev, sizeof(full), full);
+		snd_seq_ev_schedule_tick(&ev, queue, 0, at);
+		sync_output( ev );
+		c.next_quarter = (c.anchor_ns + MTC_QUARTER_NS - 1) / MTC_QUARTER_NS;
+	}
+}	// end sync_locate
+
+// queue the clocks and quarter frames before song tick end; up to the next
+// event the tempo is the cursor's
+void MidiPlayer::sync_until( qint64 end )
+{
+	Cursor &c = cur;
+	snd_seq_event_t ev;
+	if ( c.sync & SYNC_CLOCK ) {
+		qint64 ppq = static_cast<qint64>(play_song->PPQ);
+		for ( ; ; ++ c.next_clock ) {
+			qint64 tick = c.next_clock * ppq / CLOCKS_PER_QUARTER;
+			if ( tick >= end )
+				break;
+			snd_seq_ev_clear(&ev);
+			snd_seq_ev_schedule_tick(&ev, queue, 0, tick + c.offset);
+			if ( c.resume_clock ) {
+				ev.type = SND_SEQ_EVENT_CONTINUE;
+				sync_output( ev );
+				c.resume_clock = false;
+			}
+			ev.type = SND_SEQ_EVENT_CLOCK;
+			sync_output( ev );
+		}
+	}
+	if ( c.sync & SYNC_MTC ) {
+		qint64 end_ns = sync_ns( end );
+		for ( ; c.next_quarter * MTC_QUARTER_NS < end_ns; ++ c.next_quarter ) {
+			// eight pieces carry the time of the frame the first went out in
+			int piece = c.next_quarter & 7;
+			int tc[4];
+			timecode( (c.next_quarter - piece) * MTC_QUARTER_NS, tc );
+			int nibble;
+			switch ( piece ) {
+			case 0: nibble = tc[3] & 0xF; break;
+			case 1: nibble = tc[3] >> 4; break;
+			case 2: nibble = tc[2] & 0xF; break;
+			case 3: nibble = tc[2] >> 4; break;
+			case 4: nibble = tc[1] & 0xF; break;
+			case 5: nibble = tc[1] >> 4; break;
+			case 6: nibble = tc[0] & 0xF; break;
+			default: nibble = MTC_RATE << 1 | tc[0] >> 4; break;
+			}
+			qint64 real = qMax( 0LL, c.next_quarter * MTC_QUARTER_NS + c.sync_real );
+			snd_seq_real_time_t rt;
+			rt.tv_sec = real / NSEC_PER_SEC;
+			rt.tv_nsec = real % NSEC_PER_SEC;
+			snd_seq_ev_clear(&ev);
+			ev.type = SND_SEQ_EVENT_QFRAME;
+			ev.data.control.value = piece << 4 | nibble;
+			snd_seq_ev_schedule_real(&ev, queue, 0, &rt);
+			sync_output( ev );
+		}
+	}
+}	// end sync_until
+
+// a tempo change at song tick: song time goes on from there at the new rate
+void MidiPlayer::sync_tempo( qint64 tick )
+{
+	Cursor &c = cur;
+	if ( !c.sync )
+		return;
+	c.anchor_ns = sync_ns( tick );
+	c.anchor_tick = tick;
+}
+
+// song time of a song tick at the cursor's tempo
+qint64 MidiPlayer::sync_ns( qint64 tick )
+{
+	Cursor &c = cur;
+	return c.anchor_ns + (tick - c.anchor_tick) * c.tempo * 1000 / static_cast<qint64>(play_song->PPQ);
+}
+
+// The song goes on at song tick to, at the queue time song time left_ns was
+// due: a loop wrap, or a reloaded song that may have another tempo map.
+// locate for a jump the destination has to be told of.
+void MidiPlayer::sync_jump( qint64 left_ns, qint64 to, bool locate )
+{
+	Cursor &c = cur;
+	if ( !c.sync )
+		return;
+	c.anchor_tick = to;
+	c.anchor_ns = play_song->tempo_map.ns( to );
+	c.sync_real += left_ns - c.anchor_ns;
+	if ( locate )
+		sync_locate( to );
+	else if ( c.sync & SYNC_MTC )
+		c.next_quarter = (c.anchor_ns + MTC_QUARTER_NS - 1) / MTC_QUARTER_NS;
+}
+
+// the end of the song at song tick end: the last clocks and a Stop
+void MidiPlayer::sync_end( qint64 end )
+{
+	Cursor &c = cur;
+	if ( !c.sync )
+		return;
+	sync_until( end );
+	if ( c.sync & SYNC_CLOCK ) {
+		snd_seq_event_t ev;
+		snd_seq_ev_clear(&ev);
+		ev.type = SND_SEQ_EVENT_STOP;
+		snd_seq_ev_schedule_tick(&ev, queue, 0, end + c.offset);
+		sync_output( ev );
+	}
+}
+
+// stopped or paused by the user: a Stop right away, the queued clocks are gone
+void MidiPlayer::sync_stop()
+{
+	if ( !seq || port_index < 0 || !(sync_out & SYNC_CLOCK) )
+		return;
+	snd_seq_event_t ev;
+	snd_seq_ev_clear(&ev);
+	ev.type = SND_SEQ_EVENT_STOP;
+	ev.dest = port;
+	snd_seq_ev_set_direct(&ev);
+	int err = snd_seq_event_output_direct(seq, &ev);
+	check_snd("output event", err);
+}
+
+void MidiPlayer::sync_output( snd_seq_event_t &ev )
+{
+	ev.dest = port;
+	int err = seq_output(ev);
+	check_snd("output event", err);
+}
@@ -0,0 +1,72 @@
+#ifndef TEMPO_MAP_H
+#define TEMPO_MAP_H
+
+#include <QtGlobal>
+#include <QVector>
+#include <algorithm>
+
+// Song time against ticks along the tempo changes of a song, at normal
+// speed.  Built once in tick order; every lookup after that is a binary
+// search over the changes instead of a walk over the events.
+class TempoMap
+{
+public:
+	struct Change {
+		qint64 tick;
+		double usec;		// song time at tick
+		unsigned tempo;		// usec per quarter from tick on
+	};
+
+	TempoMap() { clear( 500000, 96 ); }
+
+	void clear( unsigned initial_tempo, qint64 ppq ) {
+		this->ppq = qMax( static_cast<qint64>(1), ppq );
+		Change c = { 0, 0, initial_tempo };
+		changes.clear();
+		changes << c;
+	}
+
+	// the next change, at or after the last one; the last of several at
+	// one tick wins, a tempo of 0 is no change
+	void append( qint64 tick, unsigned tempo ) {
+		Change &last = changes.last();
+		if ( !tempo || tick < last.tick )
+			return;
+		if ( tick == last.tick ) {
+			last.tempo = tempo;
+			return;
+		}
+		Change c = { tick, usec(tick), tempo };
+		changes << c;
+	}
+
+	double usec( qint64 tick ) const {
+		const Change &c = at_tick( tick );
+		return c.usec + static_cast<double>( tick - c.tick ) * c.tempo / ppq;
+	}
+	qint64 ns( qint64 tick ) const {
+		return static_cast<qint64>( usec(tick) * 1000 );
+	}
+	qint64 tick( double usec ) const {
+		const Change *c = std::upper_bound( changes.constBegin(), changes.constEnd(), usec, usec_order );
+		const Change &from = c == changes.constBegin() ? *c : *(c - 1);
+		return from.tick + static_cast<qint64>( (usec - from.usec) * ppq / from.tempo );
+	}
+	unsigned tempo( qint64 tick ) const {
+		return at_tick( tick ).tempo;
+	}
+
+	QVector<Change> changes;	// the first at tick 0, the initial tempo
+
+private:
+	qint64 ppq;
+
+	const Change &at_tick( qint64 tick ) const {
+		const Change *c = std::upper_bound( changes.constBegin(), changes.constEnd(), tick, tick_order );
+		return c == changes.constBegin() ? *c : *(c - 1);
+	}
+	static bool tick_order( qint64 tick, const Change &c ) { return tick < c.tick; }
+	static bool usec_order( double usec, const Change &c ) { return usec < c.usec; }
+};
+
+#endif // TEMPO_MAP_H
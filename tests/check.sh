@@ -0,0 +1,49 @@
+#!/bin/sh
+# check.sh   -- part of MIDI_PLAYER
+# plays the songs here through the seq engine on a virtual clock
+# (MIDI_PLAYER --simulate) and compares what the queue would play with the
+# logs kept beside them.  Run by "make check"; UPDATE=1 writes the logs
+# afresh after a change that is meant to alter them.
+# While a file PROVISIONAL sits here the logs were not written by a real
+# build of MIDI_PLAYER, and a pass proves little; UPDATE=1 from a real
+# build replaces them and removes it.
+# usage: check.sh path/to/MIDI_PLAYER
+
+player=$1
+dir=$(dirname "$0")
+[ -x "$player" ] || { echo "usage: $0 path/to/MIDI_PLAYER" >&2; exit 2; }
+
+# no display needed, and none of the user's settings
+QT_QPA_PLATFORM=offscreen
+XDG_CONFIG_HOME=$(mktemp -d)
+export QT_QPA_PLATFORM XDG_CONFIG_HOME
+trap 'rm -rf "$XDG_CONFIG_HOME"' EXIT
+
+failed=0
+# name song [ms:step ...]
+run() {
+	name=$1
+	song=$2
+	shift 2
+	if [ -n "$UPDATE" ]; then
+		"$player" --simulate "$dir/$song" "$@" > "$dir/$name.log" 2>/dev/null
+		echo "wrote $name.log"
+	elif "$player" --simulate "$dir/$song" "$@" 2>/dev/null | diff -u "$dir/$name.log" - > /dev/null; then
+		echo "PASS $name"
+	else
+		echo "FAIL $name"
+		"$player" --simulate "$dir/$song" "$@" 2>/dev/null | diff -u "$dir/$name.log" - | head -20
+		failed=1
+	fi
+}
+
+run loop-transport loop.mid 1000:pause 1500:resume 2500:seek=960 4000:speed=1.5
+run loop-wrap loop.mid 0:loop=1920-5760 9000:loop=0-0
+run sx sx.mid
+
+if [ -n "$UPDATE" ]; then
+	rm -f "$dir/PROVISIONAL"
+elif [ -e "$dir/PROVISIONAL" ]; then
+	echo "NOTE the logs are provisional, see $dir/PROVISIONAL"
+fi
+exit $failed